@@ -0,0 +1,503 @@
+#include "bench.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string.h>
+#include "checksumindex.h"
+#include "fileio.h"
+#include "uringfile.h"
+#include "multipart.h"
+#ifdef __linux__
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+using namespace TdmSync;
+
+static double getWallTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void benchmarkLookup(const std::vector<int64_t> &blockCounts, int64_t queries) {
+    static const ChecksumLookup Lookups[] = {clPhf, clBinsearch, clBuckets};
+    static const char *LookupNames[] = {"phf", "binsearch", "buckets"};
+    //PHF construction often fails and retries on large inputs: with 2M blocks it takes minutes
+    static const int64_t PhfMaxBlocks = 1 << 20;
+
+    std::mt19937 rnd;
+    printf("%10s  %-10s  %10s  %12s  %12s\n", "blocks", "lookup", "build sec", "bytes/block", "ns/window");
+    for (int64_t num : blockCounts) {
+        //checksums of blocks: random values (as polyhash produces)
+        std::vector<uint32_t> checksums(num);
+        for (int64_t i = 0; i < num; i++)
+            checksums[i] = rnd() & 0x7FFFFFFF;
+        std::sort(checksums.begin(), checksums.end());
+
+        //checksums of windows: mostly misses, one in 64 windows hits some block
+        std::vector<uint32_t> digests(queries);
+        for (int64_t k = 0; k < queries; k++)
+            digests[k] = (rnd() % 64 == 0 && num > 0 ? checksums[rnd() % num] : rnd() & 0x7FFFFFFF);
+
+        for (int t = 0; t < 3; t++) {
+            if (Lookups[t] == clPhf && num > PhfMaxBlocks) {
+                printf("%10" PRId64 "  %-10s  skipped (construction is too slow)\n", num, LookupNames[t]);
+                continue;
+            }
+
+            double buildStart = getWallTime();
+            ChecksumIndex index;
+            index.create(Lookups[t], std::vector<uint32_t>(checksums));
+            double buildTime = getWallTime() - buildStart;
+
+            //same access pattern as scanning local file: lookup a batch of windows, then check hits
+            static const int64_t BatchWindows = 1 << 18;
+            static const int64_t PrefetchDistance = 16;
+            std::vector<uint32_t> indices(BatchWindows);
+            int64_t hits = 0;
+            double lookupStart = getWallTime();
+            for (int64_t from = 0; from < queries; from += BatchWindows) {
+                int64_t cnt = std::min(BatchWindows, queries - from);
+                const uint32_t *batch = digests.data() + from;
+                index.findMany(batch, indices.data(), cnt);
+                for (int64_t k = 0; k < cnt; k++) {
+                    if (k + PrefetchDistance < cnt && indices[k + PrefetchDistance] < num)
+                        TDM_PREFETCH(&index.checksums[indices[k + PrefetchDistance]]);
+                    if (indices[k] < num && index.checksums[indices[k]] == batch[k])
+                        hits++;
+                }
+            }
+            double lookupTime = getWallTime() - lookupStart;
+
+            printf("%10" PRId64 "  %-10s  %10.2lf  %12.1lf  %12.2lf    (%" PRId64 " hits)\n",
+                num, LookupNames[t], buildTime, double(index.memoryUsage()) / std::max(num, int64_t(1)),
+                lookupTime / queries * 1e+9, hits
+            );
+        }
+    }
+}
+//==================================================================
+
+namespace {
+
+//one remote file together with an outdated local copy of it
+//(and optionally another local file with parts of remote file, used as additional source of blocks)
+struct StressCase {
+    std::vector<uint8_t> remote, local, extra;
+    int blockSize = 0;
+    MetaFormat format;
+    ScanMode mode = smExhaustive;
+    FileInfo info;
+    UpdatePlan plan;        //computed sequentially (before any concurrency)
+};
+
+//random data with repeated fragments (so that some blocks occur several times)
+std::vector<uint8_t> generateData(std::mt19937 &rnd, size_t size) {
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = uint8_t(rnd() % 4 ? rnd() : 0);
+    for (int t = rnd() % 8; t > 0 && size > 0; t--) {
+        size_t len = rnd() % std::min(size, size_t(20000)) + 1;
+        size_t src = rnd() % (size - len + 1), dst = rnd() % (size - len + 1);
+        memmove(&data[dst], &data[src], len);
+    }
+    return data;
+}
+
+//apply random edits: insert random bytes, delete range, duplicate range
+std::vector<uint8_t> mutateData(std::mt19937 &rnd, std::vector<uint8_t> data) {
+    for (int t = rnd() % 20; t > 0; t--) {
+        size_t pos = rnd() % (data.size() + 1);
+        size_t len = rnd() % 5000 + 1;
+        int type = rnd() % 3;
+        if (type == 0) {
+            std::vector<uint8_t> added = generateData(rnd, len);
+            data.insert(data.begin() + pos, added.begin(), added.end());
+        }
+        else if (type == 1) {
+            len = std::min(len, data.size() - pos);
+            data.erase(data.begin() + pos, data.begin() + pos + len);
+        }
+        else if (data.size() > 0) {
+            size_t src = rnd() % data.size();
+            len = std::min(len, data.size() - src);
+            std::vector<uint8_t> copied(data.begin() + src, data.begin() + src + len);
+            data.insert(data.begin() + pos, copied.begin(), copied.end());
+        }
+    }
+    return data;
+}
+
+bool sameInfos(const FileInfo &a, const FileInfo &b) {
+    if (a.fileSize != b.fileSize || a.blockSize != b.blockSize || a.blocks.size() != b.blocks.size())
+        return false;
+    return a.blocks.empty() || memcmp(a.blocks.data(), b.blocks.data(), a.blocks.size() * sizeof(BlockInfo)) == 0;
+}
+
+bool samePlans(const UpdatePlan &a, const UpdatePlan &b) {
+    if (a.bytesLocal != b.bytesLocal || a.bytesRemote != b.bytesRemote || a.segments.size() != b.segments.size())
+        return false;
+    for (size_t i = 0; i < a.segments.size(); i++) {
+        const SegmentUse &x = a.segments[i], &y = b.segments[i];
+        if (x.dstOffset != y.dstOffset || x.srcOffset != y.srcOffset || x.size != y.size || x.remote != y.remote || x.source != y.source)
+            return false;
+    }
+    return true;
+}
+
+//checks one case: recomputes metainfo and plan, then applies the plan
+//returns empty string on success, description of problem otherwise
+std::string runStressJob(const StressCase &sc, std::mt19937 &rnd) {
+    static const ChecksumLookup Lookups[] = {clAuto, clPhf, clBinsearch, clBuckets};
+    int threadsNum = rnd() % 2 + 1;
+    ChecksumLookup lookup = Lookups[rnd() % 4];
+
+    MemoryFile remoteFile(sc.remote), localFile(sc.local), extraFile(sc.extra);
+    FileInfo info;
+    info.computeFromFile(remoteFile, sc.blockSize, threadsNum, sc.format);
+    if (!sameInfos(info, sc.info))
+        return "metainfo differs";
+
+    std::vector<BaseFile*> localFiles = {&localFile, &extraFile};
+    UpdatePlan plan = sc.info.createUpdatePlan(localFiles, threadsNum, lookup, sc.mode);
+    if (!samePlans(plan, sc.plan))
+        return "plan differs (lookup " + std::to_string(int(lookup)) + ")";
+
+    MemoryFile downloadFile, resultFile;
+    plan.createDownloadFile(remoteFile, downloadFile);
+    plan.apply(localFiles, downloadFile, resultFile);
+    if (resultFile.contents != sc.remote)
+        return "patched file differs from remote";
+
+    if (plan.inPlaceFeasible) {
+        MemoryFile inPlaceFile(sc.local);
+        localFiles[0] = &inPlaceFile;
+        plan.applyInPlace(localFiles, [&](BaseFile &sink) {
+            plan.createDownloadFile(remoteFile, sink);
+        });
+        if (inPlaceFile.contents != sc.remote)
+            return "file patched in place differs from remote";
+    }
+
+    //coalesced plan must remain valid
+    RangeCostModel model;
+    model.rangeOverhead = rnd() % 20000;
+    UpdatePlan coalesced = plan;
+    coalesced.coalesceRemote(model);
+    localFiles[0] = &localFile;
+    MemoryFile coalescedDownload, coalescedResult;
+    coalesced.createDownloadFile(remoteFile, coalescedDownload);
+    coalesced.apply(localFiles, coalescedDownload, coalescedResult);
+    if (coalescedResult.contents != sc.remote)
+        return "file patched with coalesced plan differs from remote";
+    return "";
+}
+
+}
+
+bool stressConcurrentPlans(int filesNum, int rounds, int threadsNum) {
+    static const int BlockSizes[] = {64, 96, 256, 1024, 2048, 4096};
+    std::mt19937 rnd;
+
+    double prepareStart = getWallTime();
+    std::vector<StressCase> cases(filesNum);
+    for (StressCase &sc : cases) {
+        sc.remote = generateData(rnd, rnd() % 2000000);
+        sc.local = mutateData(rnd, sc.remote);
+        sc.blockSize = BlockSizes[rnd() % 6];
+        if (rnd() % 2)
+            sc.format = MetaFormat::compact();
+        sc.format.strongHash = StrongHash(rnd() % 2);
+        sc.format.rollingHash = RollingHash(rnd() % 2);
+        if (rnd() % 2) {
+            sc.format.sequentialMatch = true;
+            sc.format.checksumBytes = MetaFormat::CHECKSUM_BYTES_AUTO;
+        }
+        sc.mode = ScanMode(rnd() % 3);
+        if (rnd() % 2)
+            sc.extra = mutateData(rnd, sc.remote);
+        MemoryFile remoteFile(sc.remote), localFile(sc.local), extraFile(sc.extra);
+        std::vector<BaseFile*> localFiles = {&localFile, &extraFile};
+        sc.info.computeFromFile(remoteFile, sc.blockSize, 1, sc.format);
+        sc.plan = sc.info.createUpdatePlan(localFiles, 1, clAuto, sc.mode);
+    }
+    printf("Prepared %d files in %0.2lf sec\n", filesNum, getWallTime() - prepareStart);
+
+    //every thread takes next job (case and round) until all are done
+    //note: every job runs scan with 1 or 2 threads of its own, so there are even more threads in total
+    int jobsNum = filesNum * rounds;
+    std::atomic<int> nextJob(0), failures(0);
+    std::mutex printMutex;
+    double runStart = getWallTime();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadsNum; t++) {
+        threads.emplace_back([&]() {
+            for (int job; (job = nextJob++) < jobsNum; ) {
+                const StressCase &sc = cases[job % filesNum];
+                std::mt19937 jobRnd(job);
+                std::string error;
+                try {
+                    error = runStressJob(sc, jobRnd);
+                }
+                catch(const std::exception &e) {
+                    error = std::string("exception: ") + e.what();
+                }
+                if (!error.empty()) {
+                    failures++;
+                    std::lock_guard<std::mutex> lock(printMutex);
+                    printf("Job %d (file %d, block size %d): %s\n", job, job % filesNum, sc.blockSize, error.c_str());
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    printf("Finished %d jobs on %d threads in %0.2lf sec: %d failed\n", jobsNum, threadsNum, getWallTime() - runStart, int(failures));
+    return failures == 0;
+}
+
+bool checkSequentialMatch() {
+    static const int BlockSizes[] = {256, 1024, 4096};
+    static const char *EditNames[] = {"overwrite", "insert", "delete"};
+    static const char *ModeNames[] = {"exhaustive", "skip", "aligned"};
+    static const char *PlaceNames[] = {"in the middle", "after chunk boundary"};
+    //local file is scanned in chunks of this size (see createUpdatePlan)
+    static const size_t ChunkBytes = 4 << 20;
+    std::mt19937 rnd;
+    int failures = 0;
+
+    for (int blockSize : BlockSizes) for (int place = 0; place < 2; place++) {
+        for (int edit = 0; edit < 3; edit++) {
+            //random file without repeated fragments, changed in the middle (not at block boundary)
+            //or right after the block starting at chunk boundary, so that its previous block is in another chunk
+            std::vector<uint8_t> remote(place == 0 ? 1 << 20 : ChunkBytes + (1 << 20));
+            for (uint8_t &byte : remote)
+                byte = uint8_t(rnd());
+            std::vector<uint8_t> local = remote;
+            size_t pos = (place == 0 ? remote.size() / 2 : ChunkBytes + blockSize) + blockSize / 3;
+            size_t len = blockSize / 5 + 1;
+            if (edit == 0) {
+                for (size_t i = pos; i < pos + len; i++)
+                    local[i] ^= 0x5A;
+            }
+            else if (edit == 1) {
+                std::vector<uint8_t> added(len, 0x5A);
+                local.insert(local.begin() + pos, added.begin(), added.end());
+            }
+            else {
+                local.erase(local.begin() + pos, local.begin() + pos + len);
+            }
+
+            MetaFormat sequentialFormat;
+            sequentialFormat.sequentialMatch = true;
+            sequentialFormat.checksumBytes = MetaFormat::CHECKSUM_BYTES_AUTO;
+            MemoryFile remoteFile(remote), localFile(local);
+            std::vector<BaseFile*> localFiles = {&localFile};
+            FileInfo info, sequentialInfo;
+            info.computeFromFile(remoteFile, blockSize, 1);
+            remoteFile.seek(0);
+            sequentialInfo.computeFromFile(remoteFile, blockSize, 1, sequentialFormat);
+
+            for (int mode = 0; mode < 3; mode++) {
+                localFile.seek(0);
+                UpdatePlan plan = info.createUpdatePlan(localFiles, 1, clAuto, ScanMode(mode));
+                localFile.seek(0);
+                UpdatePlan sequentialPlan = sequentialInfo.createUpdatePlan(localFiles, 1, clAuto, ScanMode(mode));
+                MemoryFile downloadFile, resultFile;
+                remoteFile.seek(0);
+                localFile.seek(0);
+                sequentialPlan.createDownloadFile(remoteFile, downloadFile);
+                sequentialPlan.apply(localFiles, downloadFile, resultFile);
+
+                //only blocks touching the change must be downloaded, same as without sequential matching
+                //note: the last block before the change and the first block after it must be found too
+                bool ok = (resultFile.contents == remote && sequentialPlan.bytesRemote < plan.bytesRemote + blockSize);
+                printf("Block size %d, %s %s, %s: remote %" PRId64 " bytes (%" PRId64 " without sequential matching)%s\n",
+                    blockSize, EditNames[edit], PlaceNames[place], ModeNames[mode], sequentialPlan.bytesRemote, plan.bytesRemote, ok ? "" : ": FAILED");
+                if (!ok)
+                    failures++;
+            }
+        }
+    }
+    return failures == 0;
+}
+//==================================================================
+
+namespace {
+
+//evicts file data from OS page cache, so that the next access reads it from disk
+//returns false if it is not possible (then benchmark measures warm cache)
+bool dropFileCache(const std::string &filename) {
+#ifdef __linux__
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    //note: dirty pages are not evicted, so they must be written first
+    fdatasync(fd);
+    int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return err == 0;
+#else
+    return false;
+#endif
+}
+
+std::unique_ptr<BaseFile> openBenchFile(const std::string &filename, bool uring, bool write) {
+    if (uring) {
+        std::unique_ptr<UringFile> file(new UringFile());
+        file->open(filename.c_str(), write ? UringFile::Write : UringFile::Read);
+        return std::unique_ptr<BaseFile>(std::move(file));
+    }
+    std::unique_ptr<StdioFile> file(new StdioFile());
+    file->open(filename.c_str(), write ? StdioFile::Write : StdioFile::Read);
+    return std::unique_ptr<BaseFile>(std::move(file));
+}
+
+}
+
+void benchmarkFileIO(const std::string &remoteFn, const std::string &localFn, int blockSize, int rounds) {
+    static const char *BackendNames[] = {"stdio", "uring"};
+    std::string downFn = localFn + ".benchio.download";
+    std::string resultFn = localFn + ".benchio";
+    bool uringSupported = UringFile::isSupported();
+    if (!uringSupported)
+        printf("io_uring is not supported: only stdio is measured\n");
+    if (!dropFileCache(remoteFn))
+        printf("Cannot drop page cache: measuring with warm cache\n");
+
+    printf("%-6s  %5s  %10s  %10s  %10s  %10s\n", "files", "round", "prepare", "plan", "apply", "total");
+    double sums[2][3] = {{0}};
+    for (int r = 0; r < rounds; r++) {
+        //backends alternate, so that both are equally affected by other activity on disk
+        for (int b = 0; b < 2; b++) {
+            bool uring = (b == 1);
+            if (uring && !uringSupported)
+                continue;
+            double times[3];
+
+            dropFileCache(remoteFn);
+            double startTime = getWallTime();
+            FileInfo info;
+            {
+                std::unique_ptr<BaseFile> remoteFile = openBenchFile(remoteFn, uring, false);
+                info.computeFromFile(*remoteFile, blockSize);
+            }
+            times[0] = getWallTime() - startTime;
+
+            dropFileCache(localFn);
+            startTime = getWallTime();
+            UpdatePlan plan;
+            {
+                std::unique_ptr<BaseFile> localFile = openBenchFile(localFn, uring, false);
+                plan = info.createUpdatePlan(*localFile);
+            }
+            times[1] = getWallTime() - startTime;
+
+            //download file is created beforehand: it is not measured
+            {
+                std::unique_ptr<BaseFile> remoteFile = openBenchFile(remoteFn, false, false);
+                std::unique_ptr<BaseFile> downloadFile = openBenchFile(downFn, false, true);
+                plan.createDownloadFile(*remoteFile, *downloadFile);
+            }
+            dropFileCache(localFn);
+            dropFileCache(downFn);
+            startTime = getWallTime();
+            {
+                std::unique_ptr<BaseFile> localFile = openBenchFile(localFn, uring, false);
+                std::unique_ptr<BaseFile> downloadFile = openBenchFile(downFn, uring, false);
+                std::unique_ptr<BaseFile> resultFile = openBenchFile(resultFn, uring, true);
+                plan.apply(*localFile, *downloadFile, *resultFile);
+                resultFile->flush();
+            }
+            times[2] = getWallTime() - startTime;
+            //writeback of result is not measured, but it must not slow down the next run
+            dropFileCache(resultFn);
+
+            printf("%-6s  %5d  %10.3lf  %10.3lf  %10.3lf  %10.3lf\n", BackendNames[b], r, times[0], times[1], times[2], times[0] + times[1] + times[2]);
+            for (int t = 0; t < 3; t++)
+                sums[b][t] += times[t];
+        }
+    }
+    for (int b = 0; b < 2; b++) {
+        if (b == 1 && !uringSupported)
+            continue;
+        printf("%-6s  %5s  %10.3lf  %10.3lf  %10.3lf  %10.3lf\n", BackendNames[b], "avg",
+            sums[b][0] / rounds, sums[b][1] / rounds, sums[b][2] / rounds, (sums[b][0] + sums[b][1] + sums[b][2]) / rounds
+        );
+    }
+    remove(downFn.c_str());
+    remove(resultFn.c_str());
+}
+//==================================================================
+
+void benchmarkMultipart(const std::vector<int> &partSizes, int64_t totalBytes, int chunkSize) {
+    //one response carries this much payload, it is parsed repeatedly until totalBytes are passed
+    static const int64_t ResponsePayload = 64 << 20;
+    static const char *Boundary = "3d6b6a416f9b5";
+
+    std::mt19937 rnd;
+    printf("%10s  %8s  %12s  %10s  %10s\n", "part size", "parts", "overhead %", "sec", "GB/s");
+    for (int partSize : partSizes) {
+        //requested ranges are separated by gaps of same size: part K holds remote bytes [2*K*partSize, (2*K+1)*partSize)
+        int64_t partsNum = std::max(ResponsePayload / partSize, int64_t(1));
+        int64_t payloadSize = partsNum * partSize;
+        int64_t remoteSize = 2 * payloadSize;
+        std::vector<char> payload(payloadSize);
+        for (char &c : payload)
+            c = char(rnd());
+
+        std::string body;
+        body.reserve(payloadSize + partsNum * 128 + 64);
+        char header[256];
+        for (int64_t k = 0; k < partsNum; k++) {
+            int64_t from = 2 * k * partSize;
+            sprintf(header, "\r\n--%s\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n",
+                Boundary, from, from + partSize - 1, remoteSize
+            );
+            body += header;
+            body.append(payload.data() + k * partSize, partSize);
+        }
+        body += std::string("\r\n--") + Boundary + "--\r\n";
+
+        //sink puts data where it belongs in downloaded data, like CurlDownloader::writeRemote
+        std::vector<char> downloaded(payloadSize);
+        MultipartParser::Sink sink = [&](int64_t offset, const char *data, size_t size) -> bool {
+            while (size > 0) {
+                int64_t k = offset / (2 * partSize);
+                int64_t inPart = offset - 2 * k * partSize;
+                if (k >= partsNum || inPart >= partSize)
+                    return false;
+                size_t chunk = size_t(std::min(int64_t(size), partSize - inPart));
+                memcpy(downloaded.data() + k * partSize + inPart, data, chunk);
+                offset += chunk;
+                data += chunk;
+                size -= chunk;
+            }
+            return true;
+        };
+
+        int64_t rounds = std::max((totalBytes + int64_t(body.size()) - 1) / int64_t(body.size()), int64_t(1));
+        bool ok = true;
+        double start = getWallTime();
+        for (int64_t r = 0; r < rounds && ok; r++) {
+            MultipartParser parser;
+            parser.startMultipart(Boundary);
+            for (size_t pos = 0; pos < body.size() && ok; pos += chunkSize)
+                ok = parser.feed(body.data() + pos, std::min(size_t(chunkSize), body.size() - pos), sink);
+            ok = ok && parser.isFinished();
+        }
+        double elapsed = getWallTime() - start;
+        ok = ok && memcmp(downloaded.data(), payload.data(), payloadSize) == 0;
+
+        printf("%10d  %8" PRId64 "  %12.1lf  %10.2lf  %10.2lf%s\n",
+            partSize, partsNum, 100.0 * (body.size() - payloadSize) / body.size(),
+            elapsed, rounds * body.size() / elapsed * 1e-9, ok ? "" : "    FAILED"
+        );
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef _TDM_BENCH_H_640173_
+#define _TDM_BENCH_H_640173_
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+//performance benchmarks and stress tests of tdmsync internals (invoked from command line)
+
+//compares checksum lookup structures (see TdmSync::ChecksumLookup) on random checksums
+//for every count in blockCounts: builds every structure and looks up "queries" random windows
+void benchmarkLookup(const std::vector<int64_t> &blockCounts, int64_t queries);
+
+//computes many update plans concurrently in one process (checks that library is reentrant)
+//generates filesNum random files with outdated copies, every file has its own block size and metainfo format
+//then "threadsNum" threads recompute metainfo and plan for every file "rounds" times and apply the plans
+//returns false if any result differs from the one computed sequentially
+bool stressConcurrentPlans(int filesNum, int rounds, int threadsNum);
+
+//checks that sequential matching (see TdmSync::MetaFormat::sequentialMatch) finds all unchanged blocks:
+//random file is changed in the middle (overwrite, insertion, deletion), and for every block size and scan mode
+//  the number of downloaded bytes must be less than one block more than without sequential matching
+//returns false if any check fails
+bool checkSequentialMatch();
+
+//compares file backends (StdioFile and UringFile) on cold cache: page cache is dropped before every step
+//measures computing metainfo of remote file, devising plan for local file, and applying the plan
+//files "localFn.benchio" and "localFn.benchio.download" are created and removed afterwards
+void benchmarkFileIO(const std::string &remoteFn, const std::string &localFn, int blockSize, int rounds);
+
+//measures throughput of multipart/byteranges parser (see TdmSync::MultipartParser) on synthetic in-memory response
+//for every part size in partSizes: parses "totalBytes" of response body fed in chunks of "chunkSize" bytes
+//payload is copied to its place in downloaded data (as CurlDownloader does), result is checked
+void benchmarkMultipart(const std::vector<int> &partSizes, int64_t totalBytes, int chunkSize);
+
+#endif
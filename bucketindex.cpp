@@ -0,0 +1,59 @@
+#include "bucketindex.h"
+#include <string.h>
+#include <random>
+#include <stdexcept>
+
+namespace TdmBucket {
+
+void BucketIndex::create(const Key *keys, size_t num) {
+    size_t unique = 0;
+    for (size_t i = 0; i < num; i++)
+        if (i == 0 || keys[i] != keys[i-1])
+            unique++;
+
+    //choose number of buckets: power-of-two, keep load factor at most 50%
+    //note: with higher load factor, too many buckets overflow
+    size_t logSize = 0;
+    while ((size_t(SLOTS) << logSize) < unique * 2)
+        logSize++;
+    size_t cells = size_t(1) << logSize;
+    mask = cells - 1;
+    shift = 64 - logSize;
+    if (logSize == 0)
+        shift = 63, mask = 0;   //note: shift by 64 is undefined
+
+    //note: keys are checksums, so their distribution is close to uniform
+    //multiplier is still randomized (with fixed seed) to mix bits well
+    std::mt19937_64 rnd;
+    mult = rnd() | 1;
+
+    static const size_t Alignment = 64;
+    memory.assign(cells * sizeof(Bucket) + Alignment, 0);
+    uintptr_t addr = uintptr_t(memory.data());
+    buckets = (Bucket*)((addr + Alignment - 1) / Alignment * Alignment);
+    for (size_t b = 0; b < cells; b++)
+        for (int s = 0; s < SLOTS; s++)
+            buckets[b].values[s] = NONE;
+
+    for (size_t i = 0; i < num; i++) {
+        if (i && keys[i] == keys[i-1])
+            continue;
+        if (i >= NONE)
+            throw std::runtime_error("BucketIndex: too many keys");
+        //linear probing over buckets: find first bucket with free slot
+        bool inserted = false;
+        for (size_t b = home(keys[i]); !inserted; b = (b + 1) & mask) {
+            Bucket &bucket = buckets[b];
+            for (int s = 0; s < SLOTS; s++) if (bucket.values[s] == NONE) {
+                bucket.keys[s] = keys[i];
+                bucket.values[s] = uint32_t(i);
+                inserted = true;
+                break;
+            }
+            if (!inserted)
+                bucket.values[SLOTS - 1] |= OVERFLOW_BIT;
+        }
+    }
+}
+
+}
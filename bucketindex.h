@@ -0,0 +1,96 @@
+#ifndef _TDM_BUCKETINDEX_H_572913_
+#define _TDM_BUCKETINDEX_H_572913_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "prefetch.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define TDM_BUCKET_SSE2
+    #include <emmintrin.h>
+#endif
+
+//tdmsync cache-conscious hash table
+namespace TdmBucket {
+
+//hash table from 32-bit keys to their indices in a sorted array
+//every bucket occupies one cache line and stores keys inline together with their values,
+//so a lookup (even an unsuccessful one) usually touches only one cache line
+//note: PHF touches two random cells and then the keys array, binary search touches log(N) cells
+struct BucketIndex {
+    typedef uint32_t Key;
+    //value returned for absent keys
+    static const uint32_t NONE = 0x7FFFFFFF;
+    //highest bit of last value in bucket: set if some keys of this bucket did not fit and went to next bucket
+    static const uint32_t OVERFLOW_BIT = 0x80000000U;
+    //number of keys in one bucket
+    static const int SLOTS = 8;
+
+    //note: slots are filled from the beginning, so empty slots are always at the end
+    //the first slot with key equal to the searched one contains the answer:
+    //either value of this key, or NONE if this slot is empty (key must be absent then)
+    struct Bucket {
+        Key keys[SLOTS];
+        uint32_t values[SLOTS];     //NONE for empty slot (last one can also have OVERFLOW_BIT)
+    };
+
+    size_t shift = 63, mask = 0;
+    //random odd multiplier for choosing bucket
+    uint64_t mult = 0;
+    //memory of buckets (with some padding to align buckets to cache lines)
+    std::vector<uint8_t> memory;
+    Bucket *buckets = nullptr;
+
+    BucketIndex() {}
+    //note: buckets point into memory, so copying is not allowed
+    BucketIndex(const BucketIndex &) = delete;
+    BucketIndex &operator=(const BucketIndex &) = delete;
+
+    //index of bucket where key should be stored
+    inline size_t home(Key key) const {
+        return size_t((key * mult) >> shift) & mask;
+    }
+
+    //returns index of first occurrence of key in sorted array, or NONE if there is no such key
+    inline uint32_t evaluate(Key key) const {
+        for (size_t b = home(key); ; b = (b + 1) & mask) {
+            const Bucket &bucket = buckets[b];
+#ifdef TDM_BUCKET_SSE2
+            __m128i needle = _mm_set1_epi32(int(key));
+            __m128i eqLo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)&bucket.keys[0]), needle);
+            __m128i eqHi = _mm_cmpeq_epi32(_mm_load_si128((const __m128i*)&bucket.keys[4]), needle);
+            int matched = _mm_movemask_ps(_mm_castsi128_ps(eqLo)) | (_mm_movemask_ps(_mm_castsi128_ps(eqHi)) << 4);
+            if (matched) {
+                int s = 0;
+                while (!(matched & (1 << s)))
+                    s++;
+                return bucket.values[s] & ~OVERFLOW_BIT;
+            }
+#else
+            for (int s = 0; s < SLOTS; s++)
+                if (bucket.keys[s] == key)
+                    return bucket.values[s] & ~OVERFLOW_BIT;
+#endif
+            //note: overflow is rare, so this branch is well-predicted
+            if (!(bucket.values[SLOTS - 1] & OVERFLOW_BIT))
+                return NONE;
+        }
+    }
+
+    //start loading memory needed to evaluate the key
+    //(call it a bit earlier than evaluate if many keys are processed)
+    inline void prefetch(Key key) const {
+        TDM_PREFETCH(&buckets[home(key)]);
+    }
+
+    //build hash table for the specified array of keys (must be sorted, duplicates allowed)
+    void create(const Key *keys, size_t num);
+
+    //total size of the table in bytes
+    size_t memoryUsage() const { return memory.size(); }
+};
+
+}
+
+#endif
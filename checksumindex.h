@@ -0,0 +1,115 @@
+#ifndef _TDM_CHECKSUMINDEX_H_308214_
+#define _TDM_CHECKSUMINDEX_H_308214_
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "tdmsync.h"
+#include "tsassert.h"
+#include "binsearch.h"
+#include "phf.h"
+#include "bucketindex.h"
+#include "prefetch.h"
+
+namespace TdmSync {
+
+//branchless binary search over sorted checksums (same interface as PHF and buckets)
+struct BinsearchTable {
+    tdm_bsb_info info;
+    const uint32_t *keys = nullptr;
+
+    inline uint32_t evaluate(uint32_t key) const {
+        return binary_search_branchless_run(&info, keys, key);
+    }
+    //note: binary search reads cells one after another, so there is nothing to prefetch in advance
+    inline void prefetch(uint32_t /*key*/) const {}
+};
+
+//search structure over checksums of blocks
+//used to find blocks with same checksum as a window of local file
+struct ChecksumIndex {
+    ChecksumLookup lookup = clAuto;
+    //checksums of all blocks (sorted)
+    std::vector<uint32_t> checksums;
+    TdmPhf::PerfectHashFunc perfecthash;
+    BinsearchTable binsearcher;
+    TdmBucket::BucketIndex buckets;
+
+    void create(ChecksumLookup type, const std::vector<BlockInfo> &blocks) {
+        std::vector<uint32_t> sorted(blocks.size());
+        for (size_t i = 0; i < blocks.size(); i++)
+            sorted[i] = blocks[i].chksum;
+        create(type, std::move(sorted));
+    }
+    void create(ChecksumLookup type, std::vector<uint32_t> &&sortedChecksums) {
+        checksums = std::move(sortedChecksums);
+        size_t num = checksums.size();
+        //PHF is faster while it fits into cache, but for many blocks it is slower and takes long time to build
+        static const size_t AutoPhfMaxBlocks = 1 << 17;
+        lookup = type;
+        if (lookup == clAuto)
+            lookup = (num <= AutoPhfMaxBlocks ? clPhf : clBuckets);
+        TdmSyncAssert(std::is_sorted(checksums.begin(), checksums.end()));
+        if (lookup == clPhf)
+            perfecthash.create(checksums.data(), num);
+        else if (lookup == clBinsearch) {
+            binary_search_branchless_precompute(&binsearcher.info, num);
+            binsearcher.keys = checksums.data();
+        }
+        else if (lookup == clBuckets)
+            buckets.create(checksums.data(), num);
+        else
+            TdmSyncAssertF(false, "Unknown checksum lookup %d", int(lookup));
+    }
+
+    //returns index of the first block with specified checksum
+    //if there is no such block, then either index >= checksums.size() or index of block with other checksum is returned
+    inline size_t find(uint32_t digest) const {
+        if (lookup == clPhf)
+            return perfecthash.evaluate(digest);
+        else if (lookup == clBuckets)
+            return buckets.evaluate(digest);
+        else
+            return binsearcher.evaluate(digest);
+    }
+
+    //same as calling find for every digest, but memory is prefetched in advance
+    //so that cache misses of consecutive lookups overlap
+    void findMany(const uint32_t *digests, uint32_t *indices, size_t count) const {
+        if (lookup == clPhf)
+            findManyAs<clPhf>(digests, indices, count);
+        else if (lookup == clBuckets)
+            findManyAs<clBuckets>(digests, indices, count);
+        else
+            findManyAs<clBinsearch>(digests, indices, count);
+    }
+    //same as findMany, but lookup structure is known at compile time (must be equal to "lookup")
+    //so the whole loop is specialized for it
+    template<ChecksumLookup Lookup> void findManyAs(const uint32_t *digests, uint32_t *indices, size_t count) const {
+        const auto &table = getTable(std::integral_constant<ChecksumLookup, Lookup>());
+        static const size_t PrefetchDistance = 16;
+        for (size_t k = 0; k < count; k++) {
+            if (k + PrefetchDistance < count)
+                table.prefetch(digests[k + PrefetchDistance]);
+            indices[k] = table.evaluate(digests[k]);
+        }
+    }
+    const TdmPhf::PerfectHashFunc &getTable(std::integral_constant<ChecksumLookup, clPhf>) const { return perfecthash; }
+    const BinsearchTable &getTable(std::integral_constant<ChecksumLookup, clBinsearch>) const { return binsearcher; }
+    const TdmBucket::BucketIndex &getTable(std::integral_constant<ChecksumLookup, clBuckets>) const { return buckets; }
+
+    //approximate memory used by the index (in bytes)
+    size_t memoryUsage() const {
+        size_t res = checksums.size() * sizeof(checksums[0]);
+        if (lookup == clPhf)
+            res += perfecthash.data.size() * sizeof(perfecthash.data[0]);
+        else if (lookup == clBuckets)
+            res += buckets.memoryUsage();
+        return res;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,78 @@
+#include "cpuinfo.h"
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define TDM_CPU_X86
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #include <immintrin.h>
+    #else
+        #include <cpuid.h>
+    #endif
+#endif
+
+
+namespace {
+
+struct CpuFeatures {
+    bool shaNi = false;
+    bool avx2 = false;
+
+    CpuFeatures() {
+#ifdef TDM_CPU_X86
+        uint32_t maxLeaf = cpuid(0, 0, 0);
+        if (maxLeaf < 7)
+            return;
+        uint32_t ecx1 = cpuid(1, 0, 2);
+        uint32_t ebx7 = cpuid(7, 0, 1);
+
+        bool ssse3 = (ecx1 >> 9) & 1;
+        bool sse41 = (ecx1 >> 19) & 1;
+        bool osxsave = (ecx1 >> 27) & 1;
+        bool avx = (ecx1 >> 28) & 1;
+        shaNi = ssse3 && sse41 && ((ebx7 >> 29) & 1);
+
+        //OS must save YMM registers on context switch
+        bool ymmState = osxsave && avx && (xgetbv0() & 6) == 6;
+        avx2 = ymmState && ((ebx7 >> 5) & 1);
+#endif
+    }
+
+#ifdef TDM_CPU_X86
+    //returns register number "reg" (0 = eax, 1 = ebx, 2 = ecx, 3 = edx) of cpuid(leaf, subleaf)
+    static uint32_t cpuid(uint32_t leaf, uint32_t subleaf, int reg) {
+        uint32_t regs[4] = {0};
+        #ifdef _MSC_VER
+        __cpuidex((int*)regs, leaf, subleaf);
+        #else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+        #endif
+        return regs[reg];
+    }
+    static uint64_t xgetbv0() {
+        #ifdef _MSC_VER
+        return _xgetbv(0);
+        #else
+        uint32_t lo, hi;
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        return (uint64_t(hi) << 32) | lo;
+        #endif
+    }
+#endif
+};
+
+//note: initialization of local static is thread-safe
+const CpuFeatures &getFeatures() {
+    static CpuFeatures features;
+    return features;
+}
+
+}
+
+extern "C" int cpu_has_sha_ni(void) {
+    return getFeatures().shaNi;
+}
+
+extern "C" int cpu_has_avx2(void) {
+    return getFeatures().avx2;
+}
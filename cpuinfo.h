@@ -0,0 +1,21 @@
+#ifndef _TDM_CPUINFO_H_730461_
+#define _TDM_CPUINFO_H_730461_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//runtime detection of CPU features (for choosing optimized code paths)
+//all functions return nonzero if feature is supported by both CPU and OS
+//note: detection is done once, so these functions are cheap to call
+
+//SHA extensions (SHA-NI): sha1rnds4, sha1nexte, sha1msg1, sha1msg2 + SSSE3 + SSE4.1
+int cpu_has_sha_ni(void);
+//AVX2 (including OS support of YMM registers)
+int cpu_has_avx2(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+#include "downloadjournal.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include "fileio.h"
+#include "murmur3.h"
+
+#undef min
+#undef max
+
+
+namespace TdmSync {
+
+static const char JOURNAL_MAGIC[] = "tdmsyncj";
+
+DownloadJournal::DownloadJournal(const std::string &downloadPath) : downloadPath(downloadPath) {
+    if (!downloadPath.empty())
+        path = downloadPath + ".journal";
+}
+
+void DownloadJournal::clear() {
+    written.clear();
+    writtenBytes = 0;
+    dirty = true;
+}
+
+bool DownloadJournal::start(const FileInfo &remoteInfo, const UpdatePlan &plan) {
+    //identity: metainfo of remote file (its blocks change whenever file changes) and where remote segments go
+    int64_t blocksHash[2];
+    murmur3_x64_128((uint8_t*)blocksHash, (const uint8_t*)remoteInfo.blocks.data(), remoteInfo.blocks.size() * sizeof(BlockInfo), 0);
+    std::vector<int64_t> key = {remoteInfo.fileSize, remoteInfo.blockSize, plan.bytesRemote, blocksHash[0], blocksHash[1]};
+    for (const SegmentUse &seg : plan.segments)
+        if (seg.remote) {
+            key.push_back(seg.dstOffset);
+            key.push_back(seg.size);
+        }
+    murmur3_x64_128(identity, (const uint8_t*)key.data(), key.size() * sizeof(int64_t), 0);
+    downloadSize = plan.bytesRemote;
+    clear();
+    dirty = false;
+
+    if (path.empty())
+        return false;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    fclose(f);
+    StdioFile file;
+    file.open(path.c_str(), StdioFile::Read);
+    std::vector<uint8_t> data(file.getSize());
+    if (!data.empty())
+        file.read(data.data(), data.size());
+
+    //layout: magic, identity, download size, number of parts, parts (start, end), hash of all the previous bytes
+    //note: file may be broken if process was killed while saving it, then hash does not match
+    const size_t headerSize = strlen(JOURNAL_MAGIC) + sizeof(identity) + 2 * sizeof(int64_t);
+    if (data.size() < headerSize + 16 || memcmp(data.data(), JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0)
+        return false;
+    uint8_t hash[16];
+    murmur3_x64_128(hash, data.data(), data.size() - 16, 0);
+    if (memcmp(hash, data.data() + data.size() - 16, 16) != 0)
+        return false;
+    const uint8_t *ptr = data.data() + strlen(JOURNAL_MAGIC);
+    if (memcmp(ptr, identity, sizeof(identity)) != 0)
+        return false;
+    ptr += sizeof(identity);
+    int64_t size, count;
+    memcpy(&size, ptr, sizeof(size));
+    memcpy(&count, ptr + sizeof(size), sizeof(count));
+    ptr += 2 * sizeof(int64_t);
+    if (size != downloadSize || count < 0 || data.size() != headerSize + count * 2 * sizeof(int64_t) + 16)
+        return false;
+
+    int64_t maxEnd = 0;
+    for (int64_t i = 0; i < count; i++) {
+        int64_t range[2];
+        memcpy(range, ptr + i * sizeof(range), sizeof(range));
+        if (range[0] < 0 || range[0] >= range[1] || range[1] > downloadSize) {
+            clear();
+            return false;
+        }
+        markWritten(range[0], range[1]);
+        maxEnd = std::max(maxEnd, range[1]);
+    }
+    dirty = false;
+
+    //download file may have been deleted or truncated since then
+    f = fopen(downloadPath.c_str(), "rb");
+    if (!f) {
+        clear();
+        return false;
+    }
+    fclose(f);
+    StdioFile downloadFile;
+    downloadFile.open(downloadPath.c_str(), StdioFile::Read);
+    if (int64_t(downloadFile.getSize()) < maxEnd) {
+        clear();
+        return false;
+    }
+    return writtenBytes > 0;
+}
+
+void DownloadJournal::markWritten(int64_t start, int64_t end) {
+    if (start >= end)
+        return;
+    dirty = true;
+    //find part which contains or touches start, or create new one
+    auto next = written.upper_bound(start);
+    std::map<int64_t, int64_t>::iterator cur;
+    if (next != written.begin() && std::prev(next)->second >= start)
+        cur = std::prev(next);      //usual case: data is written sequentially, so the last part is extended
+    else
+        cur = written.emplace_hint(next, start, start);
+    writtenBytes -= cur->second - cur->first;
+    int64_t newEnd = std::max(cur->second, end);
+    //absorb all parts which are covered or touched by the new one
+    while (next != written.end() && next->first <= newEnd) {
+        newEnd = std::max(newEnd, next->second);
+        writtenBytes -= next->second - next->first;
+        next = written.erase(next);
+    }
+    cur->second = newEnd;
+    writtenBytes += cur->second - cur->first;
+}
+
+int64_t DownloadJournal::writtenPrefix(int64_t start, int64_t end) const {
+    auto it = written.upper_bound(start);
+    if (it == written.begin())
+        return 0;
+    --it;
+    if (it->second <= start)
+        return 0;
+    return std::min(it->second, end) - start;
+}
+
+void DownloadJournal::forEachMissing(int64_t start, int64_t end, const std::function<void(int64_t from, int64_t to)> &func) const {
+    int64_t pos = start;
+    auto it = written.upper_bound(start);
+    if (it != written.begin() && std::prev(it)->second > pos)
+        pos = std::prev(it)->second;
+    for (; pos < end; ++it) {
+        int64_t until = (it == written.end() ? end : std::min(it->first, end));
+        if (pos < until)
+            func(pos, until);
+        if (it == written.end())
+            break;
+        pos = std::max(pos, it->second);
+    }
+}
+
+void DownloadJournal::save() {
+    if (path.empty() || !dirty)
+        return;
+    std::vector<uint8_t> data(JOURNAL_MAGIC, JOURNAL_MAGIC + strlen(JOURNAL_MAGIC));
+    auto append = [&data](const void *ptr, size_t size) {
+        data.insert(data.end(), (const uint8_t*)ptr, (const uint8_t*)ptr + size);
+    };
+    int64_t count = written.size();
+    append(identity, sizeof(identity));
+    append(&downloadSize, sizeof(downloadSize));
+    append(&count, sizeof(count));
+    for (const auto &part : written) {
+        int64_t range[2] = {part.first, part.second};
+        append(range, sizeof(range));
+    }
+    uint8_t hash[16];
+    murmur3_x64_128(hash, data.data(), data.size(), 0);
+    append(hash, sizeof(hash));
+
+    StdioFile file;
+    file.open(path.c_str(), StdioFile::Write);
+    file.write(data.data(), data.size());
+    file.flush();
+    dirty = false;
+}
+
+void DownloadJournal::remove() {
+    if (!path.empty())
+        ::remove(path.c_str());
+}
+
+}
@@ -0,0 +1,60 @@
+#ifndef _TDM_SYNC_DOWNLOADJOURNAL_H_730418_
+#define _TDM_SYNC_DOWNLOADJOURNAL_H_730418_
+
+#include "tdmsync.h"
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <functional>
+
+namespace TdmSync {
+
+//progress of filling download file with remote segments: which parts of it are written already
+//it can be kept in a small journal file next to download file, then interrupted download (e.g. dropped connection,
+//  killed process) is resumed by the next run: only the parts which are not written yet are downloaded
+//journal is bound to identity of the download: remote segments of plan and metainfo of remote file,
+//  so that progress of another plan or another version of remote file is never reused
+//note: journal file says that data is written only after download file is flushed (see CurlDownloader)
+class DownloadJournal {
+public:
+    //downloadPath --- path of download file, journal is kept in file downloadPath + ".journal"
+    //if path is empty, then progress is only tracked in memory (save and remove do nothing)
+    explicit DownloadJournal(const std::string &downloadPath = std::string());
+
+    //start tracking download of remote segments of the plan for remote file with specified metainfo
+    //loads progress from journal file if it has same identity and download file still has all the written data
+    //returns true if something is written already: then download file must be opened without truncating it
+    bool start(const FileInfo &remoteInfo, const UpdatePlan &plan);
+    //forget all progress (in memory)
+    void clear();
+
+    //mark bytes [start, end) of download file as written
+    void markWritten(int64_t start, int64_t end);
+    //returns how many bytes are written from start of [start, end) without interruption
+    int64_t writtenPrefix(int64_t start, int64_t end) const;
+    //calls func(from, to) for every maximal part [from, to) of [start, end) which is not written yet
+    void forEachMissing(int64_t start, int64_t end, const std::function<void(int64_t from, int64_t to)> &func) const;
+    //total number of written bytes
+    int64_t getWrittenBytes() const { return writtenBytes; }
+
+    //whether journal is kept in file
+    bool isPersistent() const { return !path.empty(); }
+    //write journal file if anything has changed since last save
+    void save();
+    //delete journal file (when download file is no longer needed)
+    void remove();
+
+private:
+    std::string path, downloadPath;
+    //hash of everything the download depends on
+    uint8_t identity[16] = {0};
+    int64_t downloadSize = 0;
+    //written parts of download file: start -> end, disjoint and not touching each other
+    std::map<int64_t, int64_t> written;
+    int64_t writtenBytes = 0;
+    bool dirty = false;
+};
+
+}
+
+#endif
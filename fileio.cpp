@@ -1,13 +1,36 @@
 #pragma warning(disable: 4244)	//conversion from 'uint64_t' to 'long', possible loss of data
 #include "fileio.h"
 #include <stdio.h>
+#include <string.h>
 #include <stdexcept>
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+#ifdef __linux__
+    #include <errno.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <linux/fs.h>
+#endif
 #include "tsassert.h"
 #include "tdmsync.h"
 
 
 namespace TdmSync {
 
+void BaseFile::truncate(uint64_t /*size*/) {
+    TdmSyncAssertF(false, "Changing size of file is not supported");
+}
+
+//===========================================================================
+
 StdioFile::StdioFile() {
     fh = nullptr;
 }
@@ -20,19 +43,21 @@ void StdioFile::open(const char *filename, OpenMode mode) {
     if (fh)
         fclose((FILE*)fh);
     this->mode = mode;
-    FILE *f = fopen(filename, mode == Read ? "rb" : "wb");
-    TdmSyncAssertF(f, "Failed to open file %s for %s", filename, mode == Read ? "reading" : "writing");
+    static const char *FopenModes[] = {"rb", "wb", "r+b"};
+    static const char *Purposes[] = {"reading", "writing", "updating"};
+    FILE *f = fopen(filename, FopenModes[mode]);
+    TdmSyncAssertF(f, "Failed to open file %s for %s", filename, Purposes[mode]);
     fh = f;
 }
 
 void StdioFile::read(void* data, size_t size) {
-    TdmSyncAssert(fh && mode == Read);
+    TdmSyncAssert(fh && mode != Write);
     size_t bytes = fread(data, 1, size, (FILE*)fh);
     TdmSyncAssert(bytes == size);
 }
 
 void StdioFile::write(const void* data, size_t size) {
-    TdmSyncAssert(fh && mode == Write);
+    TdmSyncAssert(fh && mode != Read);
     size_t bytes = fwrite(data, 1, size, (FILE*)fh);
     TdmSyncAssert(bytes == size);
 }
@@ -63,4 +88,202 @@ void StdioFile::flush() {
     fflush(f);
 }
 
+void StdioFile::truncate(uint64_t size) {
+    TdmSyncAssert(fh && mode != Read);
+    FILE *f = (FILE*)fh;
+    fflush(f);
+#ifdef _WIN32
+    int err = _chsize_s(_fileno(f), size);
+#else
+    int err = ftruncate(fileno(f), size);
+#endif
+    TdmSyncAssertF(err == 0, "Failed to change file size to %lld", (long long)size);
+}
+
+void StdioFile::preallocate(uint64_t size) {
+    TdmSyncAssert(fh && mode != Read);
+#ifdef __linux__
+    //note: failure is not an error (e.g. filesystem does not support it)
+    FILE *f = (FILE*)fh;
+    fflush(f);
+    if (size > 0)
+        fallocate(fileno(f), 0, 0, size);
+#endif
+}
+
+bool StdioFile::copyRangeFrom(BaseFile &src, uint64_t srcPos, uint64_t dstPos, uint64_t size) {
+    TdmSyncAssert(fh && mode != Read);
+#ifdef __linux__
+    StdioFile *srcStdio = dynamic_cast<StdioFile*>(&src);
+    if (!srcStdio || !srcStdio->fh)
+        return false;
+    //make sure that buffered writes do not land after the copied data
+    fflush((FILE*)fh);
+    int fdIn = fileno((FILE*)srcStdio->fh);
+    int fdOut = fileno((FILE*)fh);
+
+#ifdef FICLONERANGE
+    //reflink: on copy-on-write filesystems (btrfs, XFS) data is shared instead of copied
+    //offsets and size must be aligned to filesystem block, which is usually 4 KB
+    static const uint64_t CloneAlignment = 4096;
+    if (srcPos % CloneAlignment == 0 && dstPos % CloneAlignment == 0 && size % CloneAlignment == 0) {
+        struct file_clone_range range;
+        range.src_fd = fdIn;
+        range.src_offset = srcPos;
+        range.src_length = size;
+        range.dest_offset = dstPos;
+        if (ioctl(fdOut, FICLONERANGE, &range) == 0)
+            return true;
+    }
+#endif
+
+#ifdef SYS_copy_file_range
+    //in-kernel copy (note: called via syscall, since glibc wrapper is rather new)
+    loff_t offIn = srcPos, offOut = dstPos;
+    uint64_t done = 0;
+    while (done < size) {
+        long res = syscall(SYS_copy_file_range, fdIn, &offIn, fdOut, &offOut, size_t(size - done), 0U);
+        if (res <= 0) {
+            //not supported at all (e.g. old kernel, different filesystems): let caller copy everything
+            TdmSyncAssertF(done == 0 && res < 0, "copy_file_range failed after %lld bytes", (long long)done);
+            return false;
+        }
+        done += res;
+    }
+    return true;
+#endif
+#endif
+    return false;
+}
+
+//===========================================================================
+
+MmapFile::MmapFile() {}
+MmapFile::~MmapFile() {
+    close();
+}
+
+void MmapFile::open(const char *filename) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    TdmSyncAssertF(file != INVALID_HANDLE_VALUE, "Failed to open file %s for reading", filename);
+    LARGE_INTEGER len;
+    GetFileSizeEx(file, &len);
+    size = len.QuadPart;
+    if (size > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            ptr = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);   //note: view keeps mapping alive
+        }
+        CloseHandle(file);
+        TdmSyncAssertF(ptr, "Failed to map file %s into memory", filename);
+    }
+    else
+        CloseHandle(file);
+#else
+    int fd = ::open(filename, O_RDONLY);
+    TdmSyncAssertF(fd >= 0, "Failed to open file %s for reading", filename);
+    struct stat st;
+    fstat(fd, &st);
+    size = st.st_size;
+    if (size > 0) {
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);    //note: mapping stays valid
+        TdmSyncAssertF(addr != MAP_FAILED, "Failed to map file %s into memory", filename);
+        ptr = (const uint8_t*)addr;
+    }
+    else
+        ::close(fd);
+#endif
+    pos = 0;
+    opened = true;
+}
+
+void MmapFile::close() {
+    if (ptr) {
+#ifdef _WIN32
+        UnmapViewOfFile(ptr);
+#else
+        munmap((void*)ptr, size);
+#endif
+    }
+    ptr = nullptr;
+    size = pos = 0;
+    opened = false;
+}
+
+void MmapFile::read(void* data, size_t size) {
+    TdmSyncAssert(opened && pos + size <= this->size);
+    memcpy(data, ptr + pos, size);
+    pos += size;
+}
+
+void MmapFile::write(const void* /*data*/, size_t /*size*/) {
+    TdmSyncAssertF(false, "MmapFile is read-only");
+}
+
+void MmapFile::seek(uint64_t pos) {
+    TdmSyncAssert(opened);
+    this->pos = pos;
+}
+
+uint64_t MmapFile::tell() {
+    TdmSyncAssert(opened);
+    return pos;
+}
+
+uint64_t MmapFile::getSize() {
+    TdmSyncAssert(opened);
+    return size;
+}
+
+void MmapFile::flush() {}
+
+const uint8_t *MmapFile::getData() {
+    TdmSyncAssert(opened);
+    return ptr;
+}
+
+//===========================================================================
+
+void MemoryFile::read(void* data, size_t size) {
+    TdmSyncAssert(pos + size <= contents.size());
+    if (size > 0)
+        memcpy(data, contents.data() + pos, size);
+    pos += size;
+}
+
+void MemoryFile::write(const void* data, size_t size) {
+    if (pos + size > contents.size())
+        contents.resize(pos + size);
+    if (size > 0)
+        memcpy(contents.data() + pos, data, size);
+    pos += size;
+}
+
+void MemoryFile::seek(uint64_t pos) {
+    //note: seeking past the end is allowed (like fseek), gap is zero-filled on write
+    this->pos = pos;
+}
+
+uint64_t MemoryFile::tell() {
+    return pos;
+}
+
+uint64_t MemoryFile::getSize() {
+    return contents.size();
+}
+
+void MemoryFile::flush() {}
+
+void MemoryFile::truncate(uint64_t size) {
+    contents.resize(size);
+}
+
+const uint8_t *MemoryFile::getData() {
+    return contents.empty() ? nullptr : contents.data();
+}
+
 }
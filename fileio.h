@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
 namespace TdmSync {
 
@@ -18,6 +19,19 @@ public:
     virtual uint64_t tell() = 0;
     virtual uint64_t getSize() = 0;
     virtual void flush() = 0;
+    //change size of file (needed only for in-place update, not supported by default)
+    virtual void truncate(uint64_t size);
+    //hint that file will have the specified size, so that disk space can be allocated at once (no-op by default)
+    virtual void preallocate(uint64_t /*size*/) {}
+    //copy "size" bytes from position "srcPos" of "src" file to position "dstPos" of this file,
+    //  without passing data through user memory (e.g. reflink or in-kernel copy), positions of files are not used
+    //returns false if it is not supported for these files (then caller copies data itself)
+    virtual bool copyRangeFrom(BaseFile &/*src*/, uint64_t /*srcPos*/, uint64_t /*dstPos*/, uint64_t /*size*/) { return false; }
+
+    //returns pointer to the whole contents of file in memory (e.g. if file is memory-mapped)
+    //tdmsync uses it instead of reading data into its own buffers, avoiding copies
+    //returns nullptr if direct access is not supported (default)
+    virtual const uint8_t *getData() { return nullptr; }
 };
 
 //default file I/O based on FILE: fopen/fread/fwrite/fseek/ftell/fflush
@@ -26,7 +40,8 @@ public:
     StdioFile();
     ~StdioFile();
 
-    enum OpenMode { Read, Write };
+    //ReadWrite opens existing file without truncating it (for in-place update)
+    enum OpenMode { Read, Write, ReadWrite };
     void open(const char *filename, OpenMode mode);
 
     virtual void read(void* data, size_t size) override;
@@ -35,12 +50,62 @@ public:
     virtual uint64_t tell() override;
     virtual uint64_t getSize() override;
     virtual void flush() override;
+    virtual void truncate(uint64_t size) override;
+    //on Linux: preallocates with fallocate, copies ranges between StdioFile-s with FICLONERANGE or copy_file_range
+    virtual void preallocate(uint64_t size) override;
+    virtual bool copyRangeFrom(BaseFile &src, uint64_t srcPos, uint64_t dstPos, uint64_t size) override;
 
 private:
     OpenMode mode;
     void *fh;       //(FILE*) -- type erased
 };
 
+//read-only file mapped into memory (mmap / MapViewOfFile)
+//provides direct access to data via getData, so no intermediate copies are needed
+class MmapFile : public BaseFile {
+public:
+    MmapFile();
+    ~MmapFile();
+
+    void open(const char *filename);
+    void close();
+
+    virtual void read(void* data, size_t size) override;
+    virtual void write(const void* data, size_t size) override;
+    virtual void seek(uint64_t pos) override;
+    virtual uint64_t tell() override;
+    virtual uint64_t getSize() override;
+    virtual void flush() override;
+    virtual const uint8_t *getData() override;
+
+private:
+    const uint8_t *ptr = nullptr;
+    uint64_t size = 0;
+    uint64_t pos = 0;
+    bool opened = false;
+};
+
+//file stored entirely in memory (vector of bytes)
+//reading past the end is an error, writing past the end extends the file
+class MemoryFile : public BaseFile {
+public:
+    MemoryFile() {}
+    MemoryFile(std::vector<uint8_t> contents) : contents(std::move(contents)) {}
+
+    virtual void read(void* data, size_t size) override;
+    virtual void write(const void* data, size_t size) override;
+    virtual void seek(uint64_t pos) override;
+    virtual uint64_t tell() override;
+    virtual uint64_t getSize() override;
+    virtual void flush() override;
+    virtual void truncate(uint64_t size) override;
+    virtual const uint8_t *getData() override;
+
+    std::vector<uint8_t> contents;
+private:
+    uint64_t pos = 0;
+};
+
 }
 
 #endif
@@ -136,18 +136,35 @@ def test_single(orig: bytearray, src: str, dst: str) -> bool:
         f.write(orig)
     with open(dst, 'wb') as f:
         f.write(mod)
-    err = os.system('tdmsync prepare %s' % src)
+    sources = ''
+    if random() < 0.3:
+        with open(dst + '.extra', 'wb') as f:
+            f.write(gen_local(orig))
+        sources = '-source %s.extra' % dst
+    threads = choice([1, 1, 2, 4])
+    hash = choice(['sha1', 'murmur3'])
+    rolling = choice(['polyhash', 'buzhash'])
+    compact = choice(['', '-compact', '-sequential', '-sequential -checksum-bytes 1'])
+    mmap = choice(['', '-mmap', '-uring'])
+    lookup = choice(['auto', 'phf', 'binsearch', 'buckets'])
+    scan = choice(['exhaustive', 'skip', 'aligned'])
+    stream = choice(['', '-stream', '-inplace'])
+    coalesce = choice(['', '', '-coalesce', '-coalesce -range-overhead 5000', '-coalesce -rtt 20'])
+    batch = choice(['', '', '-batch-ranges 3', '-batch-size 4 -connections 2', '-connections 1'])
+    if os.path.exists(dst + '.updated'):
+        os.remove(dst + '.updated')
+    err = os.system('tdmsync prepare %s -threads %d -hash %s -rolling %s %s %s' % (src, threads, hash, rolling, compact, mmap))
     if err != 0:
         return False
     if g_local:
-        cmd = 'tdmsync update -file %s %s 2>nul' % (src, dst)
+        cmd = 'tdmsync update -file %s %s -threads %d %s -lookup %s -scan %s %s %s %s 2>nul' % (src, dst, threads, mmap, lookup, scan, sources, stream, coalesce)
     else:
-        cmd = 'tdmsync update -url http://localhost:%d/%s %s 2>nul' % (g_port, src, dst)
+        cmd = 'tdmsync update -url http://localhost:%d/%s %s -threads %d %s -lookup %s -scan %s %s %s %s %s 2>nul' % (g_port, src, dst, threads, mmap, lookup, scan, sources, stream, coalesce, batch)
     err = os.system(cmd)
     if err != 0:
         return False
     got = b""
-    with open(dst + '.updated', 'rb') as f:
+    with open(dst + '.updated' if os.path.exists(dst + '.updated') else dst, 'rb') as f:
         got = f.read()
     return orig == got
 
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Static file server with byte ranges support, which emulates network latency.
+Every new connection is delayed by several round trips (TCP and TLS handshakes), every request by one more.
+Every connection sends at most one window of data per round trip, like TCP on a link with high bandwidth-delay product.
+Prints how many connections and requests it has served, so that connection reuse can be checked.
+Uses only standard library.
+
+Usage: latencyserv.py [-port 8001] [-rtt 50] [-connect-rtts 2] [-window 0] [-no-multipart] [-max-ranges 0] [-error-rate 0] [-drop-rate 0] [-reorder] [-merge 0] [root_dir]
+"""
+import http.server, socketserver
+import os, sys, time, threading, random
+
+g_port = 8001           # same default port as in cherryserv.py
+g_rtt = 0.050           # emulated round trip time (seconds)
+g_connect_rtts = 2      # round trips for establishing connection: TCP handshake + TLS 1.3 handshake
+g_window = 0            # bytes sent per round trip by one connection (0 = unlimited)
+g_multipart = True      # if false, then multi-range requests get whole file (like some servers do)
+g_max_ranges = 0        # requests with more ranges get whole file, like MaxRanges in Apache (0 = unlimited)
+g_error_rate = 0.0      # fraction of range requests which fail with 503 (overloaded server)
+g_drop_rate = 0.0       # fraction of range responses which are cut off midway (broken connection)
+g_reorder = False       # if true, then parts of multipart response are shuffled (allowed by RFC 7233)
+g_merge = -1            # ranges separated by at most this many bytes are merged into one part (-1 = never)
+g_root = os.path.dirname(os.path.abspath(__file__))
+
+g_lock = threading.Lock()
+g_connections = 0
+g_requests = 0
+
+def report():
+    print("connections: %d  requests: %d" % (g_connections, g_requests), flush=True)
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'   # keep-alive
+
+    def setup(self):
+        global g_connections
+        super().setup()
+        time.sleep(g_rtt * g_connect_rtts)
+        with g_lock:
+            g_connections += 1
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_data(self, code, headers, body, drop=False):
+        self.send_response(code)
+        self.send_header('Accept-Ranges', 'bytes')
+        for k, v in headers:
+            self.send_header(k, v)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if drop and body:
+            # connection breaks at random point: client gets only a part of promised body
+            body = body[:random.randrange(len(body))]
+            self.close_connection = True
+        if g_window <= 0:
+            self.wfile.write(body)
+            return
+        for pos in range(0, len(body), g_window):
+            if pos > 0:
+                time.sleep(g_rtt)
+            self.wfile.write(body[pos:pos + g_window])
+
+    def do_GET(self):
+        global g_requests
+        time.sleep(g_rtt)
+        with g_lock:
+            g_requests += 1
+        report()
+
+        path = os.path.join(g_root, self.path.lstrip('/'))
+        if not os.path.isfile(path):
+            self.send_data(404, [], b'')
+            return
+        with open(path, 'rb') as f:
+            data = f.read()
+        size = len(data)
+
+        header = self.headers.get('Range')
+        if not header or not header.startswith('bytes='):
+            self.send_data(200, [], data)
+            return
+        if random.random() < g_error_rate:
+            self.send_data(503, [], b'')
+            return
+        ranges = []
+        for r in header[len('bytes='):].split(','):
+            a, b = r.strip().split('-')
+            a = int(a)
+            b = min(int(b) if b else size - 1, size - 1)
+            ranges.append((a, b))
+        if g_merge >= 0:
+            merged = []
+            for a, b in sorted(ranges):
+                if merged and a - merged[-1][1] - 1 <= g_merge:
+                    merged[-1] = (merged[-1][0], max(merged[-1][1], b))
+                else:
+                    merged.append((a, b))
+            ranges = merged
+        if g_reorder:
+            random.shuffle(ranges)
+        drop = random.random() < g_drop_rate
+
+        if len(ranges) == 1:
+            a, b = ranges[0]
+            self.send_data(206, [('Content-Range', 'bytes %d-%d/%d' % (a, b, size))], data[a:b+1], drop)
+        elif not g_multipart or (g_max_ranges > 0 and len(ranges) > g_max_ranges):
+            self.send_data(200, [], data)
+        else:
+            boundary = 'LATENCYSERV_BOUNDARY'
+            parts = []
+            for a, b in ranges:
+                parts.append(('\r\n--%s\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes %d-%d/%d\r\n\r\n' % (boundary, a, b, size)).encode())
+                parts.append(data[a:b+1])
+            parts.append(('\r\n--%s--\r\n' % boundary).encode())
+            self.send_data(206, [('Content-Type', 'multipart/byteranges; boundary=' + boundary)], b''.join(parts), drop)
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    request_queue_size = 256    # default backlog drops connections when client opens many at once
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    while args:
+        arg = args.pop(0)
+        if arg == '-port':
+            g_port = int(args.pop(0))
+        elif arg == '-rtt':
+            g_rtt = float(args.pop(0)) / 1000.0
+        elif arg == '-connect-rtts':
+            g_connect_rtts = int(args.pop(0))
+        elif arg == '-window':
+            g_window = int(args.pop(0)) * 1024
+        elif arg == '-no-multipart':
+            g_multipart = False
+        elif arg == '-max-ranges':
+            g_max_ranges = int(args.pop(0))
+        elif arg == '-error-rate':
+            g_error_rate = float(args.pop(0)) / 100.0
+        elif arg == '-drop-rate':
+            g_drop_rate = float(args.pop(0)) / 100.0
+        elif arg == '-reorder':
+            g_reorder = True
+        elif arg == '-merge':
+            g_merge = int(args.pop(0))
+        else:
+            g_root = os.path.abspath(arg)
+    print("serving %s on port %d: rtt = %d ms, connect = %d rtts, window = %d KB" % (g_root, g_port, g_rtt * 1000, g_connect_rtts, g_window // 1024), flush=True)
+    Server(('0.0.0.0', g_port), Handler).serve_forever()
@@ -1,9 +1,15 @@
 #include <stdio.h>
 #include <time.h>
+#include <chrono>
 #include <stdlib.h>
 #include <string>
+#include <memory>
 #include "tdmsync.h"
+#include "tdmsync_many.h"
 #include "fileio.h"
+#include "uringfile.h"
+#include "downloadjournal.h"
+#include "bench.h"
 
 #ifdef WITH_CURL
 #include <curl/curl.h>
@@ -14,27 +20,216 @@ using namespace TdmSync;
 
 void exit_usage() {
     fprintf(stderr, "Usage: \n");
-    fprintf(stderr, "  tdmsync prepare [file_path] (block_size=4096)\n");
+    fprintf(stderr, "  tdmsync prepare [file_path] (block_size=4096) (-threads N) (-hash sha1|murmur3) (-rolling polyhash|buzhash) (-sequential) (-checksum-bytes N) (-compact) (-mmap) (-uring)\n");
     fprintf(stderr, "    takes local file at [file_path] and preprocess it\n");
     fprintf(stderr, "    saves metainformation into file [file_path].tdmsync\n");
     fprintf(stderr, "    optional parameter [block_size] specified granularity of updates\n");
+    fprintf(stderr, "    optional -threads N sets number of threads for hashing (0 = all cores, default = 1)\n");
+    fprintf(stderr, "    optional -hash sets algorithm of block hashes: sha1 (default, readable by old versions) or murmur3 (faster)\n");
+    fprintf(stderr, "    optional -rolling sets algorithm of block checksums: polyhash (default, readable by old versions) or buzhash\n");
+    fprintf(stderr, "    optional -sequential makes update match a block only if the next block follows it, so checksums are shorter\n");
+    fprintf(stderr, "    optional -checksum-bytes N sets how many bytes of checksums are stored (1-4, default = auto)\n");
+    fprintf(stderr, "    optional -compact makes metainfo smaller: hashes and checksums are truncated, block offsets are not stored\n");
+    fprintf(stderr, "    optional -mmap reads file via memory mapping instead of buffered reads\n");
+    fprintf(stderr, "    optional -uring reads file via io_uring with several reads in flight (Linux only)\n");
     fprintf(stderr, "\n");
-    fprintf(stderr, "  tdmsync update -file [source_file_path] [dest_file_path]\n");
+    fprintf(stderr, "  tdmsync update -file [source_file_path] [dest_file_path] (-threads N) (-mmap) (-uring) (-lookup auto|phf|binsearch|buckets) (-scan exhaustive|skip|aligned) (-source [path] ...) (-stream) (-inplace) (-coalesce ...)\n");
     fprintf(stderr, "    takes local file at [source_file_path] with metainformation at [source_file_path].tdmsync\n");
     fprintf(stderr, "    synchronizes the local file at [dest_file_path] with it\n");
     fprintf(stderr, "\n");
 #ifdef WITH_CURL
-    fprintf(stderr, "  tdmsync update -url [source_file_url] [dest_file_path]\n");
+    fprintf(stderr, "  tdmsync update -url [source_file_url] [dest_file_path] (-threads N) (-mmap) (-uring) (-lookup auto|phf|binsearch|buckets) (-scan exhaustive|skip|aligned) (-source [path] ...) (-stream) (-inplace) (-coalesce ...) (-connections N) (-batch-ranges N) (-batch-size KB) (-retries N)\n");
     fprintf(stderr, "    takes remote file at [source_file_url] with metainformation at [source_file_url].tdmsync\n");
     fprintf(stderr, "    synchronizes the local file at [dest_file_path] with it, downloading only metainfo and some parts of source\n");
     fprintf(stderr, "\n");
 #endif
+    fprintf(stderr, "    optional -threads N sets number of threads for analysis of local file (0 = all cores, default = 1)\n");
+    fprintf(stderr, "    optional -mmap reads local files via memory mapping instead of buffered reads\n");
+    fprintf(stderr, "    optional -uring accesses files via io_uring: reads ahead, writes behind, copies in kernel (Linux only)\n");
+    fprintf(stderr, "    optional -lookup sets data structure for searching blocks by checksum (default = auto)\n");
+    fprintf(stderr, "    optional -stream writes downloaded data straight into updated file (no [dest_file_path].download is created)\n");
+    fprintf(stderr, "    optional -inplace modifies [dest_file_path] directly, so that no disk space is needed for a copy\n");
+    fprintf(stderr, "      (falls back to normal update if local data cannot be moved using bounded memory)\n");
+    fprintf(stderr, "    optional -source [path] adds another local file where blocks are searched too (can be repeated)\n");
+    fprintf(stderr, "    optional -scan sets which windows of local file are checked (default = exhaustive):\n");
+    fprintf(stderr, "      skip does not check windows overlapping found blocks: much faster on similar files\n");
+    fprintf(stderr, "      aligned checks blocks at same offsets first, then only the windows around changed parts\n");
+    fprintf(stderr, "    optional -coalesce merges remote parts separated by short local data into fewer byte ranges\n");
+    fprintf(stderr, "      its cost model is set by -range-overhead N (bytes per range, default = 100),\n");
+    fprintf(stderr, "      -rtt MS (round trip time per range, default = 0) and -bandwidth MB (MB per second, default = 10)\n");
+#ifdef WITH_CURL
+    fprintf(stderr, "    optional -connections N sets max number of simultaneous connections for downloading missing parts (default = 8)\n");
+    fprintf(stderr, "    optional -batch-ranges N and -batch-size KB limit one multi-range HTTP request (default = 200 ranges, 1024 KB)\n");
+    fprintf(stderr, "      batches are downloaded simultaneously, rejected batch is downloaded again range by range\n");
+    fprintf(stderr, "      number of simultaneous transfers is adapted to download speed\n");
+    fprintf(stderr, "    optional -retries N sets how many times failed range request is repeated (default = 2)\n");
+    fprintf(stderr, "      broken transfer is repeated from its first missing byte\n");
+    fprintf(stderr, "    if download is interrupted, the next run with same arguments downloads only the missing parts\n");
+    fprintf(stderr, "      (progress is kept in [dest_file_path].download.journal, delete .download file to start over)\n");
+#endif
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  tdmsync update-many [manifest_path] (-threads N) (-connections N) (-memory MB) (-lookup ...) (-scan ...) (-stream) (-coalesce ...)\n");
+    fprintf(stderr, "    updates many files at once, every line of manifest is: [source_file_path_or_url] [dest_file_path]\n");
+    fprintf(stderr, "    (empty lines and lines starting with # are ignored, paths cannot contain spaces)\n");
+    fprintf(stderr, "    metainfo, analysis, download and patching of all files run on one shared thread pool\n");
+    fprintf(stderr, "    optional -threads N sets number of threads in the pool (0 = all cores, default = 0)\n");
+    fprintf(stderr, "    optional -connections N sets max number of simultaneous HTTP requests (default = 4)\n");
+    fprintf(stderr, "    optional -memory MB sets approximate limit on memory used by metainfo and analysis (default = 1024)\n");
+    fprintf(stderr, "    optional -stream writes downloaded data straight into updated files\n");
+    fprintf(stderr, "    exit code is nonzero if some file failed\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  tdmsync bench-lookup (blocks_count ...) (-queries N)\n");
+    fprintf(stderr, "    compares performance of lookup structures on random checksums\n");
+    fprintf(stderr, "    default blocks counts are 1000, 1000000, 50000000; default number of queries is 100000000\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  tdmsync bench-io [remote_file] (local_file) (block_size=4096) (-rounds N)\n");
+    fprintf(stderr, "    compares stdio and io_uring files on cold cache: metainfo, analysis and patching\n");
+    fprintf(stderr, "    local file is same as remote by default; default number of rounds is 3\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  tdmsync bench-multipart (part_size ...) (-total MB) (-chunk KB)\n");
+    fprintf(stderr, "    measures throughput of multipart/byteranges parser on synthetic response in memory\n");
+    fprintf(stderr, "    default part sizes are 256, 4096, 65536, 1048576; default total is 4096 MB in chunks of 16 KB\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  tdmsync stress-plans (-files N) (-rounds N) (-threads N)\n");
+    fprintf(stderr, "    computes update plans for random files concurrently and checks them against sequential results\n");
+    fprintf(stderr, "    default: 16 files, 4 rounds, 8 threads; exit code is nonzero on failure\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  tdmsync check-sequential\n");
+    fprintf(stderr, "    checks that sequential matching finds all unchanged blocks around a change in random file\n");
+    fprintf(stderr, "    exit code is nonzero on failure\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
 std::vector<std::string> arguments;
 
+//wall clock time in seconds (note: clock() sums CPU time of all threads)
+double getTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//finds option "-name value" in arguments, removes it and returns its value
+//returns false if there is no such option
+bool extractOption(const char *name, std::string &value) {
+    for (size_t i = 0; i < arguments.size(); i++) {
+        if (arguments[i] != name)
+            continue;
+        if (i + 1 >= arguments.size()) {
+            fprintf(stderr, "Missing value for option %s\n\n", name);
+            exit_usage();
+        }
+        value = arguments[i + 1];
+        arguments.erase(arguments.begin() + i, arguments.begin() + i + 2);
+        return true;
+    }
+    return false;
+}
+
+//finds option "-name" (without value) in arguments and removes it
+bool extractFlag(const char *name) {
+    for (size_t i = 0; i < arguments.size(); i++) {
+        if (arguments[i] == name) {
+            arguments.erase(arguments.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+int extractIntOption(const char *name, int defaultValue) {
+    std::string str;
+    if (!extractOption(name, str))
+        return defaultValue;
+    int value;
+    if (sscanf(str.c_str(), "%d", &value) != 1) {
+        fprintf(stderr, "Option %s must be integer: \"%s\"\n\n", name, str.c_str());
+        exit_usage();
+    }
+    return value;
+}
+
+//how data files are accessed
+enum FileBackend {
+    fbStdio,        //usual buffered files
+    fbMmap,         //-mmap: files being read are memory-mapped
+    fbUring,        //-uring: io_uring with several reads in flight and write-behind
+};
+
+FileBackend extractBackend() {
+    bool useMmap = extractFlag("-mmap");
+    bool useUring = extractFlag("-uring");
+    if (useUring) {
+        if (UringFile::isSupported())
+            return fbUring;
+        fprintf(stderr, "io_uring is not supported, using stdio instead\n");
+    }
+    return useMmap ? fbMmap : fbStdio;
+}
+
+//opens file for reading with the specified backend
+std::unique_ptr<BaseFile> openReadFile(const std::string &filename, FileBackend backend) {
+    if (backend == fbMmap) {
+        std::unique_ptr<MmapFile> file(new MmapFile());
+        file->open(filename.c_str());
+        return std::unique_ptr<BaseFile>(std::move(file));
+    }
+    if (backend == fbUring) {
+        std::unique_ptr<UringFile> file(new UringFile());
+        file->open(filename.c_str(), UringFile::Read);
+        return std::unique_ptr<BaseFile>(std::move(file));
+    }
+    std::unique_ptr<StdioFile> file(new StdioFile());
+    file->open(filename.c_str(), StdioFile::Read);
+    return std::unique_ptr<BaseFile>(std::move(file));
+}
+
+//opens file for writing with the specified backend (memory mapping is not used for writing)
+std::unique_ptr<BaseFile> openWriteFile(const std::string &filename, FileBackend backend) {
+    if (backend == fbUring) {
+        std::unique_ptr<UringFile> file(new UringFile());
+        file->open(filename.c_str(), UringFile::Write);
+        return std::unique_ptr<BaseFile>(std::move(file));
+    }
+    std::unique_ptr<StdioFile> file(new StdioFile());
+    file->open(filename.c_str(), StdioFile::Write);
+    return std::unique_ptr<BaseFile>(std::move(file));
+}
+
 void commandPrepare() {
+    int threadsNum = extractIntOption("-threads", 1);
+    FileBackend backend = extractBackend();
+    MetaFormat format;
+    if (extractFlag("-compact"))
+        format = MetaFormat::compact();
+    if (extractFlag("-sequential")) {
+        format.sequentialMatch = true;
+        format.checksumBytes = MetaFormat::CHECKSUM_BYTES_AUTO;
+    }
+    format.checksumBytes = extractIntOption("-checksum-bytes", format.checksumBytes);
+    if (format.checksumBytes != MetaFormat::CHECKSUM_BYTES_AUTO && (format.checksumBytes < 0 || format.checksumBytes > 4)) {
+        fprintf(stderr, "Checksum bytes must be from 1 to 4\n\n");
+        exit_usage();
+    }
+    std::string hashName = "sha1";
+    extractOption("-hash", hashName);
+    if (hashName == "sha1")
+        format.strongHash = shSha1;
+    else if (hashName == "murmur3")
+        format.strongHash = shMurmur3;
+    else {
+        fprintf(stderr, "Unknown hash algorithm \"%s\"\n\n", hashName.c_str());
+        exit_usage();
+    }
+    std::string rollingName = "polyhash";
+    extractOption("-rolling", rollingName);
+    if (rollingName == "polyhash")
+        format.rollingHash = rhPolyhash;
+    else if (rollingName == "buzhash")
+        format.rollingHash = rhBuzhash;
+    else {
+        fprintf(stderr, "Unknown rolling hash algorithm \"%s\"\n\n", rollingName.c_str());
+        exit_usage();
+    }
     if (arguments.size() < 2) {
         fprintf(stderr, "Prepare: missing file path argument\n\n");
         exit_usage();
@@ -48,26 +243,107 @@ void commandPrepare() {
     if (!(arguments.size() >= 3 && sscanf(arguments[2].c_str(), "%d", &blockSize) == 1))
         blockSize = 4096;
     fprintf(stderr, "Block size: %d\n", blockSize);
+    fprintf(stderr, "Threads: %d\n", threadsNum);
+    fprintf(stderr, "Hash: %s\n", hashName.c_str());
+    fprintf(stderr, "Rolling hash: %s\n", rollingName.c_str());
 
-    int starttime = clock();
+    double starttime = getTime();
     //===========================================
 
-    StdioFile dataFile;
-    dataFile.open(dataFn.c_str(), StdioFile::Read);
+    std::unique_ptr<BaseFile> dataFile = openReadFile(dataFn, backend);
     FileInfo info;
-    info.computeFromFile(dataFile, blockSize);
+    info.computeFromFile(*dataFile, blockSize, threadsNum, format);
 
     StdioFile metaFile;
     metaFile.open(metaFn.c_str(), StdioFile::Write);
     info.serialize(metaFile);
     metaFile.flush();
+    printf("Metainfo: %d blocks, %d bytes of checksum and %d bytes of hash per block, %0.0lf KB total\n",
+        (int)info.blocks.size(), info.format.storedChecksumSize(), info.format.storedHashSize(), metaFile.getSize() / 1024.0
+    );
 
     //===========================================
-    int deltatime = clock() - starttime;
-    printf("Finished in %0.2lf sec\n", double(deltatime) / CLOCKS_PER_SEC);
+    double deltatime = getTime() - starttime;
+    printf("Finished in %0.2lf sec\n", deltatime);
+}
+
+ChecksumLookup extractLookupOption() {
+    ChecksumLookup lookup = clAuto;
+    std::string lookupName;
+    if (extractOption("-lookup", lookupName)) {
+        if (lookupName == "auto")
+            lookup = clAuto;
+        else if (lookupName == "phf")
+            lookup = clPhf;
+        else if (lookupName == "binsearch")
+            lookup = clBinsearch;
+        else if (lookupName == "buckets")
+            lookup = clBuckets;
+        else {
+            fprintf(stderr, "Unknown lookup structure \"%s\"\n\n", lookupName.c_str());
+            exit_usage();
+        }
+    }
+    return lookup;
+}
+
+//returns true if remote segments must be coalesced, fills cost model for it
+bool extractCoalesceOption(RangeCostModel &model) {
+    bool coalesce = extractFlag("-coalesce");
+    std::string value;
+    if (extractOption("-range-overhead", value))
+        model.rangeOverhead = atoll(value.c_str());
+    if (extractOption("-rtt", value))
+        model.rangeRtt = atof(value.c_str()) * 1e-3;
+    if (extractOption("-bandwidth", value))
+        model.bandwidth = atof(value.c_str()) * 1e+6;
+    return coalesce;
+}
+
+#ifdef WITH_CURL
+CurlDownloader::BatchOptions extractBatchOptions() {
+    CurlDownloader::BatchOptions options;
+    options.connectionsNum = extractIntOption("-connections", options.connectionsNum);
+    options.maxRanges = extractIntOption("-batch-ranges", options.maxRanges);
+    options.maxBytes = int64_t(extractIntOption("-batch-size", int(options.maxBytes >> 10))) << 10;
+    options.retriesNum = extractIntOption("-retries", options.retriesNum);
+    return options;
+}
+#endif
+
+ScanMode extractScanOption() {
+    ScanMode scanMode = smExhaustive;
+    std::string scanName;
+    if (extractOption("-scan", scanName)) {
+        if (scanName == "exhaustive")
+            scanMode = smExhaustive;
+        else if (scanName == "skip")
+            scanMode = smSkipAhead;
+        else if (scanName == "aligned")
+            scanMode = smAligned;
+        else {
+            fprintf(stderr, "Unknown scan mode \"%s\"\n\n", scanName.c_str());
+            exit_usage();
+        }
+    }
+    return scanMode;
 }
 
 void commandUpdate() {
+    int threadsNum = extractIntOption("-threads", 1);
+    FileBackend backend = extractBackend();
+    ChecksumLookup lookup = extractLookupOption();
+    ScanMode scanMode = extractScanOption();
+    bool streaming = extractFlag("-stream");
+    bool inPlace = extractFlag("-inplace");
+    RangeCostModel rangeCost;
+    bool coalesce = extractCoalesceOption(rangeCost);
+    #ifdef WITH_CURL
+    CurlDownloader::BatchOptions batchOptions = extractBatchOptions();
+    #endif
+    std::vector<std::string> extraFns;
+    for (std::string extraFn; extractOption("-source", extraFn); )
+        extraFns.push_back(extraFn);
     if (arguments.size() < 4) {
         fprintf(stderr, "Update: missing type, source or destination argument\n\n");
         exit_usage();
@@ -97,19 +373,34 @@ void commandUpdate() {
     fprintf(stderr, "  %-40s  : source file to be synchronized with\n", dataUri.c_str());
     fprintf(stderr, "  %-40s  : source file metainformation\n", metaUri.c_str());
     fprintf(stderr, "  %-40s  : local file with metainformation to be read\n", metaUri.c_str());
-    fprintf(stderr, "  %-40s  : data downloaded from source file\n", downFn.c_str());
+    if (!streaming)
+        fprintf(stderr, "  %-40s  : data downloaded from source file\n", downFn.c_str());
+    for (const std::string &extraFn : extraFns)
+        fprintf(stderr, "  %-40s  : another local file with blocks\n", extraFn.c_str());
 
-    int starttime = clock();
+    double starttime = getTime();
     //=======================================
 
+    #ifdef WITH_CURL
+    //all HTTP requests of the update go through same connections
+    CurlSession curlSession;
+    #endif
+    auto printFinished = [&]() {
+        #ifdef WITH_CURL
+        if (!isLocal)
+            printf("Sent %d HTTP requests over %d new connections\n", (int)curlSession.getRequestsNum(), (int)curlSession.getConnectsNum());
+        #endif
+        printf("Finished in %0.2lf sec\n", getTime() - starttime);
+    };
+
     #ifdef WITH_CURL
     if (!isLocal) {
-        int metadownload_starttime = clock();
+        double metadownload_starttime = getTime();
         StdioFile metaFile;
         metaFile.open(metaFn.c_str(), StdioFile::Write);
-        CurlDownloader curlWrapper;
+        CurlDownloader curlWrapper(&curlSession);
         curlWrapper.downloadMeta(metaFile, metaUri.c_str());
-        printf("Downloaded %0.0lf KB of metadata in %0.2lf sec\n", metaFile.getSize() / 1024.0, double(clock() - metadownload_starttime) / CLOCKS_PER_SEC);
+        printf("Downloaded %0.0lf KB of metadata in %0.2lf sec\n", metaFile.getSize() / 1024.0, getTime() - metadownload_starttime);
     }
     #endif
     
@@ -118,43 +409,220 @@ void commandUpdate() {
     FileInfo info;
     info.deserialize(metaFile);
 
-    int analysis_starttime = clock();
-    StdioFile localFile;
-    localFile.open(localFn.c_str(), StdioFile::Read);
-    UpdatePlan plan = info.createUpdatePlan(localFile);
+    double analysis_starttime = getTime();
+    std::unique_ptr<BaseFile> localFile = openReadFile(localFn, backend);
+    std::vector<std::unique_ptr<BaseFile>> extraFiles;
+    std::vector<BaseFile*> localFiles = {localFile.get()};
+    for (const std::string &extraFn : extraFns) {
+        extraFiles.push_back(openReadFile(extraFn, backend));
+        localFiles.push_back(extraFiles.back().get());
+    }
+    UpdatePlan plan = info.createUpdatePlan(localFiles, threadsNum, lookup, scanMode);
+    if (coalesce) {
+        int64_t oldRemote = plan.bytesRemote;
+        int merged = plan.coalesceRemote(rangeCost);
+        printf("Coalesced remote segments: %d fewer ranges, %0.0lf KB more to download\n", merged, (plan.bytesRemote - oldRemote) / 1024.0);
+    }
     plan.print();
-    printf("Analyzed %0.0lf KB of local file in %0.2lf sec\n", localFile.getSize() / 1024.0, double(clock() - analysis_starttime) / CLOCKS_PER_SEC);
+    printf("Analyzed %0.0lf KB of local file in %0.2lf sec\n", localFile->getSize() / 1024.0, getTime() - analysis_starttime);
     
+    #ifdef WITH_CURL
+    //downloads remote segments in batches of byte ranges
+    auto downloadMissingParts = [&](BaseFile &sink, DownloadJournal *journal) {
+        CurlDownloader curlWrapper(&curlSession);
+        curlWrapper.setBatchOptions(batchOptions);
+        curlWrapper.downloadMissingParts(sink, plan, dataUri.c_str(), journal);
+        if (curlWrapper.getBatchesNum() > 0)
+            printf("Sent %d batch requests, %d ranges downloaded again one by one, %d retries, %0.1lf transfers at once on average\n",
+                curlWrapper.getBatchesNum(), curlWrapper.getFallbacksNum(), curlWrapper.getRetriesNum(), curlWrapper.getAverageTransfersNum());
+    };
+    #endif
+
+    //writes remote segments into specified file (for streaming and in-place modes)
+    auto downloadRemote = [&](BaseFile &sink) {
+        if (isLocal) {
+            std::unique_ptr<BaseFile> remoteFile = openReadFile(dataUri, backend);
+            plan.createDownloadFile(*remoteFile, sink);
+        }
+        #ifdef WITH_CURL
+        else
+            downloadMissingParts(sink, nullptr);
+        #endif
+    };
+
+    if (inPlace && !plan.inPlaceFeasible) {
+        printf("In-place update is not feasible, writing updated file %s instead\n", resultFn.c_str());
+        inPlace = false;
+    }
+    if (inPlace) {
+        //local file is modified directly, neither download file nor result file is created
+        double inplace_starttime = getTime();
+        localFile.reset();
+        StdioFile rdwrLocalFile;
+        rdwrLocalFile.open(localFn.c_str(), StdioFile::ReadWrite);
+        localFiles[0] = &rdwrLocalFile;
+        plan.applyInPlace(localFiles, downloadRemote);
+        printf("Downloaded %0.0lf KB of missing blocks and patched %0.0lf KB file in place in %0.2lf sec\n", plan.bytesRemote / 1024.0, rdwrLocalFile.getSize() / 1024.0, getTime() - inplace_starttime);
+        printFinished();
+        return;
+    }
+
+    if (streaming) {
+        //remote segments go straight into result file, no download file is created
+        double stream_starttime = getTime();
+        std::unique_ptr<BaseFile> resultFile = openWriteFile(resultFn, backend);
+        plan.applyStreaming(localFiles, *resultFile, downloadRemote);
+        resultFile->flush();
+        printf("Downloaded %0.0lf KB of missing blocks and patched %0.0lf KB file in %0.2lf sec\n", plan.bytesRemote / 1024.0, resultFile->getSize() / 1024.0, getTime() - stream_starttime);
+        printFinished();
+        return;
+    }
+
+    //with URL, progress of download is kept in journal file, so that interrupted download is resumed by the next run
+    std::unique_ptr<DownloadJournal> journal;
     if (isLocal) {
-        StdioFile remoteFile;
-        remoteFile.open(dataUri.c_str(), StdioFile::Read);
-        StdioFile downloadFile;
-        downloadFile.open(downFn.c_str(), StdioFile::Write);
-        plan.createDownloadFile(remoteFile, downloadFile);
+        std::unique_ptr<BaseFile> remoteFile = openReadFile(dataUri, backend);
+        std::unique_ptr<BaseFile> downloadFile = openWriteFile(downFn, backend);
+        plan.createDownloadFile(*remoteFile, *downloadFile);
     }
     #ifdef WITH_CURL
     else {
-        int updatedownload_starttime = clock();
-        StdioFile downloadFile;
-        downloadFile.open(downFn.c_str(), StdioFile::Write);
-        CurlDownloader curlWrapper;
-        curlWrapper.downloadMissingParts(downloadFile, plan, dataUri.c_str());
-        printf("Downloaded %0.0lf KB of missing blocks in %0.2lf sec\n", downloadFile.getSize() / 1024.0, double(clock() - updatedownload_starttime) / CLOCKS_PER_SEC);
+        double updatedownload_starttime = getTime();
+        std::unique_ptr<BaseFile> downloadFile;
+        journal.reset(new DownloadJournal(downFn));
+        if (journal->start(info, plan)) {
+            printf("Resuming interrupted download: %0.0lf KB of %0.0lf KB were downloaded before\n", journal->getWrittenBytes() / 1024.0, plan.bytesRemote / 1024.0);
+            //download file is filled up, not truncated
+            std::unique_ptr<StdioFile> file(new StdioFile());
+            file->open(downFn.c_str(), StdioFile::ReadWrite);
+            downloadFile = std::move(file);
+        }
+        else
+            downloadFile = openWriteFile(downFn, backend);
+        downloadMissingParts(*downloadFile, journal.get());
+        printf("Downloaded %0.0lf KB of missing blocks in %0.2lf sec\n", downloadFile->getSize() / 1024.0, getTime() - updatedownload_starttime);
     }
     #endif
 
-    int updatefile_starttime = clock();
-    StdioFile downloadFile;
-    downloadFile.open(downFn.c_str(), StdioFile::Read);
-    StdioFile resultFile;
-    resultFile.open(resultFn.c_str(), StdioFile::Write);
-    plan.apply(localFile, downloadFile, resultFile);
-    resultFile.flush();
-    printf("Patched %0.0lf KB file in %0.2lf sec\n", resultFile.getSize() / 1024.0, double(clock() - updatefile_starttime) / CLOCKS_PER_SEC);
+    double updatefile_starttime = getTime();
+    std::unique_ptr<BaseFile> downloadFile = openReadFile(downFn, backend);
+    std::unique_ptr<BaseFile> resultFile = openWriteFile(resultFn, backend);
+    plan.apply(localFiles, *downloadFile, *resultFile);
+    resultFile->flush();
+    printf("Patched %0.0lf KB file in %0.2lf sec\n", resultFile->getSize() / 1024.0, getTime() - updatefile_starttime);
+    if (journal)
+        journal->remove();  //update is done: there is nothing to resume
 
     //===========================================
-    int deltatime = clock() - starttime;
-    printf("Finished in %0.2lf sec\n", double(deltatime) / CLOCKS_PER_SEC);
+    printFinished();
+}
+
+void commandUpdateMany() {
+    SyncManyOptions options;
+    options.threadsNum = extractIntOption("-threads", 0);
+    options.connectionsNum = extractIntOption("-connections", 4);
+    options.memoryBudget = int64_t(extractIntOption("-memory", 1024)) << 20;
+    options.lookup = extractLookupOption();
+    options.scanMode = extractScanOption();
+    options.streaming = extractFlag("-stream");
+    options.coalesce = extractCoalesceOption(options.rangeCost);
+    if (arguments.size() < 2) {
+        fprintf(stderr, "Update-many: missing manifest path argument\n\n");
+        exit_usage();
+    }
+
+    std::vector<SyncItem> items;
+    StdioFile manifestFile;
+    manifestFile.open(arguments[1].c_str(), StdioFile::Read);
+    std::string text(manifestFile.getSize(), '\0');
+    if (!text.empty())
+        manifestFile.read(&text[0], text.size());
+    for (size_t pos = 0; pos < text.size(); ) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        pos = end + 1;
+        char source[4096], local[4096];
+        if (line.empty() || line[0] == '#' || sscanf(line.c_str(), "%4095s", source) != 1)
+            continue;
+        if (sscanf(line.c_str(), "%4095s %4095s", source, local) != 2) {
+            fprintf(stderr, "Update-many: wrong manifest line \"%s\"\n\n", line.c_str());
+            exit_usage();
+        }
+        items.push_back(SyncItem{source, local});
+    }
+    fprintf(stderr, "Updating %d files with %d threads and %d connections\n", (int)items.size(), options.threadsNum, options.connectionsNum);
+
+    SyncManyStats stats = updateMany(items, options);
+
+    printf("%-40s %10s %10s %10s %7s %7s %7s %7s\n", "file", "meta KB", "local KB", "remote KB", "meta s", "plan s", "down s", "apply s");
+    for (size_t i = 0; i < items.size(); i++) {
+        const SyncItemStats &st = stats.items[i];
+        printf("%-40s %10.0lf %10.0lf %10.0lf %7.2lf %7.2lf %7.2lf %7.2lf\n", items[i].local.c_str(),
+            st.bytesMeta / 1024.0, st.bytesLocal / 1024.0, st.bytesRemote / 1024.0,
+            st.timeMeta, st.timePlan, st.timeDownload, st.timeApply
+        );
+        if (!st.ok)
+            printf("  failed: %s\n", st.error.c_str());
+    }
+    const SyncItemStats &tot = stats.total;
+    printf("%-40s %10.0lf %10.0lf %10.0lf %7.2lf %7.2lf %7.2lf %7.2lf\n", "total",
+        tot.bytesMeta / 1024.0, tot.bytesLocal / 1024.0, tot.bytesRemote / 1024.0,
+        tot.timeMeta, tot.timePlan, tot.timeDownload, tot.timeApply
+    );
+    if (stats.httpRequests > 0)
+        printf("Sent %d HTTP requests over %d new connections\n", (int)stats.httpRequests, (int)stats.httpConnects);
+    printf("Updated %d of %d files in %0.2lf sec\n", int(items.size()) - stats.failedNum, (int)items.size(), stats.wallTime);
+    if (stats.failedNum)
+        exit(1);
+}
+
+void commandBenchLookup() {
+    int64_t queries = 100000000;
+    std::string queriesStr;
+    if (extractOption("-queries", queriesStr))
+        queries = atoll(queriesStr.c_str());
+    std::vector<int64_t> blockCounts;
+    for (size_t i = 1; i < arguments.size(); i++)
+        blockCounts.push_back(atoll(arguments[i].c_str()));
+    if (blockCounts.empty())
+        blockCounts = {1000, 1000000, 50000000};
+    benchmarkLookup(blockCounts, queries);
+}
+
+void commandBenchIO() {
+    int rounds = extractIntOption("-rounds", 3);
+    if (arguments.size() < 2)
+        exit_usage();
+    std::string remoteFn = arguments[1];
+    std::string localFn = (arguments.size() >= 3 ? arguments[2] : remoteFn);
+    int blockSize = (arguments.size() >= 4 ? atoi(arguments[3].c_str()) : 4096);
+    benchmarkFileIO(remoteFn, localFn, blockSize, rounds);
+}
+
+void commandBenchMultipart() {
+    int64_t totalMb = extractIntOption("-total", 4096);
+    int chunkKb = extractIntOption("-chunk", 16);
+    std::vector<int> partSizes;
+    for (size_t i = 1; i < arguments.size(); i++)
+        partSizes.push_back(atoi(arguments[i].c_str()));
+    if (partSizes.empty())
+        partSizes = {256, 4096, 65536, 1 << 20};
+    benchmarkMultipart(partSizes, totalMb << 20, chunkKb << 10);
+}
+
+void commandStressPlans() {
+    int filesNum = extractIntOption("-files", 16);
+    int rounds = extractIntOption("-rounds", 4);
+    int threadsNum = extractIntOption("-threads", 8);
+    if (!stressConcurrentPlans(filesNum, rounds, threadsNum))
+        exit(1);
+}
+
+void commandCheckSequential() {
+    if (!checkSequentialMatch())
+        exit(1);
 }
 
 int main(int argc, char **argv) {
@@ -176,6 +644,24 @@ int main(int argc, char **argv) {
         else if (arguments[0] == "update") {
             commandUpdate();
         }
+        else if (arguments[0] == "update-many") {
+            commandUpdateMany();
+        }
+        else if (arguments[0] == "bench-lookup") {
+            commandBenchLookup();
+        }
+        else if (arguments[0] == "bench-io") {
+            commandBenchIO();
+        }
+        else if (arguments[0] == "bench-multipart") {
+            commandBenchMultipart();
+        }
+        else if (arguments[0] == "stress-plans") {
+            commandStressPlans();
+        }
+        else if (arguments[0] == "check-sequential") {
+            commandCheckSequential();
+        }
         else {
             fprintf(stderr, "Unknown command \"%s\"\n\n", arguments[0].c_str());
             exit_usage();
@@ -0,0 +1,148 @@
+#include "multipart.h"
+#include <string.h>
+#include <algorithm>
+
+#undef min
+#undef max
+
+
+namespace TdmSync {
+
+static inline char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+//case-insensitive check for prefix (HTTP header names are case-insensitive, HTTP/2 sends them in lowercase)
+//returns pointer to the rest of string after the prefix, or nullptr if there is no such prefix
+//note: runs on every header line of every part, so locale-aware tolower is avoided
+static const char *skipPrefixNoCase(const char *str, size_t len, const char *prefix) {
+    for (size_t i = 0; prefix[i]; i++)
+        if (i >= len || lowerAscii(str[i]) != lowerAscii(prefix[i]))
+            return nullptr;
+    return str + strlen(prefix);
+}
+
+//parses decimal number at ptr, moves ptr past it; returns false if there are no digits or too many of them
+static bool parseNumber(const char *&ptr, const char *end, int64_t &value) {
+    const char *start = ptr;
+    value = 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9' && ptr - start < 18)
+        value = value * 10 + (*ptr++ - '0');
+    return ptr > start && (ptr == end || *ptr < '0' || *ptr > '9');
+}
+
+bool parseContentRange(const char *value, size_t len, int64_t &from, int64_t &to) {
+    //called for every part of multipart response, so no allocations here
+    const char *end = value + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    value = skipPrefixNoCase(value, end - value, "bytes");
+    if (!value || value == end || (*value != ' ' && *value != '\t'))
+        return false;
+    value++;
+    if (!parseNumber(value, end, from) || value == end || *value++ != '-')
+        return false;
+    if (!parseNumber(value, end, to) || value == end || *value != '/')
+        return false;
+    return from <= to;
+}
+
+
+void MultipartParser::startMultipart(const std::string &boundary) {
+    *this = MultipartParser();
+    delimiter = "--" + boundary;
+    state = sDelimiter;
+}
+
+void MultipartParser::startSinglePart(int64_t from, int64_t to) {
+    *this = MultipartParser();
+    singlePart = true;
+    partOffset = from;
+    partLeft = to - from + 1;
+    state = partLeft > 0 ? sBody : sDone;
+}
+
+bool MultipartParser::feed(const char *data, size_t size, const Sink &sink) {
+    while (size > 0) {
+        if (state == sBody) {
+            //payload goes to sink right from the input buffer
+            size_t chunk = size_t(std::min(int64_t(size), partLeft));
+            if (!sink(partOffset, data, chunk)) {
+                state = sError;
+                return false;
+            }
+            data += chunk;
+            size -= chunk;
+            partOffset += chunk;
+            partLeft -= chunk;
+            if (partLeft == 0)
+                state = singlePart ? sDone : sDelimiter;
+        }
+        else if (state == sDelimiter || state == sHeader) {
+            //collect one line: boundary, header or empty line
+            const char *eol = (const char*)memchr(data, '\n', size);
+            size_t take = eol ? eol - data + 1 : size;
+            bool ok = true;
+            if (eol && line.empty())
+                ok = processLine(data, take);     //whole line is in input: no need to copy it
+            else if (line.size() + take > MaxLineLength)
+                ok = false;
+            else {
+                line.append(data, take);
+                if (eol) {
+                    ok = processLine(line.data(), line.size());
+                    line.clear();
+                }
+            }
+            if (!ok) {
+                state = sError;
+                return false;
+            }
+            data += take;
+            size -= take;
+        }
+        else if (state == sDone)
+            return true;        //epilogue is ignored
+        else
+            return false;       //not started or failed already
+    }
+    return true;
+}
+
+bool MultipartParser::processLine(const char *ptr, size_t len) {
+    //drop line break and transport padding
+    while (len > 0 && (ptr[len-1] == '\n' || ptr[len-1] == '\r' || ptr[len-1] == ' ' || ptr[len-1] == '\t'))
+        len--;
+
+    if (state == sDelimiter) {
+        size_t dlen = delimiter.size();
+        if (len >= dlen && memcmp(ptr, delimiter.data(), dlen) == 0) {
+            if (len == dlen) {
+                state = sHeader;
+                partFrom = partTo = -1;
+            }
+            else if (len == dlen + 2 && memcmp(ptr + dlen, "--", 2) == 0)
+                state = sDone;
+        }
+        //everything else is preamble or line break after payload
+        return true;
+    }
+
+    //state == sHeader
+    if (len == 0) {
+        //end of part header: payload follows
+        if (partFrom < 0)
+            return false;   //every part must have Content-Range, otherwise we don't know where its data goes
+        partOffset = partFrom;
+        partLeft = partTo - partFrom + 1;
+        state = sBody;
+        return true;
+    }
+    if (const char *value = skipPrefixNoCase(ptr, len, "Content-Range:")) {
+        if (!parseContentRange(value, ptr + len - value, partFrom, partTo))
+            return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef _TDM_SYNC_MULTIPART_H_502914_
+#define _TDM_SYNC_MULTIPART_H_502914_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+namespace TdmSync {
+
+//parses value of Content-Range header: "bytes 100-200/5896303" (total may be "*")
+//returns false if format is wrong
+bool parseContentRange(const char *value, size_t len, int64_t &from, int64_t &to);
+
+//streaming parser of multipart/byteranges response body (see RFC 7233, appendix A):
+//    --5b69c45c39b6
+//    Content-Type: text/plain
+//    Content-Range: bytes 100-200/5896303
+//
+//    <101 bytes of data>
+//    --5b69c45c39b6
+//    ...
+//    --5b69c45c39b6--
+//length of every part is known from its Content-Range, so payload is never scanned or buffered:
+//  it is passed to sink straight from the input chunk, together with its offset in the remote file
+//only the lines between parts (boundaries and part headers) are collected, they are found with memchr
+//parts can come in any order, and server may merge several requested ranges into one part
+class MultipartParser {
+public:
+    //receives payload: offset in the remote file of its first byte, data pointer and size
+    //returns false to abort parsing
+    typedef std::function<bool(int64_t offset, const char *data, size_t size)> Sink;
+
+    //body is multipart with specified boundary token (from Content-Type header of response)
+    void startMultipart(const std::string &boundary);
+    //body is one part with specified range (not multipart response with Content-Range header of its own)
+    void startSinglePart(int64_t from, int64_t to);
+    bool isStarted() const { return state != sIdle; }
+
+    //feeds next chunk of response body, returns false if response is malformed or sink aborted
+    bool feed(const char *data, size_t size, const Sink &sink);
+    //returns true if the whole body was parsed (final boundary was seen / single part was received)
+    bool isFinished() const { return state == sDone; }
+
+private:
+    bool processLine(const char *line, size_t len);
+
+    enum State {
+        sIdle,          //not started yet
+        sDelimiter,     //waiting for boundary line (skipping preamble and line break after previous part)
+        sHeader,        //reading header lines of a part
+        sBody,          //passing payload of a part to sink
+        sDone,          //final boundary passed: everything else is ignored (epilogue)
+        sError,
+    };
+    State state = sIdle;
+    bool singlePart = false;
+    std::string delimiter;          //"--" + boundary token
+    std::string line;               //incomplete line between parts
+    int64_t partFrom = -1, partTo = -1;
+    int64_t partOffset = 0, partLeft = 0;
+
+    //line between parts cannot be longer (internal headers are short)
+    static const int MaxLineLength = 16 << 10;
+};
+
+}
+
+#endif
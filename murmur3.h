@@ -0,0 +1,23 @@
+#ifndef _TDM_MURMUR3_H_190537_
+#define _TDM_MURMUR3_H_190537_
+
+//MurmurHash3 by Austin Appleby (public domain), x64 128-bit variant
+//  https://github.com/aappleby/smhasher/blob/master/src/MurmurHash3.cpp
+//non-cryptographic hash: much faster than SHA-1, good enough for detecting changes
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//compute 128-bit hash of the specified bytes array
+//output is the pair of 64-bit values (h1, h2) written in little-endian order
+void murmur3_x64_128(uint8_t out[16], const uint8_t *data, size_t len, uint32_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
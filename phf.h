@@ -6,13 +6,16 @@
 #include <stdio.h>
 #include <vector>
 #include <random>
+#include <string>
+#include <stdexcept>
+#include "prefetch.h"
 
 //tdmsync perfect hash function library
 namespace TdmPhf {
 
 typedef std::mt19937 RndGen;
 
-std::string assertFailedMessage(const char *code, const char *file, int line) {
+inline std::string assertFailedMessage(const char *code, const char *file, int line) {
     char buff[256];
     sprintf(buff, "Assertion %s failed in %s on line %d", code, file, line);
     return buff;
@@ -52,6 +55,12 @@ struct PerfectHashFunc {
         size_t res = data[a] ^ data[b];
         return res;
     }
+    //start loading memory needed to evaluate the function on the key
+    //(call it a bit earlier than evaluate if many keys are processed)
+    inline void prefetch(Key key) const {
+        TDM_PREFETCH(&data[funcs[0].evaluate(key)]);
+        TDM_PREFETCH(&data[funcs[1].evaluate(key)]);
+    }
 
     void create(const uint32_t *keys, size_t num) {
         //choose size of auxilliary arrays: power-of-two, at least max(3*n, 32)
@@ -1,19 +1,226 @@
 #include "polyhash.h"
+#include "cpuinfo.h"
+#include <string.h>
 
-//C = -B^n mod P    (n --- window length)
-//precomputed by polyhash_compute
-uint32_t POLYHASH_NEGATOR;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define POLYHASH_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #define TARGET_AVX2
+    #else
+        #define TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
 
-uint32_t polyhash_compute(const uint8_t *data, size_t len) {
-    //hash(reversed(S)) = sum_i (S_i * B^i) mod P
-    uint32_t res = 0;
-    uint32_t pw = 1;
-    for (size_t i = 0; i < len; i++) {
-        res = (((uint64_t)res) * POLYHASH_BASE + data[i]) % POLYHASH_MODULO;
-        pw = (((uint64_t)pw) * POLYHASH_BASE) % POLYHASH_MODULO;
+//number of independent chains computed simultaneously
+#define POLYHASH_LANES 8
+
+//returns base^exp mod P
+static uint32_t polyhash_power(uint32_t base, uint64_t exp) {
+    uint32_t res = 1;
+    for (; exp; exp >>= 1) {
+        if (exp & 1)
+            res = polyhash_reduce(((uint64_t)res) * base);
+        base = polyhash_reduce(((uint64_t)base) * base);
     }
+    return res;
+}
+
+uint32_t polyhash_negator(size_t len) {
+    uint32_t pw = polyhash_power(POLYHASH_BASE, len);
     pw = POLYHASH_MODULO - pw;
     if (pw == POLYHASH_MODULO) pw = 0;
-    POLYHASH_NEGATOR = pw;
+    return pw;
+}
+
+//runs steps [from, to) on each of POLYHASH_LANES independent chains:
+//  the current value of i-th chain is saved to outs[i][t] (unless outs is NULL),
+//  then the value is updated: h[i] = (h[i] * B + adds[i][t] + rems[i][t] * negator) mod P
+//if rems is NULL, then removed bytes are considered zero (i.e. it becomes Horner's scheme)
+static void polyhash_lanes_scalar(uint32_t h[POLYHASH_LANES], const uint8_t *const *adds, const uint8_t *const *rems, uint32_t negator, uint32_t *const *outs, size_t from, size_t to) {
+    size_t t;
+    int i;
+    for (t = from; t < to; t++) {
+        for (i = 0; i < POLYHASH_LANES; i++) {
+            uint64_t x = ((uint64_t)h[i]) * POLYHASH_BASE + adds[i][t];
+            if (rems)
+                x += ((uint64_t)rems[i][t]) * negator;
+            if (outs)
+                outs[i][t] = h[i];
+            h[i] = polyhash_reduce(x);
+        }
+    }
+}
+
+#ifdef POLYHASH_X86
+//final step of reduction modulo P for 64-bit elements (less than 2 * P)
+TARGET_AVX2 static __m256i polyhash_finish_avx2(__m256i x) {
+    const __m256i modulo = _mm256_set1_epi64x(POLYHASH_MODULO);
+    const __m256i moduloMinusOne = _mm256_set1_epi64x(POLYHASH_MODULO - 1);
+    return _mm256_sub_epi64(x, _mm256_and_si256(_mm256_cmpgt_epi64(x, moduloMinusOne), modulo));
+}
+
+//loads 8 bytes at ptrs[i] + offset into i-th 64-bit element (i < 4)
+TARGET_AVX2 static __m256i polyhash_load4x8_avx2(const uint8_t *const *ptrs, size_t offset) {
+    __m128i lo = _mm_loadl_epi64((const __m128i*)(ptrs[0] + offset));
+    __m128i hi = _mm_loadl_epi64((const __m128i*)(ptrs[2] + offset));
+    lo = _mm_unpacklo_epi64(lo, _mm_loadl_epi64((const __m128i*)(ptrs[1] + offset)));
+    hi = _mm_unpacklo_epi64(hi, _mm_loadl_epi64((const __m128i*)(ptrs[3] + offset)));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+//one step of 4 chains: returns h * B + (a & 255) + (r & 255) * negator, partially reduced modulo P
+TARGET_AVX2 static __m256i polyhash_step_avx2(__m256i h, __m256i a, __m256i r, __m256i negv) {
+    const __m256i modulo = _mm256_set1_epi64x(POLYHASH_MODULO);
+    const __m256i base = _mm256_set1_epi64x(POLYHASH_BASE);
+    const __m256i byteMask = _mm256_set1_epi64x(0xFF);
+    __m256i x = _mm256_add_epi64(_mm256_and_si256(a, byteMask), _mm256_mul_epu32(_mm256_and_si256(r, byteMask), negv));
+    x = _mm256_add_epi64(x, _mm256_mul_epu32(h, base));
+    //same as polyhash_reduce, but without final subtraction
+    x = _mm256_add_epi64(_mm256_and_si256(x, modulo), _mm256_srli_epi64(x, 31));
+    x = _mm256_add_epi64(_mm256_and_si256(x, modulo), _mm256_srli_epi64(x, 31));
+    return x;
+}
+
+//same as polyhash_lanes_scalar, but processes only multiple of 8 steps
+//every 64-bit element of AVX2 register holds one chain, so 8 chains take 2 registers
+//note: values are kept partially reduced (less than P + 4) to shorten dependency chain
+//returns the first step which is not processed
+TARGET_AVX2 static size_t polyhash_lanes_avx2(uint32_t h[POLYHASH_LANES], const uint8_t *const *adds, const uint8_t *const *rems, uint32_t negator, uint32_t *const *outs, size_t from, size_t to) {
+    const __m256i negv = _mm256_set1_epi64x(negator);
+    const __m256i packIdx = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i h0, h1, a0, a1, r0, r1, rows[8];
+    uint64_t vals[POLYHASH_LANES];
+    size_t t;
+    int i, j;
+
+    h0 = _mm256_setr_epi64x(h[0], h[1], h[2], h[3]);
+    h1 = _mm256_setr_epi64x(h[4], h[5], h[6], h[7]);
+    r0 = r1 = _mm256_setzero_si256();
+
+    for (t = from; t + 8 <= to; t += 8) {
+        //load next 8 bytes of every chain, they are consumed from lowest byte
+        a0 = polyhash_load4x8_avx2(adds, t);
+        a1 = polyhash_load4x8_avx2(adds + 4, t);
+        if (rems) {
+            r0 = polyhash_load4x8_avx2(rems, t);
+            r1 = polyhash_load4x8_avx2(rems + 4, t);
+        }
+
+        for (j = 0; j < 8; j++) {
+            if (outs) {
+                //rows[j] = fully reduced values of 8 chains as 32-bit integers
+                __m256i lo = _mm256_permutevar8x32_epi32(polyhash_finish_avx2(h0), packIdx);
+                __m256i hi = _mm256_permutevar8x32_epi32(polyhash_finish_avx2(h1), packIdx);
+                rows[j] = _mm256_permute2x128_si256(lo, hi, 0x20);
+            }
+            h0 = polyhash_step_avx2(h0, a0, r0, negv);
+            h1 = polyhash_step_avx2(h1, a1, r1, negv);
+            a0 = _mm256_srli_epi64(a0, 8);
+            a1 = _mm256_srli_epi64(a1, 8);
+            r0 = _mm256_srli_epi64(r0, 8);
+            r1 = _mm256_srli_epi64(r1, 8);
+        }
+
+        if (outs) {
+            //transpose 8 x 8 matrix: rows[j][i] must be written to outs[i][t + j]
+            __m256i a0 = _mm256_unpacklo_epi32(rows[0], rows[1]);
+            __m256i a1 = _mm256_unpackhi_epi32(rows[0], rows[1]);
+            __m256i a2 = _mm256_unpacklo_epi32(rows[2], rows[3]);
+            __m256i a3 = _mm256_unpackhi_epi32(rows[2], rows[3]);
+            __m256i a4 = _mm256_unpacklo_epi32(rows[4], rows[5]);
+            __m256i a5 = _mm256_unpackhi_epi32(rows[4], rows[5]);
+            __m256i a6 = _mm256_unpacklo_epi32(rows[6], rows[7]);
+            __m256i a7 = _mm256_unpackhi_epi32(rows[6], rows[7]);
+            __m256i b0 = _mm256_unpacklo_epi64(a0, a2);
+            __m256i b1 = _mm256_unpackhi_epi64(a0, a2);
+            __m256i b2 = _mm256_unpacklo_epi64(a1, a3);
+            __m256i b3 = _mm256_unpackhi_epi64(a1, a3);
+            __m256i b4 = _mm256_unpacklo_epi64(a4, a6);
+            __m256i b5 = _mm256_unpackhi_epi64(a4, a6);
+            __m256i b6 = _mm256_unpacklo_epi64(a5, a7);
+            __m256i b7 = _mm256_unpackhi_epi64(a5, a7);
+            _mm256_storeu_si256((__m256i*)(outs[0] + t), _mm256_permute2x128_si256(b0, b4, 0x20));
+            _mm256_storeu_si256((__m256i*)(outs[1] + t), _mm256_permute2x128_si256(b1, b5, 0x20));
+            _mm256_storeu_si256((__m256i*)(outs[2] + t), _mm256_permute2x128_si256(b2, b6, 0x20));
+            _mm256_storeu_si256((__m256i*)(outs[3] + t), _mm256_permute2x128_si256(b3, b7, 0x20));
+            _mm256_storeu_si256((__m256i*)(outs[4] + t), _mm256_permute2x128_si256(b0, b4, 0x31));
+            _mm256_storeu_si256((__m256i*)(outs[5] + t), _mm256_permute2x128_si256(b1, b5, 0x31));
+            _mm256_storeu_si256((__m256i*)(outs[6] + t), _mm256_permute2x128_si256(b2, b6, 0x31));
+            _mm256_storeu_si256((__m256i*)(outs[7] + t), _mm256_permute2x128_si256(b3, b7, 0x31));
+        }
+    }
+
+    _mm256_storeu_si256((__m256i*)&vals[0], polyhash_finish_avx2(h0));
+    _mm256_storeu_si256((__m256i*)&vals[4], polyhash_finish_avx2(h1));
+    for (i = 0; i < POLYHASH_LANES; i++)
+        h[i] = (uint32_t)vals[i];
+    return t;
+}
+#endif
+
+//runs "steps" steps on POLYHASH_LANES independent chains (see polyhash_lanes_scalar)
+static void polyhash_lanes(uint32_t h[POLYHASH_LANES], const uint8_t *const *adds, const uint8_t *const *rems, uint32_t negator, uint32_t *const *outs, size_t steps) {
+    size_t t = 0;
+#ifdef POLYHASH_X86
+    if (cpu_has_avx2())
+        t = polyhash_lanes_avx2(h, adds, rems, negator, outs, 0, steps);
+#endif
+    polyhash_lanes_scalar(h, adds, rems, negator, outs, t, steps);
+}
+
+uint32_t polyhash_compute(const uint8_t *data, size_t len) {
+    //hash(reversed(S)) = sum_i (S_i * B^i) mod P
+    //bytes are split into POLYHASH_LANES segments, which are hashed independently and then combined
+    size_t seg = len / POLYHASH_LANES;
+    uint32_t h[POLYHASH_LANES] = {0};
+    const uint8_t *starts[POLYHASH_LANES];
+    uint32_t segPower = polyhash_power(POLYHASH_BASE, seg);
+    uint32_t res = 0;
+    size_t i;
+    for (i = 0; i < POLYHASH_LANES; i++)
+        starts[i] = data + i * seg;
+    polyhash_lanes(h, starts, NULL, 0, NULL, seg);
+    for (i = 0; i < POLYHASH_LANES; i++)
+        res = polyhash_reduce(((uint64_t)res) * segPower + h[i]);
+    for (i = POLYHASH_LANES * seg; i < len; i++)
+        res = polyhash_reduce(((uint64_t)res) * POLYHASH_BASE + data[i]);
     return res;
 }
+
+void polyhash_compute_many(uint32_t *values, const uint8_t *data, size_t len, size_t count) {
+    uint32_t negator = polyhash_negator(len);
+    size_t lane = count / POLYHASH_LANES;
+    size_t k = 0;
+    if (count == 0)
+        return;
+
+    //windows are split into POLYHASH_LANES ranges, each range is rolled by independent chain
+    //computing starting value of a chain costs O(len), so it is done only if there are many windows
+    if (lane >= 2 && 2 * lane >= len) {
+        uint32_t h[POLYHASH_LANES] = {0};
+        const uint8_t *adds[POLYHASH_LANES], *rems[POLYHASH_LANES];
+        uint32_t *outs[POLYHASH_LANES];
+        int i;
+        for (i = 0; i < POLYHASH_LANES; i++) {
+            rems[i] = data + i * lane;
+            adds[i] = rems[i] + len;
+            outs[i] = values + i * lane;
+        }
+        //Horner's scheme: hash of the first window of every chain
+        polyhash_lanes(h, rems, NULL, 0, NULL, len);
+        //rolling: note that the last window of every chain is not moved further
+        polyhash_lanes(h, adds, rems, negator, outs, lane - 1);
+        for (i = 0; i < POLYHASH_LANES; i++)
+            outs[i][lane - 1] = h[i];
+        k = POLYHASH_LANES * lane;
+    }
+    else {
+        values[0] = polyhash_compute(data, len);
+        k = 1;
+    }
+
+    //remaining windows are processed sequentially
+    for (; k < count; k++)
+        values[k] = polyhash_fast_update(values[k - 1], data[k - 1 + len], data[k - 1], negator);
+}
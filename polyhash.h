@@ -20,18 +20,33 @@ static const uint32_t POLYHASH_BASE = 103945823;        //B: primitive root modu
 //theory: if B is chosen randomly, then any two different windows
 //        generate hash collision with chance at most (len/P)
 
-extern uint32_t POLYHASH_NEGATOR;
+//returns x mod POLYHASH_MODULO (x must be less than 2^63)
+//uses 2^31 = 1 (mod P) instead of slow division
+static INLINE uint32_t polyhash_reduce(uint64_t x) {
+  x = (x & POLYHASH_MODULO) + (x >> 31);
+  x = (x & POLYHASH_MODULO) + (x >> 31);
+  return (uint32_t)(x >= POLYHASH_MODULO ? x - POLYHASH_MODULO : x);
+}
 
 //compute hash value of the specified bytes array (window)
-//note: also precomputes and saves POLYHASH_NEGATOR coefficient
 uint32_t polyhash_compute(const uint8_t *data, size_t len);
 
+//compute coefficient C = -B^len mod P, which is needed to move window of length "len"
+//note: all functions are reentrant, the caller keeps this coefficient (e.g. one per scan)
+uint32_t polyhash_negator(size_t len);
+
+//compute hash values of "count" consecutive windows of length "len":
+//values[k] = hash of bytes data[k .. k+len), so data must contain (count + len - 1) bytes
+//the values are exactly the same as polyhash_compute + polyhash_fast_update would produce,
+//  but computed much faster (several independent chains, AVX2 if supported)
+void polyhash_compute_many(uint32_t *values, const uint8_t *data, size_t len, size_t count);
+
 //recompute hash value after moving window forward by one byte
 //"value" is hash of the current window, hash of the next window is returned
 //"added" is the byte entering window, "removed" byte is leaving window
-//note: POLYHASH_NEGATOR must be precomputed via polyhash_compute beforehand
-static INLINE uint32_t polyhash_fast_update(uint32_t value, uint8_t added, uint8_t removed) {
-  value = (((uint64_t)value) * POLYHASH_BASE + added + ((uint64_t)removed) * POLYHASH_NEGATOR) % POLYHASH_MODULO;
+//"negator" must be computed by polyhash_negator for the window length
+static INLINE uint32_t polyhash_fast_update(uint32_t value, uint8_t added, uint8_t removed, uint32_t negator) {
+  value = polyhash_reduce(((uint64_t)value) * POLYHASH_BASE + added + ((uint64_t)removed) * negator);
   return value;
 }
 
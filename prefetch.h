@@ -0,0 +1,12 @@
+#ifndef _TDM_PREFETCH_H_640172_
+#define _TDM_PREFETCH_H_640172_
+
+//hint CPU to start loading memory at specified address into cache
+#ifdef _MSC_VER
+    #include <intrin.h>
+    #define TDM_PREFETCH(ptr) _mm_prefetch((const char*)(ptr), _MM_HINT_T0)
+#else
+    #define TDM_PREFETCH(ptr) __builtin_prefetch(ptr)
+#endif
+
+#endif
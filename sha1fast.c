@@ -0,0 +1,270 @@
+#include "sha1fast.h"
+#include "sha1.h"
+#include "cpuinfo.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define SHA1FAST_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #define TARGET_SHANI
+        #define TARGET_AVX2
+    #else
+        #define TARGET_SHANI __attribute__((target("sha,sse4.1,ssse3")))
+        #define TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
+
+
+static const uint32_t SHA1_INIT_STATE[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+static uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+static void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+//write the last (padded) 64-byte blocks of message into "pad" (must have 128 bytes)
+//returns number of padded blocks: 1 or 2
+static size_t sha1_make_padding(uint8_t pad[128], const uint8_t *data, size_t len) {
+    size_t tail = len & 63;
+    size_t blocks = (tail + 9 <= 64 ? 1 : 2);
+    uint64_t bits = (uint64_t)len * 8;
+    memset(pad, 0, 128);
+    memcpy(pad, data + (len - tail), tail);
+    pad[tail] = 0x80;
+    store_be32(pad + 64 * blocks - 8, (uint32_t)(bits >> 32));
+    store_be32(pad + 64 * blocks - 4, (uint32_t)bits);
+    return blocks;
+}
+
+static void sha1_store_digest(uint8_t digest[20], const uint32_t state[5]) {
+    int i;
+    for (i = 0; i < 5; i++)
+        store_be32(digest + 4 * i, state[i]);
+}
+
+//=========================================================================
+//          portable: SHA1Transform from sha1.c
+//=========================================================================
+
+static void sha1_blocks_portable(uint32_t state[5], const uint8_t *data, size_t blocks) {
+    size_t i;
+    for (i = 0; i < blocks; i++)
+        SHA1Transform(state, data + 64 * i);
+}
+
+//=========================================================================
+//          SHA-NI: one message at a time
+//=========================================================================
+
+#ifdef SHA1FAST_X86
+
+//"sha1rnds4" needs function index as immediate, so rounds are unrolled with macro
+#define SHANI_ROUNDS4(i, func) \
+    enext = _mm_sha1nexte_epu32(prev, msg[i]); \
+    prev = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, enext, func);
+
+TARGET_SHANI static void sha1_blocks_shani(uint32_t state[5], const uint8_t *data, size_t blocks) {
+    const __m128i BSWAP_MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, e0, prev, enext, abcdSave, e0Save;
+    __m128i msg[20];
+    size_t b;
+    int i;
+
+    abcd = _mm_loadu_si128((const __m128i*)state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    for (b = 0; b < blocks; b++, data += 64) {
+        abcdSave = abcd;
+        e0Save = e0;
+
+        //message schedule: msg[i] contains words W[4i .. 4i+3]
+        for (i = 0; i < 4; i++)
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), BSWAP_MASK);
+        for (i = 4; i < 20; i++) {
+            __m128i t = _mm_xor_si128(_mm_sha1msg1_epu32(msg[i-4], msg[i-3]), msg[i-2]);
+            msg[i] = _mm_sha1msg2_epu32(t, msg[i-1]);
+        }
+
+        enext = _mm_add_epi32(e0, msg[0]);
+        prev = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, enext, 0);
+        SHANI_ROUNDS4(1, 0)  SHANI_ROUNDS4(2, 0)  SHANI_ROUNDS4(3, 0)  SHANI_ROUNDS4(4, 0)
+        SHANI_ROUNDS4(5, 1)  SHANI_ROUNDS4(6, 1)  SHANI_ROUNDS4(7, 1)  SHANI_ROUNDS4(8, 1)  SHANI_ROUNDS4(9, 1)
+        SHANI_ROUNDS4(10, 2) SHANI_ROUNDS4(11, 2) SHANI_ROUNDS4(12, 2) SHANI_ROUNDS4(13, 2) SHANI_ROUNDS4(14, 2)
+        SHANI_ROUNDS4(15, 3) SHANI_ROUNDS4(16, 3) SHANI_ROUNDS4(17, 3) SHANI_ROUNDS4(18, 3) SHANI_ROUNDS4(19, 3)
+
+        e0 = _mm_sha1nexte_epu32(prev, e0Save);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i*)state, abcd);
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_ROUNDS4
+
+#endif
+
+//=========================================================================
+//          AVX2: eight messages at once
+//=========================================================================
+
+#ifdef SHA1FAST_X86
+
+#define AVX2_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+//process one 64-byte block of every lane: ptrs[l] points to the block of l-th message
+TARGET_AVX2 static void sha1_block_avx2_x8(__m256i state[5], const uint8_t *const ptrs[8]) {
+    __m256i w[16];
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    __m256i f, k, tmp;
+    int t;
+
+    for (t = 0; t < 16; t++) {
+        w[t] = _mm256_set_epi32(
+            (int)load_be32(ptrs[7] + 4*t), (int)load_be32(ptrs[6] + 4*t), (int)load_be32(ptrs[5] + 4*t), (int)load_be32(ptrs[4] + 4*t),
+            (int)load_be32(ptrs[3] + 4*t), (int)load_be32(ptrs[2] + 4*t), (int)load_be32(ptrs[1] + 4*t), (int)load_be32(ptrs[0] + 4*t)
+        );
+    }
+
+    for (t = 0; t < 80; t++) {
+        if (t >= 16) {
+            tmp = _mm256_xor_si256(_mm256_xor_si256(w[(t-3) & 15], w[(t-8) & 15]), _mm256_xor_si256(w[(t-14) & 15], w[t & 15]));
+            w[t & 15] = AVX2_ROL(tmp, 1);
+        }
+        if (t < 20) {
+            f = _mm256_xor_si256(_mm256_and_si256(b, _mm256_xor_si256(c, d)), d);
+            k = _mm256_set1_epi32(0x5A827999);
+        }
+        else if (t < 40) {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(0x6ED9EBA1);
+        }
+        else if (t < 60) {
+            f = _mm256_or_si256(_mm256_and_si256(_mm256_or_si256(b, c), d), _mm256_and_si256(b, c));
+            k = _mm256_set1_epi32((int)0x8F1BBCDC);
+        }
+        else {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32((int)0xCA62C1D6);
+        }
+        tmp = _mm256_add_epi32(_mm256_add_epi32(AVX2_ROL(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+        e = d;
+        d = c;
+        c = AVX2_ROL(b, 30);
+        b = a;
+        a = tmp;
+    }
+
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+}
+
+#undef AVX2_ROL
+
+//compute digests of up to 8 messages of same length
+TARGET_AVX2 static void sha1_compute_avx2_x8(uint8_t (*digests)[20], const uint8_t *const *datas, size_t len, size_t count) {
+    uint8_t pad[8][128];
+    const uint8_t *ptrs[8];
+    __m256i state[5];
+    uint32_t lanes[5][8];
+    size_t full = len / 64, padBlocks = 0, b;
+    int i, l;
+
+    for (l = 0; l < 8; l++) {
+        //unused lanes just repeat the first message
+        const uint8_t *data = datas[(size_t)l < count ? l : 0];
+        padBlocks = sha1_make_padding(pad[l], data, len);
+    }
+    for (i = 0; i < 5; i++)
+        state[i] = _mm256_set1_epi32((int)SHA1_INIT_STATE[i]);
+
+    for (b = 0; b < full + padBlocks; b++) {
+        for (l = 0; l < 8; l++) {
+            const uint8_t *data = datas[(size_t)l < count ? l : 0];
+            ptrs[l] = (b < full ? data + 64 * b : pad[l] + 64 * (b - full));
+        }
+        sha1_block_avx2_x8(state, ptrs);
+    }
+
+    for (i = 0; i < 5; i++)
+        _mm256_storeu_si256((__m256i*)lanes[i], state[i]);
+    for (l = 0; (size_t)l < count; l++) {
+        uint32_t st[5];
+        for (i = 0; i < 5; i++)
+            st[i] = lanes[i][l];
+        sha1_store_digest(digests[l], st);
+    }
+}
+
+#endif
+
+//=========================================================================
+//          dispatch
+//=========================================================================
+
+typedef void (*sha1_blocks_func)(uint32_t state[5], const uint8_t *data, size_t blocks);
+
+static sha1_blocks_func sha1_choose_blocks_func(void) {
+#ifdef SHA1FAST_X86
+    if (cpu_has_sha_ni())
+        return sha1_blocks_shani;
+#endif
+    return sha1_blocks_portable;
+}
+
+static void sha1_compute_single(sha1_blocks_func func, uint8_t digest[20], const uint8_t *data, size_t len) {
+    uint32_t state[5];
+    uint8_t pad[128];
+    size_t full = len / 64;
+    size_t padBlocks = sha1_make_padding(pad, data, len);
+    memcpy(state, SHA1_INIT_STATE, sizeof(state));
+    func(state, data, full);
+    func(state, pad, padBlocks);
+    sha1_store_digest(digest, state);
+}
+
+void sha1fast_compute(uint8_t digest[20], const uint8_t *data, size_t len) {
+    sha1_compute_single(sha1_choose_blocks_func(), digest, data, len);
+}
+
+void sha1fast_compute_many(uint8_t (*digests)[20], const uint8_t *const *datas, size_t len, size_t count) {
+    size_t i = 0;
+    sha1_blocks_func func = sha1_choose_blocks_func();
+#ifdef SHA1FAST_X86
+    if (cpu_has_avx2()) {
+        //AVX2 on eight messages is a bit faster than SHA-NI on one message at a time
+        //but if only a few messages are left, then SHA-NI is better
+        size_t minLanes = (func == sha1_blocks_shani ? 4 : 1);
+        while (count - i >= minLanes && i < count) {
+            size_t cnt = (count - i < 8 ? count - i : 8);
+            sha1_compute_avx2_x8(digests + i, datas + i, len, cnt);
+            i += cnt;
+        }
+    }
+#endif
+    for (; i < count; i++)
+        sha1_compute_single(func, digests[i], datas[i], len);
+}
+
+const char *sha1fast_backend_name(int many) {
+#ifdef SHA1FAST_X86
+    if (many && cpu_has_avx2())
+        return "AVX2 x8";
+    if (cpu_has_sha_ni())
+        return "SHA-NI";
+#endif
+    return "portable";
+}
@@ -0,0 +1,36 @@
+#ifndef _TDM_SHA1FAST_H_418305_
+#define _TDM_SHA1FAST_H_418305_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//optimized SHA-1 for whole messages in memory
+//the digests are exactly the same as produced by SHA1Init + SHA1Update + SHA1Final from sha1.h
+//best implementation is chosen at runtime:
+//  SHA-NI (x86 SHA extensions) --- one message at a time
+//  AVX2 --- eight messages at once (one per 32-bit lane), only used by sha1fast_compute_many
+//  portable C code (sha1.c) otherwise
+
+//max number of messages processed at once by sha1fast_compute_many
+//(passing more messages is allowed, but does not improve performance)
+#define SHA1FAST_LANES 8
+
+//compute SHA-1 digest of the specified message
+void sha1fast_compute(uint8_t digest[20], const uint8_t *data, size_t len);
+
+//compute SHA-1 digests of "count" different messages of same length "len"
+//datas[i] points to i-th message, its digest is written to digests[i]
+void sha1fast_compute_many(uint8_t (*digests)[20], const uint8_t *const *datas, size_t len, size_t count);
+
+//name of the implementation chosen for sha1fast_compute / sha1fast_compute_many (for logging)
+const char *sha1fast_backend_name(int many);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,187 +5,525 @@
 #include <string.h>
 #include <vector>
 #include <algorithm>
+#include <unordered_set>
+#include <set>
+#include <mutex>
+#include <math.h>
 
 #include "tsassert.h"
+#include "threads.h"
+#include "checksumindex.h"
 
-//specifies which search algorithm to use to find similar blocks in metainfo
-//perfect hash function is used when macro is defined, branchless binary search is used otherwise
-//PHF is known to be faster but is a bit more complicated (if it has bugs, then it can even hang)
-#define USE_PHF
+#include "sha1fast.h"
+#include "murmur3.h"
+#include "buzhash.h"
+#include "polyhash.h"
 
-//specifies which rolling hash (checksum) to use for blocks
-//note: this macro affects format of .tdmsync files!
-//simple polynomial hash is used when macro is defined, buzhash is used otherwise
-//while buzhash is faster on low level, it has no collision guarantees,
-//  has low quality, and exhibits quadratic behavior easily
-#define USE_POLYHASH
 
-#include "sha1.h"
+namespace TdmSync {
 
-#ifndef USE_POLYHASH
-    #include "buzhash.h"
-#else
-    #include "polyhash.h"
-#endif
+//===========================================================================
 
-#ifndef USE_PHF
-    #include "binsearch.h"
-#else
-    #include "phf.h"
-#endif
+//rolling checksums of windows of fixed length (see RollingHash)
+//scanning code is a template over these policies, so that the hot loop is fully specialized
+//all precomputed state is stored inside, so every scan can have its own hasher
 
+struct PolyHasher {
+    uint32_t negator;
+    explicit PolyHasher(size_t len) : negator(polyhash_negator(len)) {}
 
-namespace TdmSync {
+    //returns checksum of window bytes[0 .. len)
+    static uint32_t compute(const uint8_t *bytes, size_t len) {
+        return polyhash_compute(bytes, len);
+    }
+    //computes checksums of "count" consecutive windows: values[k] is checksum of bytes[k .. k+len)
+    void computeMany(uint32_t *values, const uint8_t *bytes, size_t len, size_t count) const {
+        polyhash_compute_many(values, bytes, len, count);
+    }
+};
 
-//===========================================================================
+struct BuzHasher {
+    explicit BuzHasher(size_t /*len*/) {}
 
-uint32_t checksumDigest(uint32_t value) {
-    return value;
-}
+    static uint32_t compute(const uint8_t *bytes, size_t len) {
+        return buzhash_compute(bytes, len);
+    }
+    void computeMany(uint32_t *values, const uint8_t *bytes, size_t len, size_t count) const {
+        for (size_t k = 0; k < count; k++)
+            values[k] = (k == 0 ? compute(bytes, len) : buzhash_fast_update(values[k-1], bytes[k-1 + len], bytes[k-1]));
+    }
+};
 
-uint32_t checksumCompute(const uint8_t *bytes, size_t len) {
+//returns rolling checksum of the block
+uint32_t rollingHashCompute(RollingHash algo, const uint8_t *bytes, size_t len) {
     TdmSyncAssert((len & 31) == 0);
-#ifndef USE_POLYHASH
-    return buzhash_compute(bytes, len);
-#else
-    return polyhash_compute(bytes, len);
-#endif
+    switch (algo) {
+        case rhPolyhash: return PolyHasher::compute(bytes, len);
+        case rhBuzhash: return BuzHasher::compute(bytes, len);
+    }
+    TdmSyncAssertF(false, "Unknown rolling hash algorithm %d", int(algo));
+    return 0;
 }
 
-uint32_t checksumUpdate(uint32_t value, uint8_t added, uint8_t removed) {
-#ifndef USE_POLYHASH
-    return buzhash_fast_update(value, added, removed);
-#else
-    return polyhash_fast_update(value, added, removed);
-#endif
+int strongHashSize(StrongHash algo) {
+    switch (algo) {
+        case shSha1: return 20;
+        case shMurmur3: return 16;
+    }
+    TdmSyncAssertF(false, "Unknown strong hash algorithm %d", int(algo));
+    return 0;
 }
 
-void hashCompute(uint8_t hash[20], const uint8_t *bytes, uint32_t len) {
-    SHA1_CTX sha;
-    SHA1Init(&sha);
-    SHA1Update(&sha, bytes, len);
-    SHA1Final(hash, &sha);
+void hashCompute(StrongHash algo, uint8_t hash[BlockInfo::HASH_SIZE], const uint8_t *bytes, uint32_t len) {
+    memset(hash, 0, BlockInfo::HASH_SIZE);
+    if (algo == shMurmur3)
+        murmur3_x64_128(hash, bytes, len, 0);
+    else
+        sha1fast_compute(hash, bytes, len);
+}
+
+//max number of hashes computed at once by hashComputeMany
+static const int HASH_BATCH = SHA1FAST_LANES;
+
+//compute hashes of "count" arrays of same length "len"
+void hashComputeMany(StrongHash algo, uint8_t (*hashes)[BlockInfo::HASH_SIZE], const uint8_t *const *bytes, uint32_t len, size_t count) {
+    if (algo == shSha1) {
+        static_assert(BlockInfo::HASH_SIZE == 20, "SHA-1 is 160-bit");
+        sha1fast_compute_many(hashes, bytes, len, count);
+    }
+    else {
+        for (size_t i = 0; i < count; i++)
+            hashCompute(algo, hashes[i], bytes[i], len);
+    }
 }
 
 //===========================================================================
 
+//original format: header and array of BlockInfo structures as is (only SHA-1)
 static const char MAGIC_STRING[] = "tdmsync.";
+//extended format: header with MetaFormat fields, blocks with hash of variable size
+static const char MAGIC_STRING_V2[] = "tdmsync2";
+//bit flags in extended header
+static const uint8_t FLAG_IMPLICIT_OFFSETS = 1;
+static const uint8_t FLAG_SEQUENTIAL_MATCH = 2;
+//bits 2-3 of flags byte store number of dropped checksum bytes (4 - checksumBytes)
+static const int DROPPED_CHECKSUM_SHIFT = 2;
+//high 4 bits of flags byte store RollingHash
+static const int ROLLING_HASH_SHIFT = 4;
+
+//ordering of blocks in FileInfo::blocks
+static bool blockLess(const BlockInfo &a, const BlockInfo &b) {
+    if (a.chksum != b.chksum)
+        return a.chksum < b.chksum;     //main condition: sort by checksum
+    return a.offset < b.offset;         //secondary condition: make order deterministic
+}
+
+//position of i-th block of file (in order of offsets)
+//note: the last block always has same size and ends at the end of file
+//so it usually overlaps the pre-last block
+static int64_t blockOffset(int64_t fileSize, int blockSize, int64_t i) {
+    return std::min(i * blockSize, fileSize - blockSize);
+}
 
 void FileInfo::serialize(BaseFile &wrFile) const {
-    wrFile.write(MAGIC_STRING, strlen(MAGIC_STRING));
+    //write old format whenever possible, so that old versions of tdmsync can use the file
+    bool v2 = !format.isDefault();
+    const char *magic = (v2 ? MAGIC_STRING_V2 : MAGIC_STRING);
+    wrFile.write(magic, strlen(magic));
 
     uint64_t blocksCount = blocks.size();
     wrFile.write(&fileSize, sizeof(fileSize));
     wrFile.write(&blockSize, sizeof(blockSize));
     wrFile.write(&blocksCount, sizeof(blocksCount));
-    wrFile.write(blocks.data(), blocksCount * sizeof(BlockInfo));
 
-    wrFile.write(MAGIC_STRING, strlen(MAGIC_STRING));
+    if (!v2) {
+        wrFile.write(blocks.data(), blocksCount * sizeof(BlockInfo));
+    }
+    else {
+        int hashSize = format.storedHashSize();
+        uint8_t header[3] = {uint8_t(format.strongHash), uint8_t(hashSize), 0};
+        if (format.implicitOffsets)
+            header[2] |= FLAG_IMPLICIT_OFFSETS;
+        if (format.sequentialMatch)
+            header[2] |= FLAG_SEQUENTIAL_MATCH;
+        int chksumSize = format.storedChecksumSize();
+        TdmSyncAssert(chksumSize >= 1 && chksumSize <= 4);
+        header[2] |= uint8_t((4 - chksumSize) << DROPPED_CHECKSUM_SHIFT);
+        TdmSyncAssert(unsigned(format.rollingHash) < 16);
+        header[2] |= uint8_t(format.rollingHash << ROLLING_HASH_SHIFT);
+        wrFile.write(header, sizeof(header));
+
+        std::vector<const BlockInfo*> order(blocksCount);
+        for (size_t i = 0; i < blocksCount; i++)
+            order[i] = &blocks[i];
+        if (format.implicitOffsets) {
+            std::sort(order.begin(), order.end(), [](const BlockInfo *a, const BlockInfo *b) -> bool {
+                return a->offset < b->offset;
+            });
+            for (size_t i = 0; i < blocksCount; i++)
+                TdmSyncAssert(order[i]->offset == blockOffset(fileSize, blockSize, i));
+        }
+
+        //every block is stored as: offset (unless implicit), lower chksumSize bytes of checksum, first hashSize bytes of hash
+        std::vector<uint8_t> buffer;
+        for (size_t i = 0; i < blocksCount; i++) {
+            const BlockInfo &blk = *order[i];
+            if (!format.implicitOffsets)
+                buffer.insert(buffer.end(), (const uint8_t*)&blk.offset, (const uint8_t*)&blk.offset + sizeof(blk.offset));
+            buffer.insert(buffer.end(), (const uint8_t*)&blk.chksum, (const uint8_t*)&blk.chksum + chksumSize);
+            buffer.insert(buffer.end(), blk.hash, blk.hash + hashSize);
+            if (buffer.size() >= (1 << 20) || i + 1 == blocksCount) {
+                wrFile.write(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+        }
+    }
+
+    wrFile.write(magic, strlen(magic));
 }
 
 void FileInfo::deserialize(BaseFile &rdFile) {
     char magic[sizeof(MAGIC_STRING)] = {0};
     rdFile.read(magic, strlen(MAGIC_STRING));
-    TdmSyncAssert(strcmp(magic, MAGIC_STRING) == 0);
+    bool v2 = (strcmp(magic, MAGIC_STRING_V2) == 0);
+    TdmSyncAssertF(v2 || strcmp(magic, MAGIC_STRING) == 0, "Metainfo file has wrong signature");
+    const char *expectedMagic = (v2 ? MAGIC_STRING_V2 : MAGIC_STRING);
 
     uint64_t blocksCount;
     rdFile.read(&fileSize, sizeof(fileSize));
     rdFile.read(&blockSize, sizeof(blockSize));
     rdFile.read(&blocksCount, sizeof(blocksCount));
     blocks.resize(blocksCount);
-    rdFile.read(blocks.data(), blocksCount * sizeof(BlockInfo));
+    format = MetaFormat();
+
+    if (!v2) {
+        rdFile.read(blocks.data(), blocksCount * sizeof(BlockInfo));
+    }
+    else {
+        uint8_t header[3];
+        rdFile.read(header, sizeof(header));
+        format.strongHash = StrongHash(header[0]);
+        format.hashBytes = header[1];
+        format.implicitOffsets = (header[2] & FLAG_IMPLICIT_OFFSETS) != 0;
+        format.sequentialMatch = (header[2] & FLAG_SEQUENTIAL_MATCH) != 0;
+        format.checksumBytes = 4 - ((header[2] >> DROPPED_CHECKSUM_SHIFT) & 3);
+        int chksumSize = format.storedChecksumSize();
+        if (chksumSize == 4)
+            format.checksumBytes = 0;
+        format.rollingHash = RollingHash(header[2] >> ROLLING_HASH_SHIFT);
+        TdmSyncAssertF(format.rollingHash == rhPolyhash || format.rollingHash == rhBuzhash, "Unknown rolling hash %d in metainfo", int(format.rollingHash));
+        int hashSize = format.storedHashSize();
+        TdmSyncAssertF(hashSize > 0 && hashSize <= strongHashSize(format.strongHash), "Wrong hash size %d in metainfo", hashSize);
+        if (hashSize == strongHashSize(format.strongHash))
+            format.hashBytes = 0;
+
+        size_t recordSize = (format.implicitOffsets ? 0 : sizeof(BlockInfo::offset)) + chksumSize + hashSize;
+        std::vector<uint8_t> buffer;
+        size_t recordsPerRead = std::max(size_t(1), (size_t(1) << 20) / recordSize);
+        for (size_t i = 0; i < blocksCount; i += recordsPerRead) {
+            size_t cnt = std::min(recordsPerRead, size_t(blocksCount - i));
+            buffer.resize(cnt * recordSize);
+            rdFile.read(buffer.data(), buffer.size());
+            for (size_t k = 0; k < cnt; k++) {
+                BlockInfo &blk = blocks[i + k];
+                const uint8_t *ptr = &buffer[k * recordSize];
+                blk = BlockInfo();      //zeroes hash too
+                if (format.implicitOffsets)
+                    blk.offset = blockOffset(fileSize, blockSize, i + k);
+                else {
+                    memcpy(&blk.offset, ptr, sizeof(blk.offset));
+                    ptr += sizeof(blk.offset);
+                }
+                memcpy(&blk.chksum, ptr, chksumSize);
+                ptr += chksumSize;
+                memcpy(blk.hash, ptr, hashSize);
+            }
+        }
+        if (format.implicitOffsets)
+            std::sort(blocks.begin(), blocks.end(), blockLess);
+    }
 
     rdFile.read(magic, strlen(MAGIC_STRING));
-    TdmSyncAssert(strcmp(magic, MAGIC_STRING) == 0);
+    TdmSyncAssert(strcmp(magic, expectedMagic) == 0);
 }
 
+//how many bytes of strong hash are enough to make false match improbable
+//we assume that every window of local file is compared to every block (like zsync does)
+//local file is assumed to have similar size as remote file
+static int chooseHashBytes(int64_t fileSize, int64_t blocksCount, StrongHash strongHash) {
+    //probability that a false match happens during update is about 2^(-SafetyBits)
+    static const int SafetyBits = 24;
+    double bits = SafetyBits + log2(double(fileSize) + 1.0) + log2(double(blocksCount) + 1.0);
+    int bytes = int(ceil(bits / 8.0));
+    return std::min(bytes, strongHashSize(strongHash));
+}
 
-static void readToBuffer(BaseFile &rdFile, std::vector<uint8_t> &buffer, size_t readmore) {
-    memmove(buffer.data(), buffer.data() + readmore, buffer.size() - readmore);
-    rdFile.read(buffer.data() + buffer.size() - readmore, readmore);
+//how many bytes of rolling checksum are enough to keep scanning fast
+//every window of local file is looked up by checksum: a random window should rarely hit any block
+//with sequential matching, strong hash is computed only if two consecutive checksums match,
+//  so the total number of false candidates is about fileSize * blocksCount / 2^(16 * bytes)
+static int chooseChecksumBytes(int64_t fileSize, int64_t blocksCount, bool sequentialMatch) {
+    if (!sequentialMatch)
+        return 4;
+    //at most one in 2^HitBits windows hits some block by checksum
+    static const int HitBits = 3;
+    double hitBits = log2(double(blocksCount) + 1.0) + HitBits;
+    double pairBits = log2(double(fileSize) + 1.0) + log2(double(blocksCount) + 1.0);
+    int bytes = 1;
+    while (bytes < 4 && (8 * bytes < hitBits || 16 * bytes < pairBits))
+        bytes++;
+    return bytes;
 }
 
-void FileInfo::computeFromFile(BaseFile &rdFile, int blockSize) {
+void FileInfo::computeFromFile(BaseFile &rdFile, int blockSize, int threadsNum, const MetaFormat &format) {
+    threadsNum = resolveThreadsNum(threadsNum);
     this->blockSize = blockSize;
+    this->format = format;
     fileSize = rdFile.getSize();
     TdmSyncAssert(rdFile.tell() == 0);
     blocks.clear();
 
     //always download whole file if its size is less than block size
-    if (fileSize < blockSize)
+    int blockCount = (fileSize < blockSize ? 0 : (fileSize + blockSize-1) / blockSize);
+    if (this->format.hashBytes == MetaFormat::HASH_BYTES_AUTO)
+        this->format.hashBytes = chooseHashBytes(fileSize, blockCount, format.strongHash);
+    if (this->format.checksumBytes == MetaFormat::CHECKSUM_BYTES_AUTO)
+        this->format.checksumBytes = chooseChecksumBytes(fileSize, blockCount, format.sequentialMatch);
+    TdmSyncAssertF(this->format.storedChecksumSize() <= 4, "Wrong checksum size %d", this->format.checksumBytes);
+    if (this->format.storedChecksumSize() == 4)
+        this->format.checksumBytes = 0;
+    int hashSize = this->format.storedHashSize();
+    uint32_t chksumMask = this->format.checksumMask();
+    if (blockCount == 0)
         return;
+    blocks.resize(blockCount);
 
-    int blockCount = (fileSize + blockSize-1) / blockSize;
-    blocks.reserve(blockCount);
-
-    std::vector<uint8_t> buffer(blockSize);
-    int64_t offset = 0;
-    for (int i = 0; i < blockCount; i++) {
-        //note: the last block always has same size and ends at the end of file
-        //so it usually overlaps the pre-last block
-        int64_t readmore = std::min(fileSize - offset, int64_t(blockSize));
-        readToBuffer(rdFile, buffer, readmore);
-        offset += readmore;
-
-        BlockInfo blk;
-        blk.offset = offset - blockSize;
-        blk.chksum = checksumDigest(checksumCompute(buffer.data(), blockSize));
-        hashCompute(blk.hash, buffer.data(), blockSize);
+    //file is processed in batches of consecutive blocks:
+    //every batch is read into memory, then its blocks are hashed in parallel
+    //if file contents is directly accessible (e.g. memory-mapped), then it is used without copying
+    const uint8_t *fileData = rdFile.getData();
+    static const int64_t BatchBytesPerThread = 4 << 20;
+    int batchBlocks = std::max(int64_t(1), BatchBytesPerThread * threadsNum / blockSize);
+    std::vector<uint8_t> buffer;
+    for (int first = 0; first < blockCount; first += batchBlocks) {
+        int last = std::min(first + batchBlocks, blockCount);
+        int64_t start = blockOffset(fileSize, blockSize, first);
+        int64_t end = blockOffset(fileSize, blockSize, last - 1) + blockSize;
+        const uint8_t *batchData = fileData + start;
+        if (!fileData) {
+            if (int64_t(rdFile.tell()) != start)
+                rdFile.seek(start);     //only happens when batch starts with the last (overlapping) block
+            buffer.resize(end - start);
+            rdFile.read(buffer.data(), buffer.size());
+            batchData = buffer.data();
+        }
 
-        blocks.push_back(blk);
+        //every task processes a group of blocks, so that their hashes are computed at once
+        int groups = (last - first + HASH_BATCH-1) / HASH_BATCH;
+        parallelFor(threadsNum, groups, [&](size_t g) {
+            int gFirst = first + g * HASH_BATCH;
+            int gLast = std::min(gFirst + HASH_BATCH, last);
+            const uint8_t *datas[HASH_BATCH] = {};
+            uint8_t hashes[HASH_BATCH][BlockInfo::HASH_SIZE];
+            for (int i = gFirst; i < gLast; i++) {
+                BlockInfo &blk = blocks[i];
+                blk.offset = blockOffset(fileSize, blockSize, i);
+                datas[i - gFirst] = batchData + (blk.offset - start);
+                blk.chksum = rollingHashCompute(format.rollingHash, datas[i - gFirst], blockSize) & chksumMask;
+            }
+            hashComputeMany(format.strongHash, hashes, datas, blockSize, gLast - gFirst);
+            for (int i = gFirst; i < gLast; i++) {
+                memset(blocks[i].hash, 0, BlockInfo::HASH_SIZE);
+                memcpy(blocks[i].hash, hashes[i - gFirst], hashSize);
+            }
+        });
     }
-    TdmSyncAssert(offset == fileSize);
+    if (fileData)
+        rdFile.seek(fileSize);
     TdmSyncAssert(rdFile.tell() == fileSize);
 
-    std::sort(blocks.begin(), blocks.end(), [](const BlockInfo &a, const BlockInfo &b) -> bool {
-        if (a.chksum != b.chksum)
-            return a.chksum < b.chksum;     //main condition: sort by checksum
-        return a.offset < b.offset;         //secondary condition: make order deterministic
-    });
+    parallelSort(threadsNum, blocks, blockLess);
 }
 
-UpdatePlan FileInfo::createUpdatePlan(BaseFile &rdFile) const {
-    int64_t srcFileSize = rdFile.getSize();
-    TdmSyncAssert(rdFile.tell() == 0);
-    UpdatePlan result;
+//occurrence of a block of metainfo in local file
+struct BlockMatch {
+    //index of the block in FileInfo::blocks
+    uint32_t block;
+    //start of the window in local file
+    int64_t offset;
+};
 
-    if (srcFileSize >= blockSize) {
-        //copy checksums into simple array, prepare search algorithm on them
-        size_t num = blocks.size();
-        std::vector<uint32_t> checksums(num);
-        for (int i = 0; i < num; i++)
-            checksums[i] = blocks[i].chksum;
-        TdmSyncAssert(std::is_sorted(checksums.begin(), checksums.end()));
-        #ifdef USE_PHF
-        TdmPhf::PerfectHashFunc perfecthash;
-        perfecthash.create(checksums.data(), num);
-        #else
-        tdm_bsb_info binsearcher;
-        binary_search_branchless_precompute(&binsearcher, num);
-        #endif
-
-        //buffer with the latest data from local file
-        //when sliding window gets to the end of buffer, we move remaining data to start and read some more
-        std::vector<uint8_t> buffer(2 * blockSize);
-        rdFile.read(buffer.data(), std::min((int64_t)buffer.size(), srcFileSize));
-        uint32_t currChksum = checksumCompute(buffer.data(), blockSize);
-        //the current sliding window ends at this position in buffer
-        size_t buffPtr = blockSize;
-
-        //for each block from metainfo file: whether it has already been found in local file
-        std::vector<char> foundBlocks(blocks.size(), false);
-        uint64_t sumCount = 0;
+//for sequential matching: which block follows every block in remote file
+struct NextBlock {
+    //checksum of the next block
+    uint32_t chksum = 0;
+    //distance from start of this block to start of the next one (0 if this block is the last one)
+    int delta = 0;
+};
 
-        //the current sliding window starts at "offset" position within local file
-        for (int64_t offset = 0; offset + blockSize <= srcFileSize; offset++) {
-            uint32_t digest = checksumDigest(currChksum);
+//for sequential matching: which block precedes every block in remote file
+//a block is accepted without its next block if the previous block is present right before it,
+//  so that the last block before a change and blocks followed by changed ones are found too
+struct PrevBlock {
+    //index of the previous block in FileInfo::blocks
+    uint32_t block = 0;
+    //distance from start of the previous block to start of this one (0 if this block is the first one)
+    int delta = 0;
+};
+
+//result of scanning a chunk of local file
+struct ChunkScan {
+    //all windows starting in [from, to) are checked
+    int64_t from = 0, to = 0;
+    //windows starting in [to, dataTo) are available too (used only to check the next block in sequential matching)
+    int64_t dataTo = 0;
+    //windows starting in [dataFrom, from) are available too (used only to check the previous block in sequential matching)
+    int64_t dataFrom = 0;
+    //blocks found in this chunk (in order of increasing offset, each block at most once)
+    std::vector<BlockMatch> matches;
+    //stats: total number of checksum candidates
+    uint64_t sumCount = 0;
+};
+
+//everything needed to scan chunks of local file (shared by all threads)
+struct ScanContext {
+    const FileInfo &info;
+    const ChecksumIndex &index;
+    ScanMode mode;
+    //total number of windows in local file
+    int64_t windowsCount = 0;
+    //next block for every block of info.blocks (empty if sequential matching is off)
+    std::vector<NextBlock> nextBlocks;
+    //previous block for every block of info.blocks (empty if sequential matching is off)
+    std::vector<PrevBlock> prevBlocks;
+    //blocks already found before current batch (they are ignored)
+    //note: only changed between batches, so chunks read it without synchronization
+    std::vector<char> foundBlocks;
+
+    ScanContext(const FileInfo &info, const ChecksumIndex &index, ScanMode mode) : info(info), index(index), mode(mode) {}
+};
+
+//sequential matching: checks if previous block of block j is present in local file right before "offset"
+//its window is checked by checksum, then by strong hash (this depends only on file contents, not on found blocks)
+//digestAt(pos) must return checksum of window starting at pos
+template<class DigestAt>
+static bool hasPrevBlock(const ScanContext &ctx, const uint8_t *data, const ChunkScan &chunk, uint32_t j, int64_t offset, DigestAt &&digestAt) {
+    const FileInfo &info = ctx.info;
+    const PrevBlock &prev = ctx.prevBlocks[j];
+    int64_t pos = offset - prev.delta;
+    if (prev.delta == 0 || pos < chunk.dataFrom)
+        return false;
+    const BlockInfo &block = info.blocks[prev.block];
+    if (digestAt(pos) != block.chksum)
+        return false;
+    uint8_t hash[BlockInfo::HASH_SIZE];
+    hashCompute(info.format.strongHash, hash, data + (pos - chunk.from), info.blockSize);
+    return memcmp(block.hash, hash, info.format.storedHashSize()) == 0;
+}
 
-            #ifdef USE_PHF
-            size_t idx = perfecthash.evaluate(digest);
-            #else
-            size_t idx = binary_search_branchless_run(&binsearcher, checksums.data(), digest);
-            #endif
+//finds blocks in windows of a chunk of local file
+//data --- bytes of local file starting from chunk.from (contains at least chunk.dataTo - chunk.from + blockSize - 1 bytes)
+//  bytes starting from chunk.dataFrom are available before it, i.e. data - (chunk.from - chunk.dataFrom) is valid
+typedef void (*ScanChunkFunc)(const ScanContext &ctx, const uint8_t *data, ChunkScan &chunk);
 
+//checks every window of the chunk (smExhaustive)
+//BlockSize = 0 means that block size is not known at compile time (taken from info)
+template<class Hasher, ChecksumLookup Lookup, int BlockSize>
+static void scanChunkExhaustive(const ScanContext &ctx, const uint8_t *data, ChunkScan &chunk) {
+    const FileInfo &info = ctx.info;
+    const int blockSize = (BlockSize ? BlockSize : info.blockSize);
+    Hasher hasher(blockSize);
+    const auto &blocks = info.blocks;
+    const auto &checksums = ctx.index.checksums;
+    const auto &nextBlocks = ctx.nextBlocks;
+    const auto &foundBlocks = ctx.foundBlocks;
+    size_t num = checksums.size();
+    uint32_t chksumMask = info.format.checksumMask();
+    bool sequential = info.format.sequentialMatch;
+    int64_t lookahead = (sequential ? blockSize : 0);
+
+    //windows are processed in batches:
+    //first rolling checksums of all windows in batch are computed, then they are looked up in index
+    //note: computing many consecutive checksums at once is much faster (SIMD), and lookups are prefetched
+    //digests of windows after the batch are computed too (if available) for sequential matching
+    static const int64_t PrefetchDistance = 16;
+    int64_t batchWindows = std::min(std::max(int64_t(1) << 18, int64_t(32) * blockSize), chunk.to - chunk.from);
+    std::vector<uint32_t> digests(batchWindows + lookahead), indices(batchWindows);
+    int64_t batchFrom = chunk.from, computed = 0;
+
+    //blocks found in this chunk (not marked in foundBlocks)
+    std::unordered_set<uint32_t> localFound;
+    auto isFound = [&](uint32_t j) -> bool {
+        return foundBlocks[j] || localFound.count(j);
+    };
+    //checksum of window starting at "pos" in local file (usually computed already)
+    auto digestAt = [&](int64_t pos) -> uint32_t {
+        if (pos >= batchFrom)
+            return digests[pos - batchFrom];
+        return Hasher::compute(data + (pos - chunk.from), blockSize) & chksumMask;
+    };
+    //whether block j can start at k-th window of current batch, so that its strong hash must be checked
+    //with sequential matching, the window where the next block must start should have its checksum,
+    //  or the previous block should be present where it must start
+    auto isCandidate = [&](uint32_t j, int64_t k) -> bool {
+        if (isFound(j))
+            return false;
+        if (!sequential || nextBlocks[j].delta == 0 || ctx.prevBlocks[j].delta == 0)
+            return true;
+        int64_t n = k + nextBlocks[j].delta;
+        if (n < computed && digests[n] == nextBlocks[j].chksum)
+            return true;
+        return hasPrevBlock(ctx, data, chunk, j, batchFrom + k, digestAt);
+    };
+
+    //windows with checksum candidates, for which slow hash is not computed yet
+    //slow hashes are computed in batches of HASH_BATCH windows, which is faster than one by one
+    struct Candidate {
+        int64_t offset;
+        uint32_t left, right;
+    };
+    Candidate pending[HASH_BATCH];
+    int hashSize = info.format.storedHashSize();
+    int pendingCnt = 0;
+    auto verifyPending = [&]() {
+        const uint8_t *windows[HASH_BATCH];
+        uint8_t hashes[HASH_BATCH][BlockInfo::HASH_SIZE];
+        for (int k = 0; k < pendingCnt; k++)
+            windows[k] = data + (pending[k].offset - chunk.from);
+        hashComputeMany(info.format.strongHash, hashes, windows, blockSize, pendingCnt);
+
+        //note: windows are processed in order, so the result is the same as without batching
+        for (int k = 0; k < pendingCnt; k++) {
+            const Candidate &cand = pending[k];
+            for (uint32_t j = cand.left; j < cand.right; j++) if (isCandidate(j, cand.offset - batchFrom)) {
+                if (memcmp(blocks[j].hash, hashes[k], hashSize) != 0)
+                    continue;   //note: this happens only due to checksum collisions, i.e. very rarely
+
+                localFound.insert(j);
+                chunk.matches.push_back(BlockMatch{j, cand.offset});
+            }
+        }
+        pendingCnt = 0;
+    };
+
+    for (; batchFrom < chunk.to; batchFrom += batchWindows) {
+        int64_t cnt = std::min(batchWindows, chunk.to - batchFrom);
+        computed = std::min(cnt + lookahead, chunk.dataTo - batchFrom);
+        hasher.computeMany(digests.data(), data + (batchFrom - chunk.from), blockSize, computed);
+        if (chksumMask != 0xFFFFFFFFU) {
+            for (int64_t k = 0; k < computed; k++)
+                digests[k] &= chksumMask;
+        }
+        ctx.index.findManyAs<Lookup>(digests.data(), indices.data(), cnt);
+
+        //the current sliding window starts at "offset" position within local file
+        for (int64_t k = 0; k < cnt; k++) {
+            int64_t offset = batchFrom + k;
+            if (k + PrefetchDistance < cnt && indices[k + PrefetchDistance] < num)
+                TDM_PREFETCH(&checksums[indices[k + PrefetchDistance]]);
+            uint32_t digest = digests[k];
+
+            size_t idx = indices[k];
             if (idx < num && checksums[idx] == digest) {
                 //at least one block's checksum equals checksum of the current window
                 uint32_t left = idx;
@@ -193,45 +531,551 @@ UpdatePlan FileInfo::createUpdatePlan(BaseFile &rdFile) const {
                 while (right < num && checksums[right] == digest)
                     right++;
 
-                sumCount += (right - left);
+                chunk.sumCount += (right - left);
                 //optimization: do not compute slow hash of current window, if we already found matches for all block candidates 
+                //(blocks found by pending windows are not known yet, so we can only compute a few excessive hashes)
                 int newFound = 0;
-                for (int j = left; j < right; j++) if (!foundBlocks[j])
+                for (uint32_t j = left; j < right; j++) if (isCandidate(j, k))
                     newFound++;
 
                 if (newFound > 0) {
-                    uint8_t currHash[BlockInfo::HASH_SIZE];
-                    hashCompute(currHash, &buffer[buffPtr - blockSize], blockSize);
+                    pending[pendingCnt++] = Candidate{offset, left, right};
+                    if (pendingCnt == HASH_BATCH)
+                        verifyPending();
+                }
+            }
+        }
+        //note: pending windows refer to digests of current batch
+        verifyPending();
+    }
+}
+
+//checks windows of the chunk, but skips windows overlapping found blocks (smSkipAhead)
+//after a block is found, the next window starts right after it: its checksum is computed from scratch,
+//  so while local file has blocks one after another, rolling checksum is not computed at all
+//note: window counts as found if any block with same checksum has same strong hash (even if it is already found),
+//  so that skipping depends only on chunk contents, and the plan does not depend on number of threads
+template<class Hasher, ChecksumLookup Lookup, int BlockSize>
+static void scanChunkSkipping(const ScanContext &ctx, const uint8_t *data, ChunkScan &chunk) {
+    const FileInfo &info = ctx.info;
+    const int blockSize = (BlockSize ? BlockSize : info.blockSize);
+    Hasher hasher(blockSize);
+    const auto &blocks = info.blocks;
+    const auto &checksums = ctx.index.checksums;
+    const auto &table = ctx.index.getTable(std::integral_constant<ChecksumLookup, Lookup>());
+    const auto &nextBlocks = ctx.nextBlocks;
+    size_t num = checksums.size();
+    uint32_t chksumMask = info.format.checksumMask();
+    bool sequential = info.format.sequentialMatch;
+    int hashSize = info.format.storedHashSize();
+
+    //checksum of window starting at "offset" in local file (the last computed one is remembered)
+    int64_t cachedOffset = -1;
+    uint32_t cachedDigest = 0;
+    auto digestAt = [&](int64_t offset) -> uint32_t {
+        if (offset != cachedOffset) {
+            cachedOffset = offset;
+            cachedDigest = Hasher::compute(data + (offset - chunk.from), blockSize) & chksumMask;
+        }
+        return cachedDigest;
+    };
+
+    //blocks found in this chunk (not marked in foundBlocks)
+    std::unordered_set<uint32_t> localFound;
+    //checks if window at "offset" with checksum "digest" is a copy of some block (idx is result of lookup)
+    auto matchWindow = [&](int64_t offset, uint32_t digest, size_t idx) -> bool {
+        if (!(idx < num && checksums[idx] == digest))
+            return false;
+        uint32_t left = idx;
+        uint32_t right = left;
+        while (right < num && checksums[right] == digest)
+            right++;
+        chunk.sumCount += (right - left);
+
+        bool hashed = false, matched = false;
+        uint8_t hash[BlockInfo::HASH_SIZE];
+        for (uint32_t j = left; j < right; j++) {
+            if (sequential && nextBlocks[j].delta != 0 && ctx.prevBlocks[j].delta != 0) {
+                int64_t next = offset + nextBlocks[j].delta;
+                bool nextFound = (next < chunk.dataTo && digestAt(next) == nextBlocks[j].chksum);
+                if (!nextFound && !hasPrevBlock(ctx, data, chunk, j, offset, digestAt))
+                    continue;
+            }
+            if (!hashed) {
+                hashCompute(info.format.strongHash, hash, data + (offset - chunk.from), blockSize);
+                hashed = true;
+            }
+            if (memcmp(blocks[j].hash, hash, hashSize) != 0)
+                continue;
+            matched = true;
+            if (!ctx.foundBlocks[j] && !localFound.count(j)) {
+                localFound.insert(j);
+                chunk.matches.push_back(BlockMatch{j, offset});
+            }
+        }
+        return matched;
+    };
 
-                    for (int j = left; j < right; j++) if (!foundBlocks[j]) {
-                        if (memcmp(blocks[j].hash, currHash, sizeof(currHash)) != 0)
-                            continue;   //note: this happens only due to checksum collisions, i.e. very rarely
+    //rolling checksums are computed in batches (like in exhaustive scan)
+    //batch is small after a found block (the next one is probably near), and grows while nothing is found
+    int64_t minBatch = std::max(int64_t(1) << 12, int64_t(4) * blockSize);
+    int64_t maxBatch = std::max(int64_t(1) << 18, int64_t(32) * blockSize);
+    int64_t batchWindows = minBatch;
+    std::vector<uint32_t> digests, indices;
+
+    for (int64_t pos = chunk.from; pos < chunk.to; ) {
+        //check windows at pos, pos + blockSize, ... while blocks are found there
+        bool found = false;
+        while (pos < chunk.to) {
+            uint32_t digest = digestAt(pos);
+            if (!matchWindow(pos, digest, table.evaluate(digest)))
+                break;
+            pos += blockSize;
+            found = true;
+        }
+        if (found)
+            batchWindows = minBatch;
+        //window at pos is already checked: roll from the next one until some block is found
+        int64_t batchFrom = pos + 1;
+        if (batchFrom >= chunk.to)
+            break;
+        int64_t cnt = std::min(batchWindows, chunk.to - batchFrom);
+        digests.resize(cnt);
+        indices.resize(cnt);
+        hasher.computeMany(digests.data(), data + (batchFrom - chunk.from), blockSize, cnt);
+        if (chksumMask != 0xFFFFFFFFU) {
+            for (int64_t k = 0; k < cnt; k++)
+                digests[k] &= chksumMask;
+        }
+        ctx.index.findManyAs<Lookup>(digests.data(), indices.data(), cnt);
+        pos = batchFrom + cnt;
+        for (int64_t k = 0; k < cnt; k++) {
+            if (matchWindow(batchFrom + k, digests[k], indices[k])) {
+                pos = batchFrom + k + blockSize;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            batchWindows = std::min(batchWindows * 2, maxBatch);
+    }
+
+    //the last block of remote file usually overlaps the pre-last one, so it is skipped after the pre-last block is found
+    //check the last window of local file separately, since that is where it is usually located
+    if (chunk.to == ctx.windowsCount) {
+        int64_t last = chunk.to - 1;
+        uint32_t digest = digestAt(last);
+        matchWindow(last, digest, table.evaluate(digest));
+    }
+}
+
+//implementation of ScanChunkFunc specialized for rolling hash, lookup structure and block size
+template<class Hasher, ChecksumLookup Lookup, int BlockSize>
+static void scanChunk(const ScanContext &ctx, const uint8_t *data, ChunkScan &chunk) {
+    if (ctx.mode == smSkipAhead)
+        scanChunkSkipping<Hasher, Lookup, BlockSize>(ctx, data, chunk);
+    else
+        scanChunkExhaustive<Hasher, Lookup, BlockSize>(ctx, data, chunk);
+}
+
+//returns scanChunk instance for the specified parameters
+//common block sizes get their own instances, other sizes use generic one
+template<class Hasher, ChecksumLookup Lookup> static ScanChunkFunc chooseScanChunk(int blockSize) {
+    switch (blockSize) {
+        case 1024: return scanChunk<Hasher, Lookup, 1024>;
+        case 4096: return scanChunk<Hasher, Lookup, 4096>;
+        case 65536: return scanChunk<Hasher, Lookup, 65536>;
+    }
+    return scanChunk<Hasher, Lookup, 0>;
+}
+template<class Hasher> static ScanChunkFunc chooseScanChunk(ChecksumLookup lookup, int blockSize) {
+    switch (lookup) {
+        case clPhf: return chooseScanChunk<Hasher, clPhf>(blockSize);
+        case clBinsearch: return chooseScanChunk<Hasher, clBinsearch>(blockSize);
+        case clBuckets: return chooseScanChunk<Hasher, clBuckets>(blockSize);
+        default: break;
+    }
+    TdmSyncAssertF(false, "Unknown checksum lookup %d", int(lookup));
+    return nullptr;
+}
+static ScanChunkFunc chooseScanChunk(RollingHash rollingHash, ChecksumLookup lookup, int blockSize) {
+    TdmSyncAssert((blockSize & 31) == 0);
+    switch (rollingHash) {
+        case rhPolyhash: return chooseScanChunk<PolyHasher>(lookup, blockSize);
+        case rhBuzhash: return chooseScanChunk<BuzHasher>(lookup, blockSize);
+    }
+    TdmSyncAssertF(false, "Unknown rolling hash algorithm %d", int(rollingHash));
+    return nullptr;
+}
+
+//aligned pass: checks every block at its own offset in local file
+//(when local file is an older version of remote file, most of its data usually stays in place)
+//order --- indices of blocks sorted by offset
+//sets matched[j] for every block j found at its offset
+static void matchAlignedBlocks(const FileInfo &info, BaseFile &rdFile, const std::vector<uint32_t> &order, int threadsNum, std::vector<char> &matched) {
+    int blockSize = info.blockSize;
+    int64_t srcFileSize = rdFile.getSize();
+    int hashSize = info.format.storedHashSize();
+    //only blocks which fit into local file are checked
+    size_t count = 0;
+    while (count < order.size() && info.blocks[order[count]].offset + blockSize <= srcFileSize)
+        count++;
+
+    //same as in computeFromFile: batches of consecutive blocks are read, then hashed in parallel
+    const uint8_t *fileData = rdFile.getData();
+    static const int64_t BatchBytesPerThread = 4 << 20;
+    size_t batchBlocks = std::max(int64_t(1), BatchBytesPerThread * threadsNum / blockSize);
+    std::vector<uint8_t> buffer;
+    for (size_t first = 0; first < count; first += batchBlocks) {
+        size_t last = std::min(first + batchBlocks, count);
+        int64_t start = info.blocks[order[first]].offset;
+        int64_t end = info.blocks[order[last - 1]].offset + blockSize;
+        const uint8_t *batchData = fileData + start;
+        if (!fileData) {
+            if (int64_t(rdFile.tell()) != start)
+                rdFile.seek(start);
+            buffer.resize(end - start);
+            rdFile.read(buffer.data(), buffer.size());
+            batchData = buffer.data();
+        }
+
+        size_t groups = (last - first + HASH_BATCH-1) / HASH_BATCH;
+        parallelFor(threadsNum, groups, [&](size_t g) {
+            size_t gFirst = first + g * HASH_BATCH;
+            size_t gLast = std::min(gFirst + HASH_BATCH, last);
+            const uint8_t *datas[HASH_BATCH] = {};
+            uint8_t hashes[HASH_BATCH][BlockInfo::HASH_SIZE];
+            for (size_t i = gFirst; i < gLast; i++)
+                datas[i - gFirst] = batchData + (info.blocks[order[i]].offset - start);
+            hashComputeMany(info.format.strongHash, hashes, datas, blockSize, gLast - gFirst);
+            for (size_t i = gFirst; i < gLast; i++)
+                if (memcmp(info.blocks[order[i]].hash, hashes[i - gFirst], hashSize) == 0)
+                    matched[order[i]] = true;
+        });
+    }
+}
 
-                        foundBlocks[j] = true;
+//===========================================================================
+
+//in-place update: local segments of the file being updated are moved inside it
+//they are split into pieces, and piece B must be read before piece A is written if source of B overlaps destination of A
+//pieces are processed in topological order of this graph; when only cycles remain,
+//  the smallest unread piece is read into memory ("stashed") and written later
+
+//part of local segment moved as a whole
+struct InPlacePiece {
+    int64_t srcOffset, dstOffset, size;
+};
+//one action of in-place update
+struct InPlaceStep {
+    enum Action {
+        Move,           //read piece and write it to destination
+        Stash,          //read piece into memory
+        WriteStashed,   //write previously stashed piece to destination
+    };
+    Action action;
+    uint32_t piece;
+};
+
+//larger pieces need more memory for stashing, smaller pieces make graph larger
+static const int64_t InPlacePieceSize = 1 << 20;
+//plan is feasible for in-place update only if this much memory is enough for stashed pieces
+static const int64_t InPlaceStashLimit = 16 << 20;
+
+//computes the order of in-place moves for the specified segments
+//returns max total size of pieces stashed in memory at once
+static int64_t scheduleInPlace(const std::vector<SegmentUse> &segments, std::vector<InPlacePiece> &pieces, std::vector<InPlaceStep> &steps) {
+    //note: segments taken from other local files do not depend on anything, segments staying in place are no-op
+    pieces.clear();
+    for (const SegmentUse &seg : segments) {
+        if (seg.remote || seg.source != 0 || seg.srcOffset == seg.dstOffset)
+            continue;
+        for (int64_t done = 0; done < seg.size; done += InPlacePieceSize) {
+            InPlacePiece piece;
+            piece.srcOffset = seg.srcOffset + done;
+            piece.dstOffset = seg.dstOffset + done;
+            piece.size = std::min(InPlacePieceSize, seg.size - done);
+            pieces.push_back(piece);
+        }
+    }
+    std::sort(pieces.begin(), pieces.end(), [](const InPlacePiece &a, const InPlacePiece &b) -> bool {
+        return a.dstOffset < b.dstOffset;
+    });
+    size_t n = pieces.size();
+
+    //edges B -> A: destinations do not overlap, so pieces with destination overlapping source of B are found by binary search
+    //note: piece overlapping itself is moved in proper direction (like memmove), so no edge is needed
+    std::vector<std::vector<uint32_t>> after(n);
+    std::vector<uint32_t> blockers(n, 0);
+    for (size_t b = 0; b < n; b++) {
+        int64_t srcEnd = pieces[b].srcOffset + pieces[b].size;
+        size_t a = std::upper_bound(pieces.begin(), pieces.end(), pieces[b].srcOffset, [](int64_t pos, const InPlacePiece &p) -> bool {
+            return pos < p.dstOffset + p.size;
+        }) - pieces.begin();
+        for (; a < n && pieces[a].dstOffset < srcEnd; a++) if (a != b) {
+            after[b].push_back(a);
+            blockers[a]++;
+        }
+    }
+
+    steps.clear();
+    std::vector<char> isRead(n, false);
+    std::vector<uint32_t> ready;
+    for (size_t i = 0; i < n; i++)
+        if (blockers[i] == 0)
+            ready.push_back(i);
+    //unread pieces ordered by size (candidates for stashing)
+    std::set<std::pair<int64_t, uint32_t>> unread;
+    for (size_t i = 0; i < n; i++)
+        unread.insert(std::make_pair(pieces[i].size, uint32_t(i)));
+    auto markRead = [&](uint32_t b) {
+        isRead[b] = true;
+        unread.erase(std::make_pair(pieces[b].size, b));
+        for (uint32_t a : after[b])
+            if (--blockers[a] == 0)
+                ready.push_back(a);
+    };
+
+    int64_t stashed = 0, maxStashed = 0;
+    size_t written = 0;
+    while (written < n) {
+        if (ready.empty()) {
+            //only cycles remain: stash the smallest unread piece
+            TdmSyncAssert(!unread.empty());
+            uint32_t b = unread.begin()->second;
+            InPlaceStep step = {InPlaceStep::Stash, b};
+            steps.push_back(step);
+            stashed += pieces[b].size;
+            maxStashed = std::max(maxStashed, stashed);
+            markRead(b);
+            continue;
+        }
+        uint32_t a = ready.back();
+        ready.pop_back();
+        if (isRead[a]) {
+            InPlaceStep step = {InPlaceStep::WriteStashed, a};
+            steps.push_back(step);
+            stashed -= pieces[a].size;
+        }
+        else {
+            InPlaceStep step = {InPlaceStep::Move, a};
+            steps.push_back(step);
+            markRead(a);
+        }
+        written++;
+    }
+    return maxStashed;
+}
+
+//copy "size" bytes from "src" to "dst" position inside same file
+//ranges may overlap: then bytes are copied in such direction that source is read before it is overwritten
+static void moveInsideFile(BaseFile &file, int64_t src, int64_t dst, int64_t size, std::vector<uint8_t> &buffer) {
+    int64_t chunksNum = (size + int64_t(buffer.size()) - 1) / int64_t(buffer.size());
+    for (int64_t k = 0; k < chunksNum; k++) {
+        //when moving forward, go from the end
+        int64_t idx = (dst > src ? chunksNum - 1 - k : k);
+        int64_t from = idx * int64_t(buffer.size());
+        int64_t chunk = std::min(int64_t(buffer.size()), size - from);
+        file.seek(src + from);
+        file.read(buffer.data(), chunk);
+        file.seek(dst + from);
+        file.write(buffer.data(), chunk);
+    }
+}
+
+UpdatePlan FileInfo::createUpdatePlan(BaseFile &rdFile, int threadsNum, ChecksumLookup lookup, ScanMode mode) const {
+    std::vector<BaseFile*> rdFiles(1, &rdFile);
+    return createUpdatePlan(rdFiles, threadsNum, lookup, mode);
+}
+
+UpdatePlan FileInfo::createUpdatePlan(const std::vector<BaseFile*> &rdFiles, int threadsNum, ChecksumLookup lookup, ScanMode mode) const {
+    threadsNum = resolveThreadsNum(threadsNum);
+    UpdatePlan result;
+
+    bool anyScanned = false;
+    for (BaseFile *rdFile : rdFiles) {
+        TdmSyncAssert(rdFile->tell() == 0);
+        if (int64_t(rdFile->getSize()) >= blockSize)
+            anyScanned = true;
+    }
+
+    if (anyScanned) {
+        //copy checksums into simple array, prepare search algorithm on them
+        ChecksumIndex index;
+        index.create(lookup, blocks);
+        //note: index.lookup is resolved (never clAuto) after creation
+        ScanChunkFunc scanChunkFunc = chooseScanChunk(format.rollingHash, index.lookup, blockSize);
+        ScanContext ctx(*this, index, mode);
+
+        //indices of blocks sorted by offset (needed for sequential matching and aligned pass)
+        std::vector<uint32_t> order;
+        if (format.sequentialMatch || mode == smAligned) {
+            order.resize(blocks.size());
+            for (size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) -> bool {
+                return blocks[a].offset < blocks[b].offset;
+            });
+        }
+
+        //for sequential matching: find the next and the previous block (in order of offsets) for every block
+        std::vector<NextBlock> &nextBlocks = ctx.nextBlocks;
+        std::vector<PrevBlock> &prevBlocks = ctx.prevBlocks;
+        if (format.sequentialMatch) {
+            nextBlocks.resize(blocks.size());
+            prevBlocks.resize(blocks.size());
+            for (size_t i = 0; i + 1 < order.size(); i++) {
+                NextBlock &next = nextBlocks[order[i]];
+                next.chksum = blocks[order[i+1]].chksum;
+                next.delta = blocks[order[i+1]].offset - blocks[order[i]].offset;
+                PrevBlock &prev = prevBlocks[order[i+1]];
+                prev.block = order[i];
+                prev.delta = next.delta;
+            }
+        }
+
+        //for each block from metainfo file: whether it has already been found in some local file
+        std::vector<char> &foundBlocks = ctx.foundBlocks;
+        foundBlocks.assign(blocks.size(), false);
+        size_t foundCount = 0;
+
+        //local files are scanned one after another, a block found in earlier file is not searched in later ones
+        for (int source = 0; source < int(rdFiles.size()); source++) {
+            if (source > 0 && foundCount == blocks.size())
+                break;  //everything is already found
+            BaseFile &rdFile = *rdFiles[source];
+            int64_t srcFileSize = rdFile.getSize();
+            if (srcFileSize < blockSize)
+                continue;
+            uint64_t sumCount = 0;
+            int64_t windowsCount = srcFileSize - blockSize + 1;
+            ctx.windowsCount = windowsCount;
+
+            //ranges [from, to) of windows which must be scanned
+            //note: aligned pass is done only for the first local file (the one being updated),
+            //  other files usually contain moved data, so they are checked exhaustively
+            std::vector<std::pair<int64_t, int64_t>> scanRanges;
+            if (mode != smAligned || source > 0)
+                scanRanges.push_back(std::make_pair(int64_t(0), windowsCount));
+            else {
+                matchAlignedBlocks(*this, rdFile, order, threadsNum, foundBlocks);
+                //only windows which overlap some bytes not covered by aligned blocks are scanned
+                //note: if local file is same as remote, or one of them is the other one with appended data,
+                //  then all blocks are found here and nothing is scanned
+                int64_t coveredEnd = 0;
+                auto addGap = [&](int64_t gapFrom, int64_t gapTo) {
+                    int64_t from = std::max(gapFrom - blockSize + 1, int64_t(0));
+                    int64_t to = std::min(gapTo, windowsCount);
+                    if (from >= to)
+                        return;
+                    if (!scanRanges.empty() && scanRanges.back().second >= from)
+                        scanRanges.back().second = to;
+                    else
+                        scanRanges.push_back(std::make_pair(from, to));
+                };
+                bool allFound = true;
+                for (uint32_t j : order) {
+                    if (!foundBlocks[j]) {
+                        allFound = false;
+                        continue;
+                    }
+                    const BlockInfo &blk = blocks[j];
+                    if (blk.offset > coveredEnd)
+                        addGap(coveredEnd, blk.offset);
+                    coveredEnd = std::max(coveredEnd, blk.offset + blockSize);
+
+                    SegmentUse seg;
+                    seg.srcOffset = blk.offset;
+                    seg.dstOffset = blk.offset;
+                    seg.size = blockSize;
+                    seg.remote = false;
+                    result.segments.push_back(seg);
+                    foundCount++;
+                }
+                addGap(coveredEnd, srcFileSize);
+                if (allFound)
+                    scanRanges.clear();
+            }
+
+            //local file is processed in batches, every batch is read into memory and split into chunks
+            //chunks are scanned in parallel, each with its own rolling checksum and set of found blocks
+            //chunks (and batches) overlap by blockSize-1 bytes, so every window is checked exactly once
+            //with sequential matching, they overlap by blockSize more bytes on both sides
+            //  to see the next block after every window and the previous block before it
+            //since the first occurrence of every block wins, the plan does not depend on number of threads
+            static const int64_t ChunkBytes = 4 << 20;
+            int64_t chunkWindows = std::max(ChunkBytes, int64_t(blockSize));
+            int64_t lookahead = (format.sequentialMatch ? blockSize : 0);
+            int64_t lookbehind = lookahead;
+            //buffer contains bytes of local file starting from bufferFrom
+            std::vector<uint8_t> buffer;
+            int64_t bufferFrom = 0;
+            std::vector<ChunkScan> chunks;
+            //if file contents is directly accessible (e.g. memory-mapped), then it is scanned without copying
+            const uint8_t *fileData = rdFile.getData();
+
+            for (const auto &range : scanRanges) for (int64_t batchFrom = range.first; batchFrom < range.second; ) {
+                int64_t batchTo = std::min(batchFrom + chunkWindows * threadsNum, range.second);
+                int64_t batchDataTo = std::min(batchTo + lookahead, windowsCount);
+                int64_t batchDataFrom = std::max(batchFrom - lookbehind, int64_t(0));
+
+                const uint8_t *batchData = fileData + batchFrom;
+                if (!fileData) {
+                    //read local file bytes [batchDataFrom, batchDataTo + blockSize - 1) into buffer
+                    //the first bytes are the last bytes of previous batch (if they are already read)
+                    size_t kept = 0;
+                    if (batchDataFrom >= bufferFrom && batchDataFrom < bufferFrom + int64_t(buffer.size())) {
+                        kept = bufferFrom + buffer.size() - batchDataFrom;
+                        memmove(buffer.data(), buffer.data() + (batchDataFrom - bufferFrom), kept);
+                    }
+                    else if (int64_t(rdFile.tell()) != batchDataFrom)
+                        rdFile.seek(batchDataFrom);
+                    buffer.resize(batchDataTo - batchDataFrom + blockSize - 1);
+                    rdFile.read(buffer.data() + kept, buffer.size() - kept);
+                    bufferFrom = batchDataFrom;
+                    batchData = buffer.data() + (batchFrom - batchDataFrom);
+                }
+
+                chunks.clear();
+                for (int64_t from = batchFrom; from < batchTo; from += chunkWindows) {
+                    ChunkScan chunk;
+                    chunk.from = from;
+                    chunk.to = std::min(from + chunkWindows, batchTo);
+                    chunk.dataTo = std::min(chunk.to + lookahead, batchDataTo);
+                    chunk.dataFrom = std::max(from - lookbehind, batchDataFrom);
+                    chunks.push_back(chunk);
+                }
+                parallelFor(threadsNum, chunks.size(), [&](size_t k) {
+                    ChunkScan &chunk = chunks[k];
+                    scanChunkFunc(ctx, batchData + (chunk.from - batchFrom), chunk);
+                });
+
+                //merge found blocks in order of local file
+                for (const ChunkScan &chunk : chunks) {
+                    sumCount += chunk.sumCount;
+                    for (const BlockMatch &match : chunk.matches) {
+                        if (foundBlocks[match.block])
+                            continue;   //already found in previous chunk
+                        foundBlocks[match.block] = true;
                         SegmentUse seg;
-                        seg.srcOffset = offset;
-                        seg.dstOffset = blocks[j].offset;
+                        seg.srcOffset = match.offset;
+                        seg.dstOffset = blocks[match.block].offset;
                         seg.size = blockSize;
                         seg.remote = false;
+                        seg.source = source;
                         result.segments.push_back(seg);
+                        foundCount++;
                     }
                 }
-            }
 
-            if (offset + blockSize == srcFileSize)
-                break;  //end of local file
-            if (buffPtr == buffer.size()) {
-                //current sliding window hit the end of the buffer
-                size_t readmore = std::min((int64_t)buffer.size() - blockSize, srcFileSize - offset - blockSize);
-                readToBuffer(rdFile, buffer, readmore);
-                buffPtr -= readmore;
+                batchFrom = batchTo;
             }
-            //move current window by one byte and update rolling checksum
-            currChksum = checksumUpdate(currChksum, buffer[buffPtr], buffer[buffPtr - blockSize]);
-            buffPtr++;
+            //note: file is not read sequentially if it is accessed directly or if some windows are not scanned
+            if (int64_t(rdFile.tell()) != srcFileSize)
+                rdFile.seek(srcFileSize);
+            double avgCandidates = double(sumCount) / double(srcFileSize - blockSize + 1.0);
+            //fprintf(stderr, "Average candidates per window: %0.3g\n", avgCandidates);
         }
-        double avgCandidates = double(sumCount) / double(srcFileSize - blockSize + 1.0);
-        //fprintf(stderr, "Average candidates per window: %0.3g\n", avgCandidates);
     }
 
     int n = 0;
@@ -244,7 +1088,7 @@ UpdatePlan FileInfo::createUpdatePlan(BaseFile &rdFile) const {
         for (int i = 1; i < result.segments.size(); i++) {
             const auto &curr = result.segments[i];
             auto &last = result.segments[n-1];
-            if (last.dstOffset + last.size == curr.dstOffset && last.srcOffset + last.size == curr.srcOffset)
+            if (last.dstOffset + last.size == curr.dstOffset && last.srcOffset + last.size == curr.srcOffset && last.source == curr.source)
                 last.size += curr.size;
             else
                 result.segments[n++] = curr;
@@ -277,9 +1121,68 @@ UpdatePlan FileInfo::createUpdatePlan(BaseFile &rdFile) const {
     }
     TdmSyncAssert(result.bytesRemote == downloadSize);
 
+    std::vector<InPlacePiece> pieces;
+    std::vector<InPlaceStep> steps;
+    result.inPlaceFeasible = (scheduleInPlace(result.segments, pieces, steps) <= InPlaceStashLimit);
+
     return result;
 }
 
+int UpdatePlan::coalesceRemote(const RangeCostModel &model) {
+    int64_t rangeCost = model.rangeCost();
+    std::vector<SegmentUse> localSegs, remoteSegs;
+    for (const SegmentUse &seg : segments)
+        (seg.remote ? remoteSegs : localSegs).push_back(seg);
+
+    //remote segments are exactly the parts of file not covered by local segments,
+    //so local data between two remote segments is exactly the gap between them
+    //merging decision for every gap does not depend on others, so greedy merging is optimal
+    std::vector<SegmentUse> merged;
+    for (const SegmentUse &seg : remoteSegs) {
+        if (!merged.empty()) {
+            SegmentUse &last = merged.back();
+            int64_t gap = seg.dstOffset - (last.dstOffset + last.size);
+            if (gap <= rangeCost) {
+                last.size = seg.dstOffset + seg.size - last.dstOffset;
+                continue;
+            }
+        }
+        merged.push_back(seg);
+    }
+    int removed = int(remoteSegs.size() - merged.size());
+    if (removed == 0)
+        return 0;
+
+    //drop local segments which are now inside remote segments
+    //note: local segment never crosses boundary of remote segment
+    size_t k = 0, n = 0;
+    for (const SegmentUse &seg : localSegs) {
+        while (k < merged.size() && merged[k].dstOffset + merged[k].size <= seg.dstOffset)
+            k++;
+        if (k < merged.size() && merged[k].dstOffset < seg.dstOffset + seg.size) {
+            TdmSyncAssert(merged[k].dstOffset <= seg.dstOffset && seg.dstOffset + seg.size <= merged[k].dstOffset + merged[k].size);
+            continue;
+        }
+        localSegs[n++] = seg;
+    }
+    localSegs.resize(n);
+
+    segments = std::move(localSegs);
+    bytesLocal = bytesRemote = 0;
+    for (const SegmentUse &seg : segments)
+        bytesLocal += seg.size;
+    for (SegmentUse seg : merged) {
+        seg.srcOffset = bytesRemote;
+        bytesRemote += seg.size;
+        segments.push_back(seg);
+    }
+
+    std::vector<InPlacePiece> pieces;
+    std::vector<InPlaceStep> steps;
+    inPlaceFeasible = (scheduleInPlace(segments, pieces, steps) <= InPlaceStashLimit);
+    return removed;
+}
+
 //===========================================================================
 
 void UpdatePlan::print() const {
@@ -287,12 +1190,23 @@ void UpdatePlan::print() const {
     printf("Segments = %d:\n", (int)segments.size());
     for (int i = 0; i < segments.size(); i++) {
         const auto &seg = segments[i];
-        printf("  %c %08X: %08" PRIX64 " <- %08" PRIX64 "\n", (seg.remote ? 'R' : 'L'), (int)seg.size, seg.dstOffset, seg.srcOffset);
+        printf("  %c %08X: %08" PRIX64 " <- %08" PRIX64, (seg.remote ? 'R' : 'L'), (int)seg.size, seg.dstOffset, seg.srcOffset);
+        if (!seg.remote && seg.source != 0)
+            printf(" (file %d)", seg.source);
+        printf("\n");
     }
     printf("\n");
 }
 
+//copy "size" bytes from current position of "rd" file to current position of "wr" file
 static void copyfile(BaseFile &wr, BaseFile &rd, uint64_t size) {
+    if (const uint8_t *data = rd.getData()) {
+        //direct access: write straight from source memory
+        uint64_t pos = rd.tell();
+        wr.write(data + pos, size);
+        rd.seek(pos + size);
+        return;
+    }
     uint8_t buffer[65536];
     for (uint64_t pos = 0, chunk = 0; pos < size; pos += chunk) {
         chunk = std::min(size_t(size - pos), sizeof(buffer));
@@ -302,19 +1216,225 @@ static void copyfile(BaseFile &wr, BaseFile &rd, uint64_t size) {
 }
 
 void UpdatePlan::apply(BaseFile &rdLocalFile, BaseFile &rdDownloadFile, BaseFile &wrResultFile) const {
+    std::vector<BaseFile*> rdLocalFiles(1, &rdLocalFile);
+    apply(rdLocalFiles, rdDownloadFile, wrResultFile);
+}
+
+//collects data written to consecutive positions of file, so that it is written by large calls
+class WriteCombiner {
+public:
+    WriteCombiner(BaseFile &wrFile, size_t capacity) : file(wrFile), buffer(capacity) {}
+
+    //append "size" bytes at position "dstPos", taking them from current position of "rd" file
+    void append(uint64_t dstPos, BaseFile &rd, uint64_t size) {
+        if (used > 0 && start + used != dstPos)
+            flush();
+        if (used == 0)
+            start = dstPos;
+        const uint8_t *data = rd.getData();
+        while (size > 0) {
+            if (used == buffer.size())
+                flush();
+            size_t chunk = size_t(std::min(uint64_t(buffer.size() - used), size));
+            if (data) {
+                uint64_t pos = rd.tell();
+                memcpy(buffer.data() + used, data + pos, chunk);
+                rd.seek(pos + chunk);
+            }
+            else
+                rd.read(buffer.data() + used, chunk);
+            used += chunk;
+            size -= chunk;
+        }
+    }
+    void flush() {
+        if (used == 0)
+            return;
+        if (file.tell() != start)
+            file.seek(start);
+        file.write(buffer.data(), used);
+        start += used;
+        used = 0;
+    }
+
+private:
+    BaseFile &file;
+    std::vector<uint8_t> buffer;
+    uint64_t start = 0;
+    size_t used = 0;
+};
+
+void UpdatePlan::apply(const std::vector<BaseFile*> &rdLocalFiles, BaseFile &rdDownloadFile, BaseFile &wrResultFile) const {
     uint64_t resSize = 0;
-    if (!segments.empty()) {
-        const auto &last = segments.back();
-        resSize = last.dstOffset + last.size;
+    for (const SegmentUse &seg : segments)
+        resSize = std::max(resSize, uint64_t(seg.dstOffset + seg.size));
+    wrResultFile.preallocate(resSize);
+
+    //segments are copied in order of source files and offsets in them, so every source file is read sequentially
+    //(download file first, then local files in their order)
+    std::vector<const SegmentUse*> order;
+    for (const SegmentUse &seg : segments) {
+        TdmSyncAssert(seg.remote || (seg.source >= 0 && seg.source < int(rdLocalFiles.size())));
+        order.push_back(&seg);
     }
+    std::sort(order.begin(), order.end(), [](const SegmentUse *a, const SegmentUse *b) -> bool {
+        int srcA = (a->remote ? -1 : a->source), srcB = (b->remote ? -1 : b->source);
+        if (srcA != srcB)
+            return srcA < srcB;
+        return a->srcOffset < b->srcOffset;
+    });
 
-    for (int i = 0; i < segments.size(); i++) {
-        const auto &seg = segments[i];
-        auto &srcFile = seg.remote ? rdDownloadFile : rdLocalFile;
-        wrResultFile.seek(seg.dstOffset);
+    //large segments are copied by the file backend without reading them (e.g. reflink or in-kernel copy)
+    //small ones are read into buffer, where data for consecutive positions of result file is merged
+    static const int64_t MinDirectCopySize = 64 << 10;
+    WriteCombiner combiner(wrResultFile, 1 << 20);
+    for (const SegmentUse *seg : order) {
+        BaseFile &srcFile = seg->remote ? rdDownloadFile : *rdLocalFiles[seg->source];
+        if (seg->size >= MinDirectCopySize && wrResultFile.copyRangeFrom(srcFile, seg->srcOffset, seg->dstOffset, seg->size))
+            continue;
+        if (int64_t(srcFile.tell()) != seg->srcOffset)
+            srcFile.seek(seg->srcOffset);
+        combiner.append(seg->dstOffset, srcFile, seg->size);
+    }
+    combiner.flush();
+}
+
+//download file which is not stored anywhere (see UpdatePlan::applyStreaming)
+//bytes written at some position of it are written to the corresponding place of result file
+//note: result file is shared with the thread copying local segments, so access to it is locked
+class StreamingSink : public BaseFile {
+public:
+    StreamingSink(const UpdatePlan &plan, BaseFile &wrResultFile, std::mutex &resultMutex) : resultFile(wrResultFile), resultMutex(resultMutex) {
+        for (const SegmentUse &seg : plan.segments)
+            if (seg.remote)
+                remotes.push_back(&seg);
+    }
+
+    virtual void read(void* /*data*/, size_t /*size*/) override {
+        TdmSyncAssertF(false, "Streaming download file cannot be read");
+    }
+    virtual void write(const void* data, size_t size) override {
+        const uint8_t *bytes = (const uint8_t*)data;
+        while (size > 0) {
+            //find remote segment containing current position (they are sorted by srcOffset)
+            auto it = std::upper_bound(remotes.begin(), remotes.end(), int64_t(pos), [](int64_t p, const SegmentUse *seg) -> bool {
+                return p < seg->srcOffset;
+            });
+            TdmSyncAssertF(it != remotes.begin(), "Write at %" PRId64 " is outside of remote segments", int64_t(pos));
+            const SegmentUse &seg = **(it - 1);
+            int64_t delta = pos - seg.srcOffset;
+            TdmSyncAssertF(delta < seg.size, "Write at %" PRId64 " is outside of remote segments", int64_t(pos));
+            size_t chunk = size_t(std::min(int64_t(size), seg.size - delta));
+            {
+                std::lock_guard<std::mutex> lock(resultMutex);
+                resultFile.seek(seg.dstOffset + delta);
+                resultFile.write(bytes, chunk);
+            }
+            bytes += chunk;
+            size -= chunk;
+            pos += chunk;
+        }
+        written = std::max(written, pos);
+    }
+    virtual void seek(uint64_t newPos) override { pos = newPos; }
+    virtual uint64_t tell() override { return pos; }
+    virtual uint64_t getSize() override { return written; }
+    virtual void flush() override {}
+
+private:
+    BaseFile &resultFile;
+    std::mutex &resultMutex;
+    std::vector<const SegmentUse*> remotes;
+    uint64_t pos = 0, written = 0;
+};
+
+void UpdatePlan::applyStreaming(const std::vector<BaseFile*> &rdLocalFiles, BaseFile &wrResultFile, const std::function<void(BaseFile &wrDownloadFile)> &download) const {
+    std::mutex resultMutex;
+    StreamingSink sink(*this, wrResultFile, resultMutex);
+
+    auto copyLocal = [&]() {
+        std::vector<uint8_t> buffer(1 << 20);
+        for (const SegmentUse &seg : segments) {
+            if (seg.remote)
+                continue;
+            TdmSyncAssert(seg.source >= 0 && seg.source < int(rdLocalFiles.size()));
+            BaseFile &srcFile = *rdLocalFiles[seg.source];
+            const uint8_t *srcData = srcFile.getData();
+            for (int64_t done = 0, chunk = 0; done < seg.size; done += chunk) {
+                chunk = std::min(seg.size - done, int64_t(buffer.size()));
+                const uint8_t *ptr = srcData + seg.srcOffset + done;
+                if (!srcData) {
+                    //note: local file is read outside of lock, so download is not blocked meanwhile
+                    if (int64_t(srcFile.tell()) != seg.srcOffset + done)
+                        srcFile.seek(seg.srcOffset + done);
+                    srcFile.read(buffer.data(), chunk);
+                    ptr = buffer.data();
+                }
+                std::lock_guard<std::mutex> lock(resultMutex);
+                wrResultFile.seek(seg.dstOffset + done);
+                wrResultFile.write(ptr, chunk);
+            }
+        }
+    };
+
+    //one task downloads remote segments, another one copies local segments
+    parallelFor(2, 2, [&](size_t k) {
+        if (k == 0)
+            download(sink);
+        else
+            copyLocal();
+    });
+    TdmSyncAssertF(int64_t(sink.getSize()) == bytesRemote, "Downloaded %" PRId64 " bytes instead of %" PRId64, int64_t(sink.getSize()), bytesRemote);
+}
+
+void UpdatePlan::applyInPlace(const std::vector<BaseFile*> &rdwrLocalFiles, const std::function<void(BaseFile &wrDownloadFile)> &download) const {
+    TdmSyncAssertF(inPlaceFeasible, "In-place update is not feasible for this plan");
+    TdmSyncAssert(!rdwrLocalFiles.empty());
+    BaseFile &file = *rdwrLocalFiles[0];
+    int64_t resSize = 0;
+    for (const SegmentUse &seg : segments)
+        resSize = std::max(resSize, seg.dstOffset + seg.size);
+
+    //move local data inside the file
+    std::vector<InPlacePiece> pieces;
+    std::vector<InPlaceStep> steps;
+    scheduleInPlace(segments, pieces, steps);
+    std::vector<uint8_t> buffer(InPlacePieceSize);
+    std::vector<std::vector<uint8_t>> stash(pieces.size());
+    for (const InPlaceStep &step : steps) {
+        const InPlacePiece &piece = pieces[step.piece];
+        if (step.action == InPlaceStep::Move)
+            moveInsideFile(file, piece.srcOffset, piece.dstOffset, piece.size, buffer);
+        else if (step.action == InPlaceStep::Stash) {
+            stash[step.piece].resize(piece.size);
+            file.seek(piece.srcOffset);
+            file.read(stash[step.piece].data(), piece.size);
+        }
+        else {
+            file.seek(piece.dstOffset);
+            file.write(stash[step.piece].data(), piece.size);
+            std::vector<uint8_t>().swap(stash[step.piece]);
+        }
+    }
+
+    //now the data of local file is not needed, so everything else can overwrite it
+    for (const SegmentUse &seg : segments) {
+        if (seg.remote || seg.source == 0)
+            continue;
+        TdmSyncAssert(seg.source < int(rdwrLocalFiles.size()));
+        BaseFile &srcFile = *rdwrLocalFiles[seg.source];
+        file.seek(seg.dstOffset);
         srcFile.seek(seg.srcOffset);
-        copyfile(wrResultFile, srcFile, seg.size);
+        copyfile(file, srcFile, seg.size);
     }
+    std::mutex fileMutex;
+    StreamingSink sink(*this, file, fileMutex);
+    download(sink);
+    TdmSyncAssertF(int64_t(sink.getSize()) == bytesRemote, "Downloaded %" PRId64 " bytes instead of %" PRId64, int64_t(sink.getSize()), bytesRemote);
+
+    if (int64_t(file.getSize()) != resSize)
+        file.truncate(resSize);
+    file.flush();
 }
 
 void UpdatePlan::createDownloadFile(BaseFile &rdRemoteFile, BaseFile &wrDownloadFile) const {
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <vector>
 #include <stdexcept>
+#include <functional>
 #include "fileio.h"
 
 
@@ -24,6 +25,25 @@ struct SegmentUse {
     int64_t size = 0;
     //the data for this segment is taken from: local file (remote = false) / remote file (remote = true)
     bool remote = false;
+    //for local segment: index of local file in the list the plan was created with (0 = the file being updated)
+    int source = 0;
+};
+
+//cost model of downloading remote segments (see UpdatePlan::coalesceRemote)
+//every remote segment becomes a separate byte range in HTTP request, and every range costs something beyond its data
+struct RangeCostModel {
+    //bytes transferred for every range in addition to its data: part header of multipart response,
+    //boundary and the range itself in request (about 100 bytes), plus server-side seek
+    int64_t rangeOverhead = 100;
+    //round trip time (in seconds) added by every range
+    //zero when all ranges go in one multipart request; when ranges are requested separately
+    //(server does not support multipart), it is about RTT divided by number of connections
+    double rangeRtt = 0.0;
+    //download speed (in bytes per second): converts time into bytes
+    double bandwidth = 10e+6;
+
+    //cost of one range expressed in bytes
+    int64_t rangeCost() const { return rangeOverhead + int64_t(rangeRtt * bandwidth); }
 };
 
 //full instructions for turning the existing local file into the specified remote file
@@ -34,6 +54,8 @@ struct UpdatePlan {
     //stats: how many bytes are taken from local file / must be downloaded from remote file
     int64_t bytesLocal = 0;
     int64_t bytesRemote = 0;
+    //whether applyInPlace can be used: local data can be moved inside local file using bounded memory
+    bool inPlaceFeasible = false;
 
     //creates the file with all remote segments from "remote" file (when it is actually located on same machine)
     //note: if remote file is on web server, then use CurlDownloader::downloadMissingParts instead
@@ -44,20 +66,135 @@ struct UpdatePlan {
     //rdDownloadFile --- file with all remote segments downloaded and concatenated in their order
     //wrResultFile --- the resulting file where the patched version will be constructed
     void apply(BaseFile &rdLocalFile, BaseFile &rdDownloadFile, BaseFile &wrResultFile) const;
+    //same as above, but local segments are taken from several local files (see SegmentUse::source)
+    //rdLocalFiles --- same list of local files as the plan was devised with
+    void apply(const std::vector<BaseFile*> &rdLocalFiles, BaseFile &rdDownloadFile, BaseFile &wrResultFile) const;
+
+    //patch the local file without intermediate file with downloaded data
+    //download --- function which writes all remote segments into the passed file (like createDownloadFile or
+    //  CurlDownloader::downloadMissingParts do), every segment goes straight to its place in result file
+    //local segments are copied into result file by another thread meanwhile
+    void applyStreaming(const std::vector<BaseFile*> &rdLocalFiles, BaseFile &wrResultFile, const std::function<void(BaseFile &wrDownloadFile)> &download) const;
+
+    //patch the local file in place, without creating result file (only if inPlaceFeasible)
+    //rdwrLocalFiles --- same list of local files as the plan was devised with, the first one is modified
+    //  (it must support reading, writing and truncate, e.g. StdioFile opened as ReadWrite)
+    //download --- same as in applyStreaming, called after all local data is moved
+    //local segments are moved in such order that no data is overwritten before it is read
+    //note: if this fails midway, then local file is left in inconsistent state
+    void applyInPlace(const std::vector<BaseFile*> &rdwrLocalFiles, const std::function<void(BaseFile &wrDownloadFile)> &download) const;
+
+    //merge remote segments separated by short local data, so that fewer byte ranges are downloaded
+    //two neighboring remote segments are merged if downloading the data between them is cheaper than
+    //  a separate range; local segments between them are dropped then (and their data is downloaded)
+    //returns number of remote segments removed by merging
+    //note: the plan stays valid for all apply methods, bytesRemote usually grows
+    int coalesceRemote(const RangeCostModel &model);
 
     //(debug) print the plan to stdout
     void print() const;
 };
 
+//algorithm of slow and good hash of blocks (BlockInfo::hash)
+//note: value is stored in metainfo file, so never change existing values
+enum StrongHash {
+    shSha1 = 0,         //SHA-1, 160-bit (old metainfo files always use it)
+    shMurmur3 = 1,      //MurmurHash3 x64, 128-bit: not cryptographic, but several times faster
+};
+//returns size of hash value (in bytes) for specified algorithm
+int strongHashSize(StrongHash algo);
+
+//algorithm of rolling checksum of blocks (BlockInfo::chksum)
+//note: value is stored in metainfo file, so never change existing values
+enum RollingHash {
+    rhPolyhash = 0,     //polynomial hash modulo 2^31-1: has collision guarantees (old metainfo files always use it)
+    rhBuzhash = 1,      //cyclic polynomial (buzhash): a bit faster on low level, but has low quality
+                        //and exhibits quadratic behavior easily (e.g. on periodic data)
+};
+
+//search structure used to find blocks by checksum when local file is scanned
+//it does not affect the resulting plan, only performance
+enum ChecksumLookup {
+    clAuto = -1,        //choose automatically depending on number of blocks
+    clPhf = 0,          //perfect hash function: fastest on small sizes, but building it takes superlinear time
+    clBinsearch = 1,    //branchless binary search over checksums array: log(N) reads, no extra memory
+    clBuckets = 2,      //hash table with cache-line buckets: one random read, fast to build
+};
+
+//how local file is scanned for blocks when update plan is created
+enum ScanMode {
+    smExhaustive = 0,   //every window is checked: every block present in local file is found
+    smSkipAhead = 1,    //windows overlapping a found block are skipped: much faster on similar files,
+                        //but a block overlapping another found block can be missed (and downloaded)
+    smAligned = 2,      //every block is first checked at its own offset, then only windows overlapping unmatched
+                        //parts of local file are checked: fastest when most data stays in place (e.g. appended file),
+                        //but a block located inside the matched parts at another offset can be missed
+};
+
+//format of metainfo file: which algorithms are used and how data is stored
+//default-constructed format is the original format (old versions of tdmsync read only it)
+struct MetaFormat {
+    //value of hashBytes: choose it automatically from file size and number of blocks
+    static const int HASH_BYTES_AUTO = -1;
+    //value of checksumBytes: choose it automatically from file size and number of blocks
+    static const int CHECKSUM_BYTES_AUTO = -1;
+
+    //algorithm of BlockInfo::chksum
+    RollingHash rollingHash = rhPolyhash;
+    //algorithm of BlockInfo::hash
+    StrongHash strongHash = shSha1;
+    //how many first bytes of strong hash are stored for every block (0 = whole hash)
+    //shorter hashes make metainfo smaller, but increase chance of undetected false match
+    //HASH_BYTES_AUTO can be passed to computeFromFile: then hash is truncated to keep the chance negligible
+    int hashBytes = 0;
+    //if true, then offsets of blocks are not stored in metainfo file
+    //blocks are stored in order of offsets, so offsets can be restored from block index
+    bool implicitOffsets = false;
+    //if true, then a window of local file matches a block only if the window where the next block
+    //  of remote file must start has its checksum (like zsync does),
+    //  or the previous block of remote file is present right before the window (checked by checksum, then by strong hash)
+    //strong hash is computed only for such windows, so checksums can be much shorter
+    //note: the first and the last blocks of remote file are matched without this condition
+    bool sequentialMatch = false;
+    //how many lower bytes of rolling checksum are stored for every block (0 = whole checksum)
+    //CHECKSUM_BYTES_AUTO can be passed to computeFromFile: then it depends on sequentialMatch
+    int checksumBytes = 0;
+
+    //returns size of hash value (in bytes) which is actually stored and compared
+    int storedHashSize() const { return hashBytes > 0 ? hashBytes : strongHashSize(strongHash); }
+    //returns size of rolling checksum (in bytes) which is actually stored and compared
+    int storedChecksumSize() const { return checksumBytes > 0 ? checksumBytes : 4; }
+    //mask of the checksum bits which are stored (BlockInfo::chksum always has other bits zero)
+    uint32_t checksumMask() const { return storedChecksumSize() < 4 ? (1U << 8 * storedChecksumSize()) - 1 : 0xFFFFFFFFU; }
+    bool isDefault() const {
+        return rollingHash == rhPolyhash && strongHash == shSha1 && hashBytes == 0 && !implicitOffsets &&
+            !sequentialMatch && storedChecksumSize() == 4;
+    }
+
+    //compact format: shortest hashes and checksums which are still safe, no offsets
+    //this is similar to what zsync does; the metainfo file becomes 3-4 times smaller
+    static MetaFormat compact(StrongHash strongHash = shSha1) {
+        MetaFormat res;
+        res.strongHash = strongHash;
+        res.hashBytes = HASH_BYTES_AUTO;
+        res.implicitOffsets = true;
+        res.sequentialMatch = true;
+        res.checksumBytes = CHECKSUM_BYTES_AUTO;
+        return res;
+    }
+};
+
 #pragma pack(push, 1)
 //information about one block of remote file (stored in the metainfo file)
 struct BlockInfo {
-    static const int HASH_SIZE = 20;    //SHA-1 is 160-bit
+    static const int HASH_SIZE = 20;    //max size of hash: SHA-1 is 160-bit
     //position of block start (size is always FileInfo::blockSize)
     int64_t offset = 0;
-    //rolling checksum of this block
+    //rolling checksum of this block (algorithm is FileInfo::format.rollingHash)
+    //only lower FileInfo::format.checksumBytes bytes are kept, others are zero
     uint32_t chksum = 0;
-    //slow and good hash of the block (SHA-1)
+    //slow and good hash of the block (algorithm is FileInfo::format.strongHash)
+    //if hash is shorter than HASH_SIZE (or truncated), then remaining bytes are zero
     uint8_t hash[HASH_SIZE];
 };
 #pragma pack(pop)
@@ -68,6 +205,8 @@ struct FileInfo {
     int64_t fileSize = 0;
     //size of every block of file
     int blockSize = 0;
+    //algorithms used to compute this metainfo
+    MetaFormat format;
     //information about all the blocks of file
     //blocks are sorted by their checksum
     //physically last block usually slightly overlaps with the prelast one
@@ -80,10 +219,21 @@ struct FileInfo {
 
     //compute metainfo for the specified file
     //completely overwrites this object with new info
-    void computeFromFile(BaseFile &rdFile, int blockSize);
+    //threadsNum --- how many threads compute hashes of blocks (nonpositive = all hardware threads)
+    //format --- which algorithms to use (note: old versions of tdmsync can read only default format)
+    //note: the result does not depend on number of threads
+    void computeFromFile(BaseFile &rdFile, int blockSize, int threadsNum = 1, const MetaFormat &format = MetaFormat());
 
     //devise update plan, which could turn specified local file into the remote file with this metainfo
-    UpdatePlan createUpdatePlan(BaseFile &rdFile) const;
+    //threadsNum --- how many threads scan the local file (nonpositive = all hardware threads)
+    //lookup --- data structure for searching blocks by checksum
+    //mode --- which windows of local file are checked
+    //note: the plan does not depend on number of threads and lookup structure
+    UpdatePlan createUpdatePlan(BaseFile &rdFile, int threadsNum = 1, ChecksumLookup lookup = clAuto, ScanMode mode = smExhaustive) const;
+    //same as above, but blocks are searched in several local files (e.g. other files of same package, or backup copies)
+    //rdFiles[0] is the local file being updated, a block found in several files is taken from the first of them
+    //note: aligned pass of smAligned mode is done only for rdFiles[0], other files are scanned fully
+    UpdatePlan createUpdatePlan(const std::vector<BaseFile*> &rdFiles, int threadsNum = 1, ChecksumLookup lookup = clAuto, ScanMode mode = smExhaustive) const;
 };
 
 }
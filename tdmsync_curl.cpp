@@ -1,8 +1,13 @@
 #include "tdmsync_curl.h"
 #include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <vector>
 #include <algorithm>
 #include <memory>
+#include <deque>
+#include <chrono>
 
 #include "tsassert.h"
 #undef min
@@ -24,363 +29,690 @@
 
 namespace TdmSync {
 
+CurlSession::CurlSession() : requestsNum(0), connectsNum(0) {
+    share = curl_share_init();
+    TdmSyncAssertF(share, "Failed to initialize curl share");
+    auto lock_callback = [](CURL* /*handle*/, curl_lock_data data, curl_lock_access /*access*/, void *userptr) {
+        ((CurlSession*)userptr)->locks[data].lock();
+    };
+    auto unlock_callback = [](CURL* /*handle*/, curl_lock_data data, void *userptr) {
+        ((CurlSession*)userptr)->locks[data].unlock();
+    };
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, (curl_lock_function)lock_callback);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, (curl_unlock_function)unlock_callback);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, (void*)this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+CurlSession::~CurlSession() {
+    //note: all easy handles using the share must be cleaned up by now
+    for (CURLM *multi : allMultis)
+        curl_multi_cleanup(multi);
+    curl_share_cleanup(share);
+}
+
+void CurlSession::attach(CURL *handle) {
+    curl_easy_setopt(handle, CURLOPT_SHARE, share);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+}
+
+CURLM *CurlSession::acquireMulti() {
+    std::lock_guard<std::mutex> lock(multisMutex);
+    if (!idleMultis.empty()) {
+        CURLM *multi = idleMultis.back();
+        idleMultis.pop_back();
+        return multi;
+    }
+    CURLM *multi = curl_multi_init();
+    TdmSyncAssertF(multi, "Failed to initialize curl");
+    allMultis.push_back(multi);
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_HTTP1 | CURLPIPE_MULTIPLEX);
+    return multi;
+}
+
+void CurlSession::releaseMulti(CURLM *multi) {
+    std::lock_guard<std::mutex> lock(multisMutex);
+    idleMultis.push_back(multi);
+}
+
+void CurlSession::noteTransfer(CURL *handle) {
+    long connects = 0;
+    curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+    requestsNum++;
+    connectsNum += connects;
+}
+
+
 void CurlDownloader::clear() {
+    //everything is reset except for session and options
+    CurlSession *usedSession = session;
+    std::unique_ptr<CurlSession> usedOwnSession = std::move(ownSession);
+    BatchOptions usedOptions = batchOptions;
     *this = CurlDownloader();
+    session = usedSession;
+    ownSession = std::move(usedOwnSession);
+    batchOptions = usedOptions;
 }
 
+CurlSession &CurlDownloader::getSession() {
+    if (!session) {
+        ownSession.reset(new CurlSession());
+        session = ownSession.get();
+    }
+    return *session;
+}
 
-void CurlDownloader::downloadMeta(BaseFile &wrDownloadFile, const char *url_) {
-    clear();
-    downloadFile = &wrDownloadFile;
-    url = url_;
+bool CurlDownloader::Request::succeeded() const {
+    return retCode == CURLE_OK && (httpCode == 0 || httpCode / 100 == 2) && work.written == work.expected;
+}
+bool CurlDownloader::Request::retryable() const {
+    //write error means that we rejected the response ourselves (e.g. whole file was sent), repeating won't help
+    //4xx errors are also permanent, but 5xx and network errors are often transient
+    if (httpCode / 100 == 4 || retCode == CURLE_WRITE_ERROR)
+        return false;
+    return true;
+}
+
+void CurlDownloader::initRequest(Request &req, int firstRange, int rangesNum) {
+    req.owner = this;
+    req.firstRange = firstRange;
+    req.rangesNum = rangesNum;
+    //create http byte-ranges string
+    req.rangesString.clear();
+    for (int i = firstRange; i < firstRange + rangesNum; i++) {
+        char buff[256];
+        sprintf(buff, "%" PRId64 "-%" PRId64, ranges[i].from, ranges[i].to);
+        if (i > firstRange)
+            req.rangesString += ',';
+        req.rangesString += buff;
+    }
+    //ranges of one request go in increasing order in download file (with holes where journal says data is written)
+    const Range &last = ranges[firstRange + rangesNum - 1];
+    req.work.start = ranges[firstRange].filePos;
+    req.work.end = last.filePos + (last.to - last.from + 1);
+    req.work.written = 0;
+    req.work.expected = 0;
+    for (int i = firstRange; i < firstRange + rangesNum; i++)
+        req.work.expected += ranges[i].to - ranges[i].from + 1;
+    //request object may be reused: forget previous response
+    req.header.clear();
+    req.boundary.clear();
+    req.contentFrom = req.contentTo = -1;
+    req.isHttp = req.acceptRanges = false;
+    req.httpCode = 0;
+    req.retCode = -1;
+    req.parser = MultipartParser();
+}
 
+std::unique_ptr<CURL, void (*)(CURL*)> CurlDownloader::createHandle() {
+    std::unique_ptr<CURL, void (*)(CURL*)> curl(curl_easy_init(), curl_easy_cleanup);
+    TdmSyncAssertF(curl, "Failed to initialize curl");
+    getSession().attach(curl.get());
+    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+    return curl;
+}
+
+void CurlDownloader::setupHandle(CURL *curl, Request &req, bool meta) {
     auto header_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        return ((CurlDownloader*)userdata)->headerWriteCallback(ptr, size, nmemb);
+        Request *req = (Request*)userdata;
+        return req->owner->headerWriteCallback(*req, ptr, size, nmemb);
     };
     auto plain_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        return ((CurlDownloader*)userdata)->plainWriteCallback(ptr, size, nmemb);
+        Request *req = (Request*)userdata;
+        return req->owner->plainWriteCallback(*req, ptr, size, nmemb);
     };
-    std::unique_ptr<CURL, void (*)(CURL*)> curl(curl_easy_init(), curl_easy_cleanup);
-    TdmSyncAssertF(curl, "Failed to initialize curl");
-    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERFUNCTION, (curl_write_callback)header_write_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, (void*)this);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, (curl_write_callback)plain_write_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, (void*)this);
-
-    int retCode = curl_easy_perform(curl.get());
-    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &httpCode);
-    TdmSyncAssertF(httpCode == 0 || httpCode / 100 == 2, "Downloading metafile failed: http response %d", (int)httpCode);
-    TdmSyncAssertF(retCode == CURLE_OK, "Downloading metafile failed: curl error %d", retCode);
+    auto single_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
+        Request *req = (Request*)userdata;
+        return req->owner->singleWriteCallback(*req, ptr, size, nmemb);
+    };
+    auto multi_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
+        Request *req = (Request*)userdata;
+        return req->owner->multiWriteCallback(*req, ptr, size, nmemb);
+    };
+
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, (curl_write_callback)header_write_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)&req);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&req);
+    if (meta)
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)plain_write_callback);
+    else if (req.rangesNum == 1)
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)single_write_callback);
+    else
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)multi_write_callback);
+    curl_easy_setopt(curl, CURLOPT_RANGE, meta ? (const char*)NULL : req.rangesString.c_str());
+}
+
+
+void CurlDownloader::downloadMeta(BaseFile &wrDownloadFile, const char *url_) {
+    clear();
+    downloadFile = &wrDownloadFile;
+    url = url_;
+
+    Request req;
+    req.owner = this;
+    auto curl = createHandle();
+    setupHandle(curl.get(), req, true);
+
+    req.retCode = performTransfers({curl.get()})[0];
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &req.httpCode);
+    TdmSyncAssertF(req.httpCode == 0 || req.httpCode / 100 == 2, "Downloading metafile failed: http response %d", (int)req.httpCode);
+    TdmSyncAssertF(req.retCode == CURLE_OK, "Downloading metafile failed: curl error %d", req.retCode);
 }
-size_t CurlDownloader::plainWriteCallback(char *ptr, size_t size, size_t nmemb) {
+size_t CurlDownloader::plainWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb) {
     //note: we can download metainfo file without byte ranges support, but it will be useless then
-    if (!isHttp || !acceptRanges)
+    if (!req.isHttp || !req.acceptRanges)
         return 0;
     downloadFile->write(ptr, size * nmemb);
     return nmemb;
 }
 
+//note: header names are case-insensitive (e.g. HTTP/2 sends them in lowercase)
 static const char *startsWith(const std::string &line, const char *prefix){
-    int len = strlen(prefix);
-    if (strncmp(line.c_str(), prefix, len) == 0)
-        return line.c_str() + len;
-    return nullptr;
+    size_t len = strlen(prefix);
+    if (line.size() < len)
+        return nullptr;
+    for (size_t i = 0; i < len; i++)
+        if (tolower((unsigned char)line[i]) != tolower((unsigned char)prefix[i]))
+            return nullptr;
+    return line.c_str() + len;
 }
-size_t CurlDownloader::headerWriteCallback(char *ptr, size_t size, size_t nmemb) {
+size_t CurlDownloader::headerWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb) {
     size_t bytes = size * nmemb;
     std::string added(ptr, ptr + bytes);
-    header += added;    //curl calls callback once per each line of header
+    req.header += added;    //curl calls callback once per each line of header
+
+    if (startsWith(added, "HTTP")) {
+        req.isHttp = true;          //this class is tied to HTTP multi-byte-range behavior
+        //status line "HTTP/1.1 206 Partial Content": code is needed before body arrives
+        //(curl reports final code when transfer is done)
+        size_t space = added.find(' ');
+        if (space != std::string::npos)
+            req.httpCode = atol(added.c_str() + space + 1);
+    }
 
-    if (startsWith(added, "HTTP"))
-        isHttp = true;          //this class is tied to HTTP multi-byte-range behavior
+    if (startsWith(added, "Accept-Ranges: bytes"))      //returned on any request
+        req.acceptRanges = true;    //differential update is impossible without byte ranges
 
-    if (startsWith(added, "Accept-Ranges: bytes") ||        //returned on any request
-        startsWith(added, "Content-Range: bytes")           //some servers don't return accept-ranges for range requests
-    ) {
-        acceptRanges = true;    //differential update is impossible without byte ranges
+    if (auto value = startsWith(added, "Content-Range:")) {
+        //some servers don't return accept-ranges for range requests
+        //for multi-range request, server may send one range if it has merged all of them
+        if (parseContentRange(value, added.c_str() + added.size() - value, req.contentFrom, req.contentTo))
+            req.acceptRanges = true;
     }
 
     //check if this is a multipart response for multi-byte-range request
-    if (auto ptr = startsWith(added, "Content-Type: multipart/byteranges; boundary=")) {
-        acceptRanges = true;                                //some servers don't return accept-ranges for range requests
-        int pos = ptr - added.c_str();
-        //save boundary string for parsing the response
-        std::string token = added.substr(pos, added.size() - 2 - pos);
-        boundary = "\r\n--" + token;// + "\r\n";
+    if (startsWith(added, "Content-Type:")) {
+        std::string lower = added;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        size_t pos = lower.find("boundary=");
+        if (lower.find("multipart/byteranges") != std::string::npos && pos != std::string::npos) {
+            req.acceptRanges = true;                        //some servers don't return accept-ranges for range requests
+            //save boundary token for parsing the response (it may be quoted)
+            std::string token = added.substr(pos + 9);
+            if (!token.empty() && token[0] == '"')
+                token = token.substr(1, token.find('"', 1) - 1);
+            else
+                token = token.substr(0, token.find_first_of("; \t\r\n"));
+            req.boundary = token;
+        }
     }
 
     return nmemb;
 }
 
 
-void CurlDownloader::downloadMissingParts(BaseFile &wrDownloadFile, const UpdatePlan &plan_, const char *url_) {
+void CurlDownloader::downloadMissingParts(BaseFile &wrDownloadFile, const UpdatePlan &plan_, const char *url_, DownloadJournal *journal_) {
     clear();
     downloadFile = &wrDownloadFile;
     plan = &plan_;
     url = url_;
+    journal = (journal_ ? journal_ : &ownJournal);
 
-    //create http byte-ranges string
-    ranges.clear();
-    rangesString.clear();
+    //collect byte ranges, split the ones which don't fit into one request
+    int64_t maxBytes = std::max(batchOptions.maxBytes, (int64_t)1);
+    int64_t filePos = 0;
     for (size_t i = 0; i < plan->segments.size(); i++) {
         const auto &seg = plan->segments[i];
         if (seg.remote) {
-            char buff[256];
-            sprintf(buff, "%" PRId64 "-%" PRId64, seg.dstOffset, seg.dstOffset + seg.size - 1);
-            if (!ranges.empty())
-                rangesString += ',';
-            rangesString += buff;
-            ranges.push_back(buff);
+            for (int64_t off = 0; off < seg.size; off += maxBytes) {
+                int64_t len = std::min(maxBytes, seg.size - off);
+                Range rng;
+                rng.from = seg.dstOffset + off;
+                rng.to = rng.from + len - 1;
+                rng.filePos = filePos;
+                ranges.push_back(rng);
+                filePos += len;
+            }
             totalCount++;
             totalSize += seg.size;
         }
     }
     TdmSyncAssert(totalSize == plan->bytesRemote);
-    mainWorkRange.start = mainWorkRange.written = 0;
-    mainWorkRange.end = totalSize;
 
-    int retCode = -1;
     if (totalCount == 0) {
         usedMode = dmNone;              //nothing to download: empty file is OK
         return;
     }
-    else if (totalCount == 1) {
-        //retCode = performSingle();      //download with single byte-range
-        retCode = performMany();        //(use the same code as for many requests)
-        usedMode = dmSingleByterange;
+
+    //parts written by previous run (according to journal) are not downloaded again
+    if (journal->getWrittenBytes() > 0) {
+        std::vector<Range> missing;
+        for (const Range &rng : ranges) {
+            journal->forEachMissing(rng.filePos, rng.filePos + (rng.to - rng.from + 1), [&](int64_t from, int64_t to) {
+                missing.push_back(Range{rng.from + (from - rng.filePos), rng.from + (to - rng.filePos) - 1, from});
+            });
+        }
+        ranges.swap(missing);
+        if (ranges.empty()) {
+            usedMode = dmNone;          //everything was downloaded by previous run
+            return;
+        }
     }
-    else {
-        retCode = performMulti();       //download with multi-ranges
-        usedMode = dmMultipartByterange;
-        if (retCode != CURLE_OK) {
-            //multi-ranges not supported, send many single-range requests instead
-            usedMode = dmManyByteranges;
-            downloadFile->seek(0);
-            mainWorkRange.written = 0, httpCode = 0;
-            retCode = performMany();  //download with many pipelines requests, one range in each
+
+    //split ranges into batches: every batch is downloaded with one request (multipart if it has many ranges)
+    //batches go simultaneously over several connections
+    int k = ranges.size();
+    int maxRanges = std::max(batchOptions.maxRanges, 1);
+    std::vector<Job> jobs;
+    for (int i = 0; i < k; ) {
+        int j = i;
+        int64_t bytes = 0;
+        while (j < k && j - i < maxRanges) {
+            int64_t len = ranges[j].to - ranges[j].from + 1;
+            if (j > i && bytes + len > maxBytes)
+                break;
+            bytes += len;
+            j++;
         }
+        jobs.push_back(Job{i, j - i, 0});
+        i = j;
     }
-
-    TdmSyncAssertF(httpCode == 0 || httpCode / 100 == 2, "Downloading missing parts failed: http response %d", (int)httpCode);
-    TdmSyncAssertF(retCode == CURLE_OK, "Downloading missing parts failed: curl error %d", retCode);
-    TdmSyncAssertF(mainWorkRange.written == mainWorkRange.end - mainWorkRange.start,
-        "Size of output file is wrong: %" PRId64 " instead of %" PRId64,
-        mainWorkRange.written, mainWorkRange.end - mainWorkRange.start
-    );
+    batchesNum = jobs.size();
+    performMany(jobs);
+
+    bool anyMultipart = false;
+    for (const Job &job : jobs)
+        anyMultipart |= (job.rangesNum > 1);
+    if (k == 1)
+        usedMode = dmSingleByterange;
+    else if (anyMultipart && fallbacksNum == 0)
+        usedMode = dmMultipartByterange;
+    else
+        usedMode = dmManyByteranges;
 }
 
 //=======================================================================
-//      performSingle: download one byte range
-//                     superseeded by performMany
+//      singleWriteCallback: data of single-range response
+//                     written right after the data received before it
 //=======================================================================
 
-#if 0
-int CurlDownloader::performSingle() {
-    auto header_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        return ((CurlDownloader*)userdata)->headerWriteCallback(ptr, size, nmemb);
-    };
-    auto single_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        return ((CurlDownloader*)userdata)->singleWriteCallback(ptr, size, nmemb, NULL);
-    };
-    std::unique_ptr<CURL, void (*)(CURL*)> curl(curl_easy_init(), curl_easy_cleanup);
-    TdmSyncAssertF(curl, "Failed to initialize curl");
-    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERFUNCTION, (curl_write_callback)header_write_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, (void*)this);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, (curl_write_callback)single_write_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, (void*)this);
-    curl_easy_setopt(curl.get(), CURLOPT_RANGE, rangesString.c_str());
-    int ret = curl_easy_perform(curl.get());
-    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &httpCode);
-    return ret;
-}
-#endif
-size_t CurlDownloader::singleWriteCallback(char *ptr, size_t size, size_t nmemb, WorkRange *work) {
-    if (!work) work = &mainWorkRange;
+size_t CurlDownloader::singleWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb) {
+    WorkRange *work = &req.work;
+    if (req.isHttp && req.httpCode / 100 != 2)
+        return nmemb;               //body of error response (e.g. 503 page) is dropped, request fails by its code
     //with single byte range request, curl returns only/exactly the requested data
-    if (!isHttp || !acceptRanges)
+    if (!req.isHttp || !req.acceptRanges)
         return 0;                   //fail early if accept-ranges clause not present in header
+    int64_t from = ranges[req.firstRange].from;
+    if (req.contentFrom >= 0 ? req.contentFrom != from : from != 0)
+        return 0;                   //data does not start at the requested byte (e.g. whole file is sent)
     size_t bytes = size * nmemb;
     int64_t pos = work->start + work->written;
-    if (pos + bytes > work->end)
+    if (pos + int64_t(bytes) > work->end)
         return 0;                   //protection against webserver sending the whole file to us
     //write data exactly to the proposed position
-    if (downloadFile->tell() != pos)
+    if (int64_t(downloadFile->tell()) != pos)
         downloadFile->seek(pos);
     downloadFile->write(ptr, bytes);
-    //increment written amount for global and possibly local account
+    journal->markWritten(pos, pos + bytes);
     work->written += bytes;
-    if (work != &mainWorkRange)
-        mainWorkRange.written += bytes;
+    receivedBytes += bytes;
     return nmemb;
 }
 
 //=======================================================================
-//        performMany: download many byte ranges as separate requests
-//               note: works slowly unless HTTP2 is present
+//        MultiLease: multi handle taken from session for one call
+//               note: its connections stay open for next requests
 //=======================================================================
 
-int CurlDownloader::performMany() {
-    std::unique_ptr<CURLM, CURLMcode (*)(CURLM*)> curl(curl_multi_init(), curl_multi_cleanup);
-    TdmSyncAssertF(curl, "Failed to initialize curl");
-    curl_multi_setopt(curl.get(), CURLMOPT_PIPELINING, CURLPIPE_HTTP1 | CURLPIPE_MULTIPLEX);
+//multi handle is returned to session (with easy handles removed from it) even if exception is thrown
+class MultiLease {
+public:
+    MultiLease(CurlSession &ses, int maxConnections) : ses(ses), multi(ses.acquireMulti()) {
+        //without limit, every request opens its own connection at once, and none of them is reused
+        //with limit, requests wait in queue and then go over the connections which are already open
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)maxConnections);
+    }
+    ~MultiLease() {
+        for (CURL *handle : added)
+            curl_multi_remove_handle(multi, handle);
+        ses.releaseMulti(multi);
+    }
+    void add(CURL *handle) {
+        curl_multi_add_handle(multi, handle);
+        added.push_back(handle);
+    }
+    void remove(CURL *handle) {
+        curl_multi_remove_handle(multi, handle);
+        added.erase(std::find(added.begin(), added.end(), handle));
+    }
+    //run transfers for a while, returns number of still running ones
+    int perform() {
+        int running = -1, numfds;
+        CURLMcode code = curl_multi_perform(multi, &running);
+        TdmSyncAssertF(code == CURLM_OK, "curl_multi_perform returned %d", code);
+        if (running > 0) {
+            code = curl_multi_wait(multi, NULL, 0, 1000, &numfds);
+            TdmSyncAssertF(code == CURLM_OK, "curl_multi_wait returned %d", code);
+        }
+        return running;
+    }
+    //returns next finished transfer and its result (or null if none)
+    CURL *nextDone(int &result) {
+        int msgsLeft = 0;
+        while (CURLMsg *msg = curl_multi_info_read(multi, &msgsLeft)) {
+            if (msg->msg == CURLMSG_DONE) {
+                result = msg->data.result;
+                return msg->easy_handle;
+            }
+        }
+        return nullptr;
+    }
 
-    struct Handle {
-        CurlDownloader *owner;
-        WorkRange work;
-    };
-    int k = ranges.size();
-    std::vector<Handle> handles(k);
-    auto header_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        Handle *handle = (Handle*)userdata;
-        return handle->owner->headerWriteCallback(ptr, size, nmemb);
-    };
-    auto single_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        Handle *handle = (Handle*)userdata;
-        return handle->owner->singleWriteCallback(ptr, size, nmemb, &handle->work);
-    };
+private:
+    CurlSession &ses;
+    CURLM *multi;
+    std::vector<CURL*> added;
+};
 
-    std::vector<std::unique_ptr<CURL, void (*)(CURL*)>> requests;
-    int64_t filePos = 0;
-    for (int i = 0; i < k; i++) {
-        int64_t from, to, delta;
-        int parsed = sscanf(ranges[i].c_str(), "%" SCNd64 "-%" SCNd64, &from, &to);
-        delta = to - from + 1;
-        TdmSyncAssert(parsed == 2);
-        handles[i].owner = this;
-        WorkRange wr;
-        wr.start = filePos;
-        wr.end = filePos + delta;
-        wr.written = 0;
-        handles[i].work = wr;
-        filePos += delta;
-
-        requests.emplace_back(curl_easy_init(), curl_easy_cleanup);
-        auto curlE = requests[i].get();
-        curl_easy_setopt(curlE, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curlE, CURLOPT_HEADERFUNCTION, (curl_write_callback)header_write_callback);
-        curl_easy_setopt(curlE, CURLOPT_HEADERDATA, &handles[i]);
-        curl_easy_setopt(curlE, CURLOPT_WRITEFUNCTION, (curl_write_callback)single_write_callback);
-        curl_easy_setopt(curlE, CURLOPT_WRITEDATA, &handles[i]);
-        curl_easy_setopt(curlE, CURLOPT_RANGE, ranges[i].c_str());
-        curl_multi_add_handle(curl.get(), curlE);
-
-        /*//for testing only (comment curl_multi_add_handle line too)
-        auto err = curl_easy_perform(curlE);
-        requests[i].reset();*/
+//=======================================================================
+//        TransferWindow: how many transfers run at once
+//               adapted to measured download speed
+//=======================================================================
+
+//starts with all connections, then hill climbing:
+//  size is reduced by one while download does not become slower (extra transfers are useless then),
+//  and increased by one while download becomes noticeably faster; direction is reversed when step did not pay off
+//  when size reaches its bound, it stays there for several periods before probing the other way
+//speed is measured only while window is full, and the first period (opening connections) is skipped
+//note: it never exceeds max number of connections, so memory and sockets are bounded
+class TransferWindow {
+public:
+    TransferWindow(int maxSize) : maxSize(std::max(maxSize, 1)) {
+        size = this->maxSize;
+        periodStart = std::chrono::steady_clock::now();
     }
+    int getSize() const { return size; }
+    double getAverageSize() const { return periodsNum ? double(sizesSum) / periodsNum : size; }
+    void update(int64_t totalBytes, int activeNum) {
+        auto now = std::chrono::steady_clock::now();
+        if (activeNum < size) {
+            //not enough work to fill the window (e.g. last requests): measurement would be wrong
+            periodStart = now;
+            periodBytes = totalBytes;
+            return;
+        }
+        double elapsed = std::chrono::duration<double>(now - periodStart).count();
+        if (elapsed < PeriodSeconds)
+            return;
+        double speed = (totalBytes - periodBytes) / elapsed;
+        periodStart = now;
+        periodBytes = totalBytes;
+        if (warmup) {
+            warmup = false;
+            return;
+        }
+        sizesSum += size;
+        periodsNum++;
+        if (size + direction > maxSize || size + direction < 1) {
+            if (++holdPeriods < HoldPeriods)
+                return;
+            holdPeriods = 0;
+            direction = -direction;
+        }
+        else if (lastSpeed >= 0.0) {
+            bool paidOff = direction < 0 ? speed >= lastSpeed * (1.0 - Tolerance) : speed >= lastSpeed * (1.0 + Tolerance);
+            if (!paidOff)
+                direction = -direction;
+        }
+        lastSpeed = speed;
+        size = std::max(1, std::min(maxSize, size + direction));
+    }
+
+private:
+    static constexpr double PeriodSeconds = 2.0;
+    static constexpr double Tolerance = 0.05;
+    static const int HoldPeriods = 4;
+    int maxSize, size;
+    bool warmup = true;
+    int direction = -1;
+    int holdPeriods = 0;
+    double lastSpeed = -1.0;
+    std::chrono::steady_clock::time_point periodStart;
+    int64_t periodBytes = 0;
+    int64_t sizesSum = 0, periodsNum = 0;
+};
+
+//=======================================================================
+//        performMany: run jobs through a sliding window of transfers
+//               easy handles are recycled, so memory and sockets don't depend on number of ranges
+//               failed multipart job is split into single-range jobs, failed single-range job is retried
+//               from its first missing byte
+//=======================================================================
+
+//move start of range past its part which is written already (e.g. by transfer which broke midway)
+//returns false if the whole range is written
+bool CurlDownloader::skipWritten(int rangeIdx) {
+    Range &rng = ranges[rangeIdx];
+    int64_t done = journal->writtenPrefix(rng.filePos, rng.filePos + (rng.to - rng.from + 1));
+    rng.from += done;
+    rng.filePos += done;
+    return rng.from <= rng.to;
+}
+
+void CurlDownloader::saveJournal() {
+    if (!journal->isPersistent())
+        return;
+    //data must reach download file before journal says that it is written
+    downloadFile->flush();
+    journal->save();
+}
+
+void CurlDownloader::performMany(const std::vector<Job> &jobs) {
+    //journal file is saved this often, so killed process loses only last second of download
+    static const double JournalSavePeriod = 1.0;
+
+    std::deque<Job> queue(jobs.begin(), jobs.end());
+    int maxTransfers = std::max(batchOptions.connectionsNum, 1);
+    TransferWindow window(maxTransfers);
+    auto lastSave = std::chrono::steady_clock::now();
+
+    //one slot per simultaneous transfer, easy handle is created on first use
+    struct Slot {
+        Request req;
+        Job job;
+        std::unique_ptr<CURL, void (*)(CURL*)> handle = {nullptr, curl_easy_cleanup};
+        bool busy = false;
+    };
+    std::vector<Slot> slots(maxTransfers);
+    MultiLease lease(getSession(), maxTransfers);   //note: destroyed before slots
+    int active = 0;
+    receivedBytes = 0;
+    //first request which has failed for good
+    bool failed = false;
+    Request failure;
 
-    int running = -1, numfds, nofdsCnt = 0;
     while (1) {
-        CURLMcode code = curl_multi_perform(curl.get(), &running);
-        TdmSyncAssertF(code == CURLM_OK, "curl_multi_perform returned %d", code);
-        if (running == 0)
+        //start new transfers until window is full
+        for (int s = 0; s < maxTransfers && active < window.getSize() && !queue.empty() && !failed; s++) {
+            Slot &slot = slots[s];
+            if (slot.busy)
+                continue;
+            slot.job = queue.front();
+            queue.pop_front();
+            if (!slot.handle) {
+                slot.handle = createHandle();
+                curl_easy_setopt(slot.handle.get(), CURLOPT_PRIVATE, (void*)&slot);
+            }
+            initRequest(slot.req, slot.job.firstRange, slot.job.rangesNum);
+            setupHandle(slot.handle.get(), slot.req, false);
+            lease.add(slot.handle.get());
+            slot.busy = true;
+            active++;
+        }
+        if (active == 0)
             break;
-        code = curl_multi_wait(curl.get(), NULL, 0, 1000, &numfds);
-        TdmSyncAssertF(code == CURLM_OK, "curl_multi_wait returned %d", code);
+
+        lease.perform();
+        window.update(receivedBytes, active);
+
+        int result;
+        while (CURL *handle = lease.nextDone(result)) {
+            Slot *slot = nullptr;
+            curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char**)&slot);
+            lease.remove(handle);
+            getSession().noteTransfer(handle);
+            slot->busy = false;
+            active--;
+
+            Request &req = slot->req;
+            req.retCode = result;
+            curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &req.httpCode);
+            if (req.succeeded())
+                continue;
+
+            if (req.rangesNum > 1) {
+                //multi-ranges may be not supported or rejected (too many ranges / too long header)
+                //send single-range requests instead, but only for the ranges of this batch (and their missing parts)
+                for (int i = req.firstRange; i < req.firstRange + req.rangesNum; i++)
+                    if (skipWritten(i)) {
+                        queue.push_back(Job{i, 1, 0});
+                        fallbacksNum++;
+                    }
+            }
+            else if (!skipWritten(req.firstRange))
+                continue;       //all data has arrived, although transfer failed after that
+            else if (req.retryable() && slot->job.attempt < batchOptions.retriesNum) {
+                //range starts from its first missing byte now
+                Job job = slot->job;
+                job.attempt++;
+                queue.push_back(job);
+                retriesNum++;
+            }
+            else if (!failed) {
+                //don't start anything new, wait for running transfers and report error
+                failed = true;
+                failure.httpCode = req.httpCode;
+                failure.retCode = req.retCode;
+                failure.work = req.work;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - lastSave).count() >= JournalSavePeriod) {
+            saveJournal();
+            lastSave = now;
+        }
     }
 
-    return CURLE_OK;
+    //note: on failure, journal keeps everything that has arrived, so that next run continues from there
+    saveJournal();
+    averageTransfersNum = window.getAverageSize();
+    if (failed) {
+        TdmSyncAssertF(failure.httpCode == 0 || failure.httpCode / 100 == 2, "Downloading missing parts failed: http response %d", (int)failure.httpCode);
+        TdmSyncAssertF(failure.retCode == CURLE_OK, "Downloading missing parts failed: curl error %d", failure.retCode);
+        TdmSyncAssertF(false, "Size of downloaded range is wrong: %" PRId64 " instead of %" PRId64,
+            failure.work.written, failure.work.expected
+        );
+    }
 }
 
 //=======================================================================
-//       performMulti: download all byte ranges with one request
-//               note: needs multipart byteranges to be supported
+//       performTransfers: run all requests at once on a multi handle of session
 //=======================================================================
 
-int CurlDownloader::performMulti() {
-    std::unique_ptr<CURL, void (*)(CURL*)> curl(curl_easy_init(), curl_easy_cleanup);
-    TdmSyncAssertF(curl, "Failed to initialize curl");
-    bufferData.assign(BufferSize + 16, 0);
-
-    auto header_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        return ((CurlDownloader*)userdata)->headerWriteCallback(ptr, size, nmemb);
-    };
-    auto multi_write_callback = [](char *ptr, size_t size, size_t nmemb, void *userdata) -> size_t {
-        return ((CurlDownloader*)userdata)->multiWriteCallback(ptr, size, nmemb);
-    };
-    curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERFUNCTION, (curl_write_callback)header_write_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, (void*)this);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, (curl_write_callback)multi_write_callback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, (void*)this);
-    curl_easy_setopt(curl.get(), CURLOPT_RANGE, rangesString.c_str());
-
-    int retCode = curl_easy_perform(curl.get());
-    processBuffer(true);    //flush our own buffer
-    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &httpCode);
-    return retCode;
-}
-size_t CurlDownloader::multiWriteCallback(char *ptr, size_t size, size_t nmemb) {
-    //with multiple byte range request, curl returns data segments separated by some http headers
-    //this is how curl multipart response looks like (without indents):
-    /*================================================================
-
-    --5b69c45c39b6
-    Content-type: text/plain
-    Content-range: bytes 100-200/5896303
-    
-    s8d7f8767fds765fg8765sdf87g65g87s65d8f765sd87f6g58s7d6f587s6d5f87s65df76s8df7g68s7df6g876sdf8g76g7677
-    --5b69c45c39b6
-    Content-type: text/plain
-    Content-range: bytes 300-400/5896303
-    
-    87hdf98j5fg785jfg675j8f76ghj8675gh6j75fg87g5j8d7f6g587s65g87d6g5f8h67d5gf75d8fg675h8d6f7g5h6d75gf7865
-    --5b69c45c39b6--
-    ================================================================*/
-
-    if (!isHttp || !acceptRanges || boundary.empty())
-        return 0;                   //fail early if no boundary was specified in response header
-    size_t bytes = size * nmemb;
-    while (bytes > 0) {
-        //push incoming data from curl into our internal buffer
-        int added = std::min(BufferSize - bufferAvail, (int)bytes);
-        memcpy(bufferData.data() + bufferAvail, ptr, added);
-        ptr += added;
-        bytes -= added;
-        bufferAvail += added;
-        if (bufferAvail == BufferSize)
-            if (!processBuffer(false))
-                return 0;
+std::vector<int> CurlDownloader::performTransfers(const std::vector<CURL*> &handles) {
+    MultiLease lease(getSession(), std::max(batchOptions.connectionsNum, 1));
+    for (size_t i = 0; i < handles.size(); i++) {
+        curl_easy_setopt(handles[i], CURLOPT_PRIVATE, (void*)(intptr_t)i);
+        lease.add(handles[i]);
     }
-    return nmemb;
+    while (lease.perform() > 0) {}
+
+    //result of every transfer (-1 if it has not finished somehow)
+    std::vector<int> results(handles.size(), -1);
+    int result;
+    while (CURL *handle = lease.nextDone(result)) {
+        char *index = nullptr;
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, &index);
+        results[(intptr_t)index] = result;
+    }
+    for (CURL *handle : handles)
+        getSession().noteTransfer(handle);
+    return results;
 }
-bool CurlDownloader::processBuffer(bool flush) {
-    //when this method is called, the following invariant holds:
-    //  1. the start of the buffer is inside some segment's data (i.e. NOT inside the http header/boundary)
-    //  2. one of the following is true:
-    //     a. the buffer is full
-    //     b. the buffer contains the very last bytes of the response, and flush = true
 
-    bufferData[bufferAvail] = 0;    //null-terminate for string routines
+//=======================================================================
+//       multiWriteCallback: parse response to multi-range request
+//               note: needs multipart byteranges to be supported
+//=======================================================================
 
-    //size of transition zone at the end of the buffer
-    //we postpone all boundaries inside transition zone until the next call (except when flush = true)
-    //note: it is critically important that this constant is larger than any potential internal http header!
-    static const int TailSize = 1024;
+size_t CurlDownloader::multiWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb) {
+    //with multiple byte range request, response contains data segments separated by boundaries and headers
+    //see MultipartParser for its format: data of every part is placed according to its Content-Range
+    if (req.isHttp && req.httpCode / 100 != 2)
+        return nmemb;               //body of error response is dropped, request fails by its code
+    if (!req.isHttp || !req.acceptRanges)
+        return 0;
+    if (!req.parser.isStarted()) {
+        if (!req.boundary.empty())
+            req.parser.startMultipart(req.boundary);
+        else if (req.contentFrom >= 0)
+            req.parser.startSinglePart(req.contentFrom, req.contentTo);   //server merged all ranges into one
+        else
+            return 0;               //fail early if server sends the whole file
+    }
+    auto sink = [this, &req](int64_t offset, const char *data, size_t size) -> bool {
+        return writeRemote(req, offset, data, size);
+    };
+    if (!req.parser.feed(ptr, size * nmemb, sink))
+        return 0;
+    return nmemb;
+}
 
-    int pos = 0;
-    while (1) {
-        int end = flush ? bufferAvail - boundary.size() : bufferAvail - TailSize;
-        if (end < pos)
-            break;      //last http header ended inside transition zone already
-        int delim = findBoundary(bufferData.data(), pos, end);
-        int until = delim == -1 ? end : delim;
-        //write the data from current position to the next found boundary or to start of transition zone
-        singleWriteCallback(&bufferData[pos], 1, until - pos, NULL);
-        pos = until;
-        if (delim == -1)
-            break;      //no more boundaries in the buffer
-
-        //handle http boundary
-        pos += boundary.size();
-        if (strncmp(&bufferData[pos], "--", 2) == 0) {
-            //this is the final boundary in the response
-            if (!flush)
-                return false;   //premature "end of response"
-            break;    //end of response
+bool CurlDownloader::writeRemote(Request &req, int64_t offset, const char *data, size_t size) {
+    //ranges of request are sorted by remote offset
+    const Range *begin = ranges.data() + req.firstRange;
+    const Range *end = begin + req.rangesNum;
+    while (size > 0) {
+        //find the last range starting at or before offset
+        const Range *next = std::upper_bound(begin, end, offset, [](int64_t off, const Range &rng) -> bool {
+            return off < rng.from;
+        });
+        int64_t chunk;
+        if (next != begin && offset <= (next - 1)->to) {
+            //write data exactly to the proposed position
+            const Range &rng = *(next - 1);
+            chunk = std::min(int64_t(size), rng.to - offset + 1);
+            int64_t pos = rng.filePos + (offset - rng.from);
+            if (int64_t(downloadFile->tell()) != pos)
+                downloadFile->seek(pos);
+            downloadFile->write(data, chunk);
+            journal->markWritten(pos, pos + chunk);
+            req.work.written += chunk;
+            receivedBytes += chunk;
         }
-        //handle http header (skip it)
-        char *ptr = strstr(&bufferData[pos], "\r\n\r\n");
-        if (ptr == 0)
-            return false;   //internal header must fit into TailSize bytes
-        pos = ptr + 4 - bufferData.data();
+        else {
+            //data between requested ranges (server may merge close ranges): skip it
+            if (next == end)
+                return true;
+            chunk = std::min(int64_t(size), next->from - offset);
+        }
+        data += chunk;
+        size -= chunk;
+        offset += chunk;
     }
-
-    //copy the remaining bytes to the beginning of buffer
-    //usually, this is the transition zone or a part of it
-    memmove(&bufferData[0], &bufferData[pos], bufferAvail - pos);
-    bufferAvail -= pos;
-
     return true;
 }
-int CurlDownloader::findBoundary(const char *ptr, int from, int to) const {
-    for (int i = from; i < to; i++)
-        if (ptr[i + 4] == boundary[4])  //first char of boundary after two hyphens
-            if (memcmp(ptr + i, boundary.data(), boundary.size()) == 0)
-                return i;
-    return -1;
-}
 
 }
@@ -2,7 +2,13 @@
 #define _TDM_SYNC_CURL_H_328817_
 
 #include "tdmsync.h"
+#include "multipart.h"
+#include "downloadjournal.h"
 #include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 #include <curl/curl.h>
 
@@ -14,47 +20,155 @@ struct HttpError : public BaseError {
     HttpError(const char *message, int code) : BaseError(message + std::to_string(code)), code(code) {}
 };
 
+//long-lived state shared by many downloads: open connections, DNS cache and TLS sessions
+//pass one session to all CurlDownloader-s, then their requests reuse already open connections
+//instead of paying TCP (and TLS) handshake for every request and every file
+//note: session can be used by downloaders in different threads simultaneously
+class CurlSession {
+public:
+    CurlSession();
+    ~CurlSession();
+    CurlSession(const CurlSession &) = delete;
+    CurlSession &operator=(const CurlSession &) = delete;
+
+    //make easy handle use DNS cache and TLS sessions of this session (via CURLSH)
+    void attach(CURL *handle);
+    //take multi handle for exclusive use, and return it after all its transfers are finished
+    //every multi handle keeps its connections open, so the next transfers on it reuse them
+    //note: curl does not support sharing connection cache between threads (CURL_LOCK_DATA_CONNECT),
+    //  so every thread takes a whole multi handle together with its connections instead
+    CURLM *acquireMulti();
+    void releaseMulti(CURLM *multi);
+    //account finished transfer of easy handle in statistics
+    void noteTransfer(CURL *handle);
+
+    //stats: number of HTTP requests done / number of new connections opened for them
+    int64_t getRequestsNum() const { return requestsNum; }
+    int64_t getConnectsNum() const { return connectsNum; }
+
+private:
+    CURLSH *share = nullptr;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+    std::mutex multisMutex;
+    std::vector<CURLM*> allMultis, idleMultis;
+    std::atomic<int64_t> requestsNum, connectsNum;
+};
+
 //implements tdmsync differential update over HTTP 1.1 protocol (using curl)
 class CurlDownloader {
 public:
+    //session --- connections of this session are reused by all calls
+    //if it is null, then downloader creates session of its own (so its consecutive calls still reuse connections)
+    CurlDownloader(CurlSession *session = nullptr) : session(session) {}
+
+    //how byte ranges are split into requests
+    //servers limit length of Range header / number of ranges in it (then they send whole file or 416 error),
+    //and one TCP connection cannot fill a link with high bandwidth-delay product
+    struct BatchOptions {
+        int maxRanges = 200;            //max number of byte ranges in one multipart request
+        int64_t maxBytes = 1 << 20;     //max number of bytes in one request (larger ranges are split too)
+        int connectionsNum = 8;         //max number of simultaneous connections to the server
+        int retriesNum = 2;             //how many times failed single-range request is repeated (e.g. on 5xx or broken connection)
+    };
+    void setBatchOptions(const BatchOptions &options) { batchOptions = options; }
+    const BatchOptions &getBatchOptions() const { return batchOptions; }
+
     //download the metainfo file from specified url into specified file
     //you can then deserialize it and create an update plan for local file using it
     void downloadMeta(BaseFile &wrDownloadFile, const char *url);
 
     //download into specified file all the remote segments of the specified update plan from the specified url
     //this invokes multi-byte-range HTTP requests which needs proper web server support
-    void downloadMissingParts(BaseFile &wrDownloadFile, const UpdatePlan &plan, const char *url);
+    //journal --- progress of download (started for this plan, see DownloadJournal::start), optional:
+    //  parts which are written already are not downloaded, and journal file is saved every second and on failure
+    //  (then download file must support writing at any position without truncating, e.g. StdioFile opened as ReadWrite)
+    //note: range transfer which broke midway is retried from its first missing byte (with or without journal)
+    void downloadMissingParts(BaseFile &wrDownloadFile, const UpdatePlan &plan, const char *url, DownloadJournal *journal = nullptr);
 
     enum DownloadMode {
         dmUnknown,              //not yet done anything =)
         dmNone,                 //nothing to download: file already correct
         dmSingleByterange,      //only one chunk was downloaded (using byterange request)
-        dmMultipartByterange,   //used multipart byteranges request to download all chunks
-        dmManyByteranges,       //had to fallback to many requests with single byterange in each
+        dmMultipartByterange,   //used multipart byteranges requests to download all chunks
+        dmManyByteranges,       //had to fallback to many requests with single byterange in each (at least for some chunks)
     };
     //call after the request to learn which download mode was used
     //usually used for status/logging
     DownloadMode getModeUsed() const { return usedMode; }
+    //number of requests for missing parts: multipart batches, single-range fallbacks and retries
+    int getBatchesNum() const { return batchesNum; }
+    int getFallbacksNum() const { return fallbacksNum; }
+    int getRetriesNum() const { return retriesNum; }
+    //average number of simultaneous transfers (adapted to measured speed, up to connectionsNum)
+    double getAverageTransfersNum() const { return averageTransfersNum; }
 
 private:
-    struct WorkRange;
+    //how much bytes we have written to file
+    struct WorkRange {
+        int64_t start = 0, end = 0;
+        int64_t written = 0;
+        //total size of requested ranges (less than end - start if journal has cut out parts written already)
+        int64_t expected = 0;
+    };
+    //one byte range of remote file and where it goes in download file
+    struct Range {
+        int64_t from, to;       //inclusive, as in HTTP
+        int64_t filePos;
+    };
+    //state of one HTTP request
+    struct Request {
+        CurlDownloader *owner = nullptr;
+        //requested ranges: [firstRange, firstRange + rangesNum)
+        int firstRange = 0, rangesNum = 0;
+        std::string rangesString;
+        //part of download file filled by this request
+        WorkRange work;
+
+        //intermediate data: header / boundary / content range of HTTP response
+        std::string header, boundary;
+        int64_t contentFrom = -1, contentTo = -1;
+        bool isHttp = false, acceptRanges = false;
+        long httpCode = 0;
+        int retCode = -1;
+
+        //only for multi-range requests
+        MultipartParser parser;
+
+        bool succeeded() const;
+        bool retryable() const;
+    };
+    //queued request: which ranges to download and how many times it has failed already
+    struct Job {
+        int firstRange, rangesNum;
+        int attempt;
+    };
 
     void clear();
+    CurlSession &getSession();
+    void initRequest(Request &req, int firstRange, int rangesNum);
+    std::unique_ptr<CURL, void (*)(CURL*)> createHandle();
+    void setupHandle(CURL *handle, Request &req, bool meta);
 
-    size_t headerWriteCallback(char *ptr, size_t size, size_t nmemb);
-    size_t plainWriteCallback(char *ptr, size_t size, size_t nmemb);
+    size_t headerWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb);
+    size_t plainWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb);
 
-    int performSingle();
-    size_t singleWriteCallback(char *ptr, size_t size, size_t nmemb, WorkRange *work);
+    size_t singleWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb);
 
-    int performMulti();
-    size_t multiWriteCallback(char *ptr, size_t size, size_t nmemb);
-    bool processBuffer(bool flush);
-    int findBoundary(const char *ptr, int from, int to) const;
+    size_t multiWriteCallback(Request &req, char *ptr, size_t size, size_t nmemb);
+    bool writeRemote(Request &req, int64_t offset, const char *data, size_t size);
 
-    int performMany();
+    bool skipWritten(int rangeIdx);
+    void saveJournal();
+    void performMany(const std::vector<Job> &jobs);
+
+    std::vector<int> performTransfers(const std::vector<CURL*> &handles);
 
 private:
+    //connections are taken from here
+    CurlSession *session = nullptr;
+    std::unique_ptr<CurlSession> ownSession;
+    BatchOptions batchOptions;
+
     //input data from user
     BaseFile *downloadFile = nullptr;
     const UpdatePlan *plan = nullptr;
@@ -62,28 +176,15 @@ private:
 
     //byte ranges we have to download
     int64_t totalCount = 0, totalSize = 0;
-    std::vector<std::string> ranges;
-    std::string rangesString;
-
-    //intermediate data: header / boundary of HTTP response
-    std::string header, boundary;
-    bool isHttp = false, acceptRanges = false;
+    std::vector<Range> ranges;
+    //which parts of download file are written (journal from user or our own one)
+    DownloadJournal *journal = nullptr;
+    DownloadJournal ownJournal;
     DownloadMode usedMode = dmUnknown;
-    long httpCode = 0;
-
-    //how much bytes we have written to file
-    struct WorkRange {
-        int64_t start = 0, end = 0;
-        int64_t written = 0;
-    };
-    WorkRange mainWorkRange;
-
-    //intermediate data: only for "performMulti"
-    static const int BufferSize = 16 << 10;
-    std::vector<char> bufferData;
-    int bufferAvail = 0;
+    int batchesNum = 0, fallbacksNum = 0, retriesNum = 0;
+    double averageTransfersNum = 0.0;
+    int64_t receivedBytes = 0;
 };
-
 }
 
 #endif
@@ -0,0 +1,249 @@
+#include "tdmsync_many.h"
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+
+#include "tsassert.h"
+#include "threads.h"
+#ifdef WITH_CURL
+    #include "tdmsync_curl.h"
+#endif
+#undef min
+#undef max
+
+
+namespace TdmSync {
+
+static double getTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool isUrl(const std::string &source) {
+    return source.find("://") != std::string::npos;
+}
+
+//approximate memory needed to keep metainfo and create update plan with it
+static int64_t estimatePlanMemory(const FileInfo &info) {
+    //blocks, checksum index, offset order and other per-block arrays of the scan
+    int64_t perBlock = sizeof(BlockInfo) + 48;
+    //batch buffer of local file and rolling checksums of its windows
+    int64_t buffers = (int64_t(8) << 20) + 2 * info.blockSize;
+    return int64_t(info.blocks.size()) * perBlock + buffers;
+}
+
+//shared state of updateMany
+struct ManyContext {
+    const std::vector<SyncItem> &items;
+    const SyncManyOptions &options;
+    ThreadPool pool;
+    ResourceBudget memory, connections;
+#ifdef WITH_CURL
+    //all downloads reuse connections of this session
+    CurlSession curlSession;
+#endif
+    //current state of every file in the pipeline
+    std::vector<UpdatePlan> plans;
+    std::vector<SyncItemStats> stats;
+
+    ManyContext(const std::vector<SyncItem> &items, const SyncManyOptions &options)
+        : items(items), options(options), pool(options.threadsNum)
+        , memory(std::max(options.memoryBudget, int64_t(1))), connections(std::max(options.connectionsNum, 1))
+        , plans(items.size()), stats(items.size())
+    {}
+
+    //run stage of file with specified index, catching errors
+    template<class Stage> void runStage(size_t idx, double SyncItemStats::*timer, Stage stage) {
+        double starttime = getTime();
+        try {
+            stage();
+        }
+        catch(const std::exception &e) {
+            stats[idx].error = e.what();
+        }
+        stats[idx].*timer += getTime() - starttime;
+    }
+
+    void stagePlan(size_t idx);
+    void downloadRemote(size_t idx, BaseFile &wrDownloadFile);
+    void stageDownload(size_t idx);
+    void stageApply(size_t idx);
+};
+
+//local file being updated, or empty file if it does not exist yet
+static std::unique_ptr<BaseFile> openLocalFile(const std::string &filename) {
+    if (FILE *f = fopen(filename.c_str(), "rb")) {
+        fclose(f);
+        std::unique_ptr<StdioFile> file(new StdioFile());
+        file->open(filename.c_str(), StdioFile::Read);
+        return std::unique_ptr<BaseFile>(std::move(file));
+    }
+    return std::unique_ptr<BaseFile>(new MemoryFile());
+}
+
+void ManyContext::stagePlan(size_t idx) {
+    const SyncItem &item = items[idx];
+    SyncItemStats &st = stats[idx];
+
+    FileInfo info;
+    runStage(idx, &SyncItemStats::timeMeta, [&]() {
+        std::string metaUri = item.source + ".tdmsync";
+        MemoryFile metaFile;
+        if (isUrl(item.source)) {
+        #ifdef WITH_CURL
+            int64_t conn = connections.acquire(1);
+            try {
+                CurlDownloader curlWrapper(&curlSession);
+                curlWrapper.downloadMeta(metaFile, metaUri.c_str());
+            }
+            catch(...) {
+                connections.release(conn);
+                throw;
+            }
+            connections.release(conn);
+            metaFile.seek(0);
+        #else
+            TdmSyncAssertF(false, "Cannot download %s: built without curl", metaUri.c_str());
+        #endif
+        }
+        else {
+            StdioFile file;
+            file.open(metaUri.c_str(), StdioFile::Read);
+            metaFile.contents.resize(file.getSize());
+            if (!metaFile.contents.empty())
+                file.read(metaFile.contents.data(), metaFile.contents.size());
+        }
+        st.bytesMeta = metaFile.getSize();
+        info.deserialize(metaFile);
+    });
+    if (!st.error.empty())
+        return;
+
+    runStage(idx, &SyncItemStats::timePlan, [&]() {
+        int64_t mem = memory.acquire(estimatePlanMemory(info));
+        try {
+            std::unique_ptr<BaseFile> localFile = openLocalFile(item.local);
+            //note: files are processed in parallel, so every plan is created by single thread
+            plans[idx] = info.createUpdatePlan(*localFile, 1, options.lookup, options.scanMode);
+            if (options.coalesce)
+                plans[idx].coalesceRemote(options.rangeCost);
+            info = FileInfo();
+        }
+        catch(...) {
+            memory.release(mem);
+            throw;
+        }
+        memory.release(mem);
+        st.bytesLocal = plans[idx].bytesLocal;
+        st.bytesRemote = plans[idx].bytesRemote;
+    });
+    if (!st.error.empty())
+        return;
+
+    pool.submit([this, idx]() { stageDownload(idx); });
+}
+
+//write remote segments of the plan into specified file
+void ManyContext::downloadRemote(size_t idx, BaseFile &wrDownloadFile) {
+    const SyncItem &item = items[idx];
+    if (isUrl(item.source)) {
+    #ifdef WITH_CURL
+        int64_t conn = connections.acquire(1);
+        try {
+            CurlDownloader curlWrapper(&curlSession);
+            curlWrapper.downloadMissingParts(wrDownloadFile, plans[idx], item.source.c_str());
+        }
+        catch(...) {
+            connections.release(conn);
+            throw;
+        }
+        connections.release(conn);
+    #else
+        TdmSyncAssertF(false, "Cannot download %s: built without curl", item.source.c_str());
+    #endif
+    }
+    else {
+        StdioFile remoteFile;
+        remoteFile.open(item.source.c_str(), StdioFile::Read);
+        plans[idx].createDownloadFile(remoteFile, wrDownloadFile);
+    }
+}
+
+void ManyContext::stageDownload(size_t idx) {
+    const SyncItem &item = items[idx];
+    if (options.streaming) {
+        runStage(idx, &SyncItemStats::timeDownload, [&]() {
+            std::string resultFn = item.local + ".updated";
+            std::unique_ptr<BaseFile> localFile = openLocalFile(item.local);
+            StdioFile resultFile;
+            resultFile.open(resultFn.c_str(), StdioFile::Write);
+            std::vector<BaseFile*> localFiles(1, localFile.get());
+            plans[idx].applyStreaming(localFiles, resultFile, [&](BaseFile &sink) {
+                downloadRemote(idx, sink);
+            });
+            resultFile.flush();
+            plans[idx] = UpdatePlan();
+            stats[idx].ok = true;
+        });
+        return;
+    }
+
+    runStage(idx, &SyncItemStats::timeDownload, [&]() {
+        std::string downFn = item.local + ".download";
+        StdioFile downloadFile;
+        downloadFile.open(downFn.c_str(), StdioFile::Write);
+        downloadRemote(idx, downloadFile);
+        downloadFile.flush();
+    });
+    if (!stats[idx].error.empty())
+        return;
+
+    pool.submit([this, idx]() { stageApply(idx); });
+}
+
+void ManyContext::stageApply(size_t idx) {
+    const SyncItem &item = items[idx];
+    runStage(idx, &SyncItemStats::timeApply, [&]() {
+        std::string downFn = item.local + ".download";
+        std::string resultFn = item.local + ".updated";
+        std::unique_ptr<BaseFile> localFile = openLocalFile(item.local);
+        StdioFile downloadFile;
+        downloadFile.open(downFn.c_str(), StdioFile::Read);
+        StdioFile resultFile;
+        resultFile.open(resultFn.c_str(), StdioFile::Write);
+        plans[idx].apply(*localFile, downloadFile, resultFile);
+        resultFile.flush();
+        plans[idx] = UpdatePlan();
+        stats[idx].ok = true;
+    });
+}
+
+SyncManyStats updateMany(const std::vector<SyncItem> &items, const SyncManyOptions &options) {
+    double starttime = getTime();
+    ManyContext ctx(items, options);
+    for (size_t i = 0; i < items.size(); i++)
+        ctx.pool.submit([&ctx, i]() { ctx.stagePlan(i); });
+    ctx.pool.wait();
+
+    SyncManyStats res;
+    res.items = std::move(ctx.stats);
+    res.total.ok = true;
+    for (const auto &st : res.items) {
+        res.total.ok &= st.ok;
+        res.failedNum += !st.ok;
+        res.total.bytesMeta += st.bytesMeta;
+        res.total.bytesLocal += st.bytesLocal;
+        res.total.bytesRemote += st.bytesRemote;
+        res.total.timeMeta += st.timeMeta;
+        res.total.timePlan += st.timePlan;
+        res.total.timeDownload += st.timeDownload;
+        res.total.timeApply += st.timeApply;
+    }
+#ifdef WITH_CURL
+    res.httpRequests = ctx.curlSession.getRequestsNum();
+    res.httpConnects = ctx.curlSession.getConnectsNum();
+#endif
+    res.wallTime = getTime() - starttime;
+    return res;
+}
+
+}
@@ -0,0 +1,76 @@
+#ifndef _TDM_SYNC_MANY_H_740215_
+#define _TDM_SYNC_MANY_H_740215_
+
+#include "tdmsync.h"
+#include <string>
+
+namespace TdmSync {
+
+//one file to be updated by updateMany
+struct SyncItem {
+    //remote file: URL (if it contains "://") or path to a file on same machine
+    //its metainfo must be available at source + ".tdmsync"
+    std::string source;
+    //local file to be updated (it may be absent, then everything is downloaded)
+    //updated version is written to local + ".updated", downloaded data to local + ".download" (unless streaming)
+    std::string local;
+};
+
+//statistics of updating one file
+struct SyncItemStats {
+    //false if update failed, "error" contains the message then
+    bool ok = false;
+    std::string error;
+    //size of metainfo, how many bytes are taken from local file / downloaded from remote file
+    int64_t bytesMeta = 0;
+    int64_t bytesLocal = 0;
+    int64_t bytesRemote = 0;
+    //time spent in each stage of the pipeline (in seconds)
+    //note: time of waiting for memory or connections is included
+    double timeMeta = 0.0;
+    double timePlan = 0.0;
+    double timeDownload = 0.0;
+    double timeApply = 0.0;
+};
+
+//statistics of the whole updateMany call
+struct SyncManyStats {
+    //per-file stats (in same order as items)
+    std::vector<SyncItemStats> items;
+    //sums over all files
+    SyncItemStats total;
+    int failedNum = 0;
+    //number of HTTP requests sent / new connections opened for them (all files share connections)
+    int64_t httpRequests = 0;
+    int64_t httpConnects = 0;
+    //real time of the whole update (in seconds)
+    double wallTime = 0.0;
+};
+
+struct SyncManyOptions {
+    //number of workers in the shared pool (nonpositive = all hardware threads)
+    int threadsNum = 0;
+    //max number of simultaneous HTTP requests
+    int connectionsNum = 4;
+    //approximate limit on memory used by metainfo and scanning of files being processed at once (in bytes)
+    int64_t memoryBudget = int64_t(1) << 30;
+    ChecksumLookup lookup = clAuto;
+    ScanMode scanMode = smExhaustive;
+    //if true, then downloaded data is written straight into updated file (see UpdatePlan::applyStreaming)
+    //download and apply stages are merged then (all time goes to SyncItemStats::timeDownload)
+    bool streaming = false;
+    //if true, then remote segments of every plan are merged with this cost model (see UpdatePlan::coalesceRemote)
+    bool coalesce = false;
+    RangeCostModel rangeCost;
+};
+
+//update many files at once
+//every file goes through stages: get metainfo -> create plan -> download remote parts -> apply plan
+//stages of all files run as tasks on one work-stealing thread pool, so e.g. one file is downloaded while
+//  another one is scanned; every plan is created by single thread, files are processed in parallel instead
+//failure of one file does not stop others: it is reported in its stats
+SyncManyStats updateMany(const std::vector<SyncItem> &items, const SyncManyOptions &options = SyncManyOptions());
+
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include "threads.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
+
+namespace TdmSync {
+
+int resolveThreadsNum(int threadsNum) {
+    if (threadsNum > 0)
+        return threadsNum;
+    int hw = std::thread::hardware_concurrency();
+    return std::max(hw, 1);
+}
+
+void parallelFor(int threadsNum, size_t count, const std::function<void(size_t)> &body) {
+    size_t workers = std::min(size_t(std::max(threadsNum, 1)), count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++)
+            body(i);
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    std::exception_ptr error;
+    auto workerFunc = [&]() {
+        while (1) {
+            size_t i = next++;
+            if (i >= count)
+                break;
+            try {
+                body(i);
+            }
+            catch(...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;   //stop taking new work
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < workers; t++)
+        threads.emplace_back(workerFunc);
+    workerFunc();
+    for (auto &thr : threads)
+        thr.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+//===========================================================================
+
+//index of worker in the pool which runs current thread (-1 if it is not a worker)
+static thread_local const ThreadPool *currentPool = nullptr;
+static thread_local int currentWorker = -1;
+
+ThreadPool::ThreadPool(int threadsNum) {
+    threadsNum = resolveThreadsNum(threadsNum);
+    queues.resize(threadsNum);
+    for (int i = 0; i < threadsNum; i++)
+        workers.emplace_back(&ThreadPool::workerFunc, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    hasWork.notify_all();
+    for (auto &thr : workers)
+        thr.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t idx;
+        if (currentPool == this)
+            idx = currentWorker;
+        else
+            idx = (nextQueue++) % queues.size();
+        queues[idx].push_back(std::move(task));
+        pending++;
+    }
+    hasWork.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    allDone.wait(lock, [this]() { return pending == 0; });
+}
+
+bool ThreadPool::takeTask(int idx, std::function<void()> &task) {
+    //own queue: newest task first
+    if (!queues[idx].empty()) {
+        task = std::move(queues[idx].back());
+        queues[idx].pop_back();
+        return true;
+    }
+    //steal the oldest task from another queue
+    for (size_t k = 1; k < queues.size(); k++) {
+        auto &victim = queues[(idx + k) % queues.size()];
+        if (!victim.empty()) {
+            task = std::move(victim.front());
+            victim.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::workerFunc(int idx) {
+    currentPool = this;
+    currentWorker = idx;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (1) {
+        std::function<void()> task;
+        hasWork.wait(lock, [&]() { return stopping || takeTask(idx, task); });
+        if (!task)
+            break;
+        lock.unlock();
+        task();
+        task = nullptr;     //destroy captured state outside of lock
+        lock.lock();
+        if (--pending == 0)
+            allDone.notify_all();
+    }
+}
+
+//===========================================================================
+
+int64_t ResourceBudget::acquire(int64_t amount) {
+    amount = std::min(std::max(amount, int64_t(0)), total);
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [&]() { return avail >= amount; });
+    avail -= amount;
+    return amount;
+}
+
+void ResourceBudget::release(int64_t amount) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        avail += amount;
+    }
+    released.notify_all();
+}
+
+}
@@ -0,0 +1,103 @@
+#ifndef _TDM_SYNC_THREADS_H_571302_
+#define _TDM_SYNC_THREADS_H_571302_
+
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace TdmSync {
+
+//returns number of threads to use when user specified "threadsNum"
+//(nonpositive value means "use all hardware threads")
+int resolveThreadsNum(int threadsNum);
+
+//calls body(i) for every i in [0, count) using up to threadsNum threads
+//work is distributed dynamically, the calling thread participates too
+//if any call throws exception, then the first such exception is rethrown after all threads finish
+void parallelFor(int threadsNum, size_t count, const std::function<void(size_t)> &body);
+
+//sorts array using up to threadsNum threads
+//note: the result is the same as with std::sort only if comparator defines total order
+template<class T, class Cmp> void parallelSort(int threadsNum, std::vector<T> &arr, Cmp cmp) {
+    size_t n = arr.size();
+    size_t parts = std::max(threadsNum, 1);
+    if (parts <= 1 || n < 1024 * parts) {
+        std::sort(arr.begin(), arr.end(), cmp);
+        return;
+    }
+    //sort equal pieces independently
+    std::vector<size_t> bounds(parts + 1);
+    for (size_t i = 0; i <= parts; i++)
+        bounds[i] = n * i / parts;
+    parallelFor(threadsNum, parts, [&](size_t i) {
+        std::sort(arr.begin() + bounds[i], arr.begin() + bounds[i+1], cmp);
+    });
+    //merge adjacent sorted pieces pairwise until only one is left
+    for (size_t step = 1; step < parts; step *= 2) {
+        size_t pairs = (parts + 2*step - 1) / (2*step);
+        parallelFor(threadsNum, pairs, [&](size_t k) {
+            size_t l = 2*step*k, m = std::min(l + step, parts), r = std::min(l + 2*step, parts);
+            if (m < r)
+                std::inplace_merge(arr.begin() + bounds[l], arr.begin() + bounds[m], arr.begin() + bounds[r], cmp);
+        });
+    }
+}
+
+//pool of worker threads executing submitted tasks
+//every worker has its own queue: it takes tasks from the back of it (so a task submitted by a task
+//  usually runs next on the same thread), and steals from the front of other queues when it is empty
+//note: exceptions must not escape tasks
+class ThreadPool {
+public:
+    //threadsNum --- number of workers (nonpositive = all hardware threads)
+    explicit ThreadPool(int threadsNum);
+    //waits until all tasks are finished
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    //add task to the pool (can be called from tasks too)
+    void submit(std::function<void()> task);
+    //wait until all tasks are finished (including the ones submitted by tasks)
+    void wait();
+
+    int workersNum() const { return int(workers.size()); }
+
+private:
+    void workerFunc(int idx);
+    bool takeTask(int idx, std::function<void()> &task);
+
+    std::vector<std::thread> workers;
+    std::vector<std::deque<std::function<void()>>> queues;
+    std::mutex mutex;
+    std::condition_variable hasWork, allDone;
+    size_t pending = 0;             //submitted but not finished tasks
+    size_t nextQueue = 0;           //queue for next task submitted from outside
+    bool stopping = false;
+};
+
+//limited amount of some resource shared by tasks (e.g. memory or network connections)
+//works like counting semaphore: acquire blocks until requested amount is available
+class ResourceBudget {
+public:
+    explicit ResourceBudget(int64_t total) : total(total), avail(total) {}
+
+    //note: amount larger than total is reduced to total, so that it can be acquired eventually
+    //returns the amount actually acquired (pass it to release)
+    int64_t acquire(int64_t amount);
+    void release(int64_t amount);
+
+private:
+    int64_t total, avail;
+    std::mutex mutex;
+    std::condition_variable released;
+};
+
+}
+
+#endif
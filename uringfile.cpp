@@ -0,0 +1,573 @@
+#include "uringfile.h"
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include "tsassert.h"
+#include "tdmsync.h"
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        //IORING_OP_READ and IORING_OP_WRITE need headers of Linux 5.6+
+        #ifdef IORING_FEAT_RW_CUR_POS
+            #define TDM_HAS_URING
+        #endif
+    #endif
+#endif
+
+#ifdef TDM_HAS_URING
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+#endif
+
+
+namespace TdmSync {
+
+#ifdef TDM_HAS_URING
+
+//minimal wrapper over io_uring syscalls: submission and completion queues mapped into memory
+struct UringQueue {
+    int fd = -1;
+    unsigned entries = 0;
+    void *sqPtr = MAP_FAILED, *cqPtr = MAP_FAILED;
+    size_t sqLen = 0, cqLen = 0, sqesLen = 0;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqMask = nullptr, *sqArray = nullptr;
+    unsigned *cqHead = nullptr, *cqTail = nullptr, *cqMask = nullptr;
+    io_uring_sqe *sqes = (io_uring_sqe*)MAP_FAILED;
+    io_uring_cqe *cqes = nullptr;
+    //submission entries prepared, but not yet passed to kernel
+    unsigned localTail = 0, toSubmit = 0;
+
+    UringQueue() {}
+    UringQueue(const UringQueue &) = delete;
+    UringQueue &operator=(const UringQueue &) = delete;
+
+    //returns false if io_uring cannot be created
+    bool init(unsigned size) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = (int)syscall(__NR_io_uring_setup, size, &params);
+        if (fd < 0)
+            return false;
+        entries = params.sq_entries;
+        sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqLen = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single)
+            sqLen = cqLen = std::max(sqLen, cqLen);
+        sqPtr = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqPtr == MAP_FAILED)
+            return false;
+        if (single)
+            cqPtr = sqPtr;
+        else {
+            cqPtr = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqPtr == MAP_FAILED)
+                return false;
+        }
+        sqesLen = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(NULL, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+
+        char *sq = (char*)sqPtr, *cq = (char*)cqPtr;
+        sqHead = (unsigned*)(sq + params.sq_off.head);
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + params.sq_off.array);
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        localTail = *sqTail;
+        return true;
+    }
+
+    ~UringQueue() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesLen);
+        if (cqPtr != MAP_FAILED && cqPtr != sqPtr)
+            munmap(cqPtr, cqLen);
+        if (sqPtr != MAP_FAILED)
+            munmap(sqPtr, sqLen);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    //number of submission entries which can be prepared now
+    unsigned freeEntries() const {
+        return entries - (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+    }
+    //returns new zeroed submission entry (caller must ensure that freeEntries() > 0)
+    io_uring_sqe *prepare() {
+        TdmSyncAssert(freeEntries() > 0);
+        unsigned idx = localTail & *sqMask;
+        sqArray[idx] = idx;
+        localTail++;
+        toSubmit++;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    //pass all prepared entries to kernel, optionally waiting for at least one completion
+    void submit(bool wait) {
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        do {
+            unsigned flags = (wait ? IORING_ENTER_GETEVENTS : 0);
+            int res = (int)syscall(__NR_io_uring_enter, fd, toSubmit, wait ? 1 : 0, flags, NULL, 0);
+            if (res < 0) {
+                TdmSyncAssertF(errno == EINTR || errno == EAGAIN || errno == EBUSY, "io_uring_enter failed: %s", strerror(errno));
+                continue;
+            }
+            toSubmit -= std::min(unsigned(res), toSubmit);
+            wait = false;
+        } while (toSubmit > 0);
+    }
+
+    //take next completion if there is any
+    bool peek(io_uring_cqe &cqe) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = cqes[head & *cqMask];
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+struct UringFile::Impl {
+    //size of one read/write request, and number of requests in flight (for reading and writing modes)
+    static const size_t ChunkSize = 1 << 18;
+    static const int ReadDepth = 16;
+    static const int WriteDepth = 16;
+
+    //buffer of one request (or of a linked read+write pair when copying)
+    //note: reads and writes may be short (e.g. on network filesystems), then the rest is submitted again
+    struct Slot {
+        std::vector<uint8_t> buffer;
+        uint64_t offset = 0;        //position in file (for copy: destination)
+        size_t length = 0;
+        int pending = 0;            //operations submitted but not completed
+        int result = 0;             //result of main operation (bytes read/written or -errno)
+        int linkedResult = 0;       //result of read operation of a linked pair
+        bool linked = false;        //whether this is a linked pair (copy)
+        size_t done = 0;            //bytes of main operation completed so far (for copy: written)
+        //copy only: source of data, bytes read from it so far, which operations were submitted last time
+        int srcFd = -1;
+        uint64_t srcOffset = 0;
+        size_t readDone = 0;
+        bool readSubmitted = false, writeSubmitted = false;
+    };
+
+    UringQueue queue;
+    int fd = -1;
+    OpenMode mode = Read;
+    uint64_t pos = 0;
+    uint64_t fileSize = 0;          //(reading mode)
+    std::vector<Slot> slots;
+    std::vector<int> freeSlots;
+    //reading: slots with consecutive chunks starting from current one
+    //writing: slots with submitted writes or copies in order of submission
+    std::deque<int> window;
+    //writing: slot which accumulates written data (not submitted yet), or -1
+    int current = -1;
+
+    //process completions until the slot has no pending operations
+    void waitSlot(int idx) {
+        while (slots[idx].pending > 0) {
+            io_uring_cqe cqe;
+            if (!queue.peek(cqe)) {
+                queue.submit(true);
+                continue;
+            }
+            Slot &slot = slots[cqe.user_data >> 1];
+            if (cqe.user_data & 1)
+                slot.linkedResult = cqe.res;
+            else
+                slot.result = cqe.res;
+            slot.pending--;
+        }
+    }
+
+    //process results of the last operations of the slot, submit the rest of its range if they were short
+    //returns true if something was submitted (then slot must be waited for again)
+    //note: error is negative result, or zero bytes done (all ranges end at or before end of file)
+    bool continueSlot(int idx) {
+        Slot &slot = slots[idx];
+        if (slot.linked) {
+            if (slot.readSubmitted) {
+                TdmSyncAssertF(slot.linkedResult >= 0, "io_uring read for copy to %lld failed: %s", (long long)slot.offset, strerror(-slot.linkedResult));
+                TdmSyncAssertF(slot.linkedResult > 0, "io_uring read for copy from %lld: unexpected end of file", (long long)(slot.srcOffset + slot.readDone));
+                slot.readDone += slot.linkedResult;
+            }
+            //note: if read is short, then kernel cancels the linked write, its data is written separately
+            if (slot.writeSubmitted && !(slot.readSubmitted && slot.result == -ECANCELED)) {
+                TdmSyncAssertF(slot.result >= 0, "io_uring write for copy to %lld failed: %s", (long long)slot.offset, strerror(-slot.result));
+                TdmSyncAssertF(slot.result > 0, "io_uring write for copy to %lld: nothing written", (long long)(slot.offset + slot.done));
+                slot.done += slot.result;
+            }
+            slot.readSubmitted = slot.writeSubmitted = false;
+            slot.result = slot.linkedResult = 0;
+            if (slot.done < slot.readDone) {
+                reserveEntries(1);
+                prepareRw(queue.prepare(), IORING_OP_WRITE, fd, slot.buffer.data() + slot.done, slot.readDone - slot.done, slot.offset + slot.done, uint64_t(idx) << 1);
+                slot.writeSubmitted = true;
+            }
+            else if (slot.readDone < slot.length) {
+                reserveEntries(1);
+                prepareRw(queue.prepare(), IORING_OP_READ, slot.srcFd, slot.buffer.data() + slot.readDone, slot.length - slot.readDone, slot.srcOffset + slot.readDone, (uint64_t(idx) << 1) | 1);
+                slot.readSubmitted = true;
+            }
+            else
+                return false;
+        }
+        else {
+            const char *op = (mode == Read ? "read" : "write");
+            TdmSyncAssertF(slot.result >= 0, "io_uring %s at %lld failed: %s", op, (long long)slot.offset, strerror(-slot.result));
+            TdmSyncAssertF(slot.result > 0 || slot.done == slot.length, "io_uring %s at %lld: %d bytes done instead of %d", op, (long long)slot.offset, (int)slot.done, (int)slot.length);
+            slot.done += slot.result;
+            slot.result = 0;
+            if (slot.done >= slot.length)
+                return false;
+            reserveEntries(1);
+            int opcode = (mode == Read ? IORING_OP_READ : IORING_OP_WRITE);
+            prepareRw(queue.prepare(), opcode, fd, slot.buffer.data() + slot.done, slot.length - slot.done, slot.offset + slot.done, uint64_t(idx) << 1);
+        }
+        slot.pending = 1;
+        queue.submit(false);
+        return true;
+    }
+
+    //wait until all data of the slot is read/written (throws on error)
+    void completeSlot(int idx) {
+        do {
+            waitSlot(idx);
+        } while (continueSlot(idx));
+    }
+
+    //make sure that there is space for "count" submission entries
+    void reserveEntries(unsigned count) {
+        if (queue.freeEntries() < count)
+            queue.submit(false);
+        TdmSyncAssert(queue.freeEntries() >= count);
+    }
+
+    void prepareRw(io_uring_sqe *sqe, int op, int file, void *buffer, size_t length, uint64_t offset, uint64_t userData) {
+        sqe->opcode = op;
+        sqe->fd = file;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = (unsigned)length;
+        sqe->off = offset;
+        sqe->user_data = userData;
+    }
+
+    //reading: wait for all requests and forget their data
+    void dropWindow() {
+        for (int idx : window) {
+            waitSlot(idx);
+            freeSlots.push_back(idx);
+        }
+        window.clear();
+    }
+
+    //reading: submit reads of chunks following the window (starting from "chunkStart" if window is empty)
+    void fillWindow(uint64_t chunkStart) {
+        bool added = false;
+        while (!freeSlots.empty()) {
+            uint64_t next = window.empty() ? chunkStart : slots[window.back()].offset + ChunkSize;
+            if (next >= fileSize)
+                break;
+            int idx = freeSlots.back();
+            freeSlots.pop_back();
+            Slot &slot = slots[idx];
+            slot.offset = next;
+            slot.length = size_t(std::min(uint64_t(ChunkSize), fileSize - next));
+            slot.pending = 1;
+            slot.result = slot.linkedResult = 0;
+            slot.done = 0;
+            reserveEntries(1);
+            prepareRw(queue.prepare(), IORING_OP_READ, fd, slot.buffer.data(), slot.length, slot.offset, uint64_t(idx) << 1);
+            window.push_back(idx);
+            added = true;
+        }
+        if (added)
+            queue.submit(false);
+    }
+
+    //writing: get free slot, waiting for the oldest request if necessary
+    int acquireSlot() {
+        if (freeSlots.empty()) {
+            TdmSyncAssert(!window.empty());
+            int idx = window.front();
+            window.pop_front();
+            completeSlot(idx);
+            freeSlots.push_back(idx);
+        }
+        int idx = freeSlots.back();
+        freeSlots.pop_back();
+        Slot &slot = slots[idx];
+        slot.pending = 0;
+        slot.result = slot.linkedResult = 0;
+        slot.length = slot.done = slot.readDone = 0;
+        slot.linked = slot.readSubmitted = slot.writeSubmitted = false;
+        return idx;
+    }
+
+    //writing: submit accumulated data of current slot
+    void submitCurrent() {
+        if (current < 0)
+            return;
+        Slot &slot = slots[current];
+        slot.pending = 1;
+        reserveEntries(1);
+        prepareRw(queue.prepare(), IORING_OP_WRITE, fd, slot.buffer.data(), slot.length, slot.offset, uint64_t(current) << 1);
+        queue.submit(false);
+        window.push_back(current);
+        current = -1;
+    }
+
+    //writing: wait until everything is written
+    void drain() {
+        submitCurrent();
+        while (!window.empty()) {
+            int idx = window.front();
+            window.pop_front();
+            freeSlots.push_back(idx);
+            completeSlot(idx);
+        }
+    }
+};
+
+static bool checkUringSupport() {
+    UringQueue queue;
+    if (!queue.init(4))
+        return false;
+    //IORING_OP_READ/WRITE appeared in Linux 5.6: check them with probe
+    //note: probe itself appeared in 5.6 too, so failure means old kernel
+    static const int MaxOps = 64;
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + MaxOps * sizeof(io_uring_probe_op), 0);
+    int res = (int)syscall(__NR_io_uring_register, queue.fd, IORING_REGISTER_PROBE, buffer.data(), MaxOps);
+    if (res < 0)
+        return false;
+    const io_uring_probe &probe = *(const io_uring_probe*)buffer.data();
+    for (int op : {IORING_OP_READ, IORING_OP_WRITE})
+        if (op > probe.last_op || !(probe.ops[op].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    return true;
+}
+
+bool UringFile::isSupported() {
+    static bool supported = checkUringSupport();
+    return supported;
+}
+
+UringFile::UringFile() {}
+UringFile::~UringFile() {
+    //note: buffers must not be freed while kernel is using them
+    try {
+        close();
+    }
+    catch(...) {}
+}
+
+void UringFile::open(const char *filename, OpenMode mode) {
+    close();
+    TdmSyncAssertF(isSupported(), "io_uring is not supported");
+    std::unique_ptr<Impl> res(new Impl());
+    res->mode = mode;
+    res->fd = ::open(filename, mode == Read ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    TdmSyncAssertF(res->fd >= 0, "Failed to open file %s for %s", filename, mode == Read ? "reading" : "writing");
+    if (mode == Read) {
+        struct stat st;
+        fstat(res->fd, &st);
+        res->fileSize = st.st_size;
+    }
+    //every slot may need two entries (linked read+write)
+    int depth = (mode == Read ? Impl::ReadDepth : Impl::WriteDepth);
+    bool ok = res->queue.init(2 * depth);
+    if (!ok)
+        ::close(res->fd);
+    TdmSyncAssertF(ok, "Failed to create io_uring for file %s", filename);
+    res->slots.resize(depth);
+    for (int i = depth - 1; i >= 0; i--) {
+        res->slots[i].buffer.resize(Impl::ChunkSize);
+        res->freeSlots.push_back(i);
+    }
+    impl = std::move(res);
+}
+
+void UringFile::close() {
+    if (!impl)
+        return;
+    std::unique_ptr<Impl> old = std::move(impl);
+    if (old->mode == Read)
+        old->dropWindow();
+    else {
+        //note: even if some write failed, all requests must be completed before buffers are freed
+        try {
+            old->drain();
+        }
+        catch(...) {
+            for (int idx : old->window)
+                old->waitSlot(idx);
+            ::close(old->fd);
+            throw;
+        }
+    }
+    ::close(old->fd);
+}
+
+void UringFile::read(void* data, size_t size) {
+    TdmSyncAssert(impl && impl->mode == Read);
+    Impl &im = *impl;
+    TdmSyncAssert(im.pos + size <= im.fileSize);
+    uint8_t *ptr = (uint8_t*)data;
+    while (size > 0) {
+        uint64_t chunkStart = im.pos / Impl::ChunkSize * Impl::ChunkSize;
+        //forget chunks before current position (skipped forward), or everything if position is outside of window
+        while (!im.window.empty() && im.slots[im.window.front()].offset < chunkStart) {
+            int idx = im.window.front();
+            im.window.pop_front();
+            im.waitSlot(idx);
+            im.freeSlots.push_back(idx);
+        }
+        if (!im.window.empty() && im.slots[im.window.front()].offset != chunkStart)
+            im.dropWindow();
+        im.fillWindow(chunkStart);
+
+        Impl::Slot &slot = im.slots[im.window.front()];
+        im.completeSlot(im.window.front());
+        size_t avail = size_t(slot.offset + slot.length - im.pos);
+        size_t chunk = std::min(avail, size);
+        memcpy(ptr, slot.buffer.data() + (im.pos - slot.offset), chunk);
+        ptr += chunk;
+        size -= chunk;
+        im.pos += chunk;
+    }
+}
+
+void UringFile::write(const void* data, size_t size) {
+    TdmSyncAssert(impl && impl->mode == Write);
+    Impl &im = *impl;
+    const uint8_t *ptr = (const uint8_t*)data;
+    while (size > 0) {
+        if (im.current >= 0) {
+            const Impl::Slot &slot = im.slots[im.current];
+            if (slot.offset + slot.length != im.pos || slot.length == Impl::ChunkSize)
+                im.submitCurrent();
+        }
+        if (im.current < 0) {
+            im.current = im.acquireSlot();
+            im.slots[im.current].offset = im.pos;
+        }
+        Impl::Slot &slot = im.slots[im.current];
+        size_t chunk = std::min(Impl::ChunkSize - slot.length, size);
+        memcpy(slot.buffer.data() + slot.length, ptr, chunk);
+        slot.length += chunk;
+        ptr += chunk;
+        size -= chunk;
+        im.pos += chunk;
+    }
+}
+
+void UringFile::seek(uint64_t pos) {
+    TdmSyncAssert(impl);
+    impl->pos = pos;
+}
+
+uint64_t UringFile::tell() {
+    TdmSyncAssert(impl);
+    return impl->pos;
+}
+
+uint64_t UringFile::getSize() {
+    TdmSyncAssert(impl);
+    if (impl->mode == Read)
+        return impl->fileSize;
+    impl->drain();
+    struct stat st;
+    fstat(impl->fd, &st);
+    return st.st_size;
+}
+
+void UringFile::flush() {
+    TdmSyncAssert(impl);
+    if (impl->mode == Write)
+        impl->drain();
+}
+
+void UringFile::truncate(uint64_t size) {
+    TdmSyncAssert(impl && impl->mode == Write);
+    impl->drain();
+    int err = ftruncate(impl->fd, size);
+    TdmSyncAssertF(err == 0, "Failed to change file size to %lld", (long long)size);
+}
+
+void UringFile::preallocate(uint64_t size) {
+    TdmSyncAssert(impl && impl->mode == Write);
+    //note: failure is not an error (e.g. filesystem does not support it)
+    if (size > 0)
+        fallocate(impl->fd, 0, 0, size);
+}
+
+bool UringFile::copyRangeFrom(BaseFile &src, uint64_t srcPos, uint64_t dstPos, uint64_t size) {
+    TdmSyncAssert(impl && impl->mode == Write);
+    UringFile *srcUring = dynamic_cast<UringFile*>(&src);
+    if (!srcUring || !srcUring->impl || srcUring->impl->mode != Read)
+        return false;
+    Impl &im = *impl;
+    int srcFd = srcUring->impl->fd;
+    im.submitCurrent();
+    //every piece is read into slot buffer and written from it by a linked pair of requests
+    //note: pairs are submitted in batches, completions are processed only when slots are needed
+    for (uint64_t done = 0; done < size; ) {
+        int idx = im.acquireSlot();
+        Impl::Slot &slot = im.slots[idx];
+        slot.offset = dstPos + done;
+        slot.length = size_t(std::min(uint64_t(Impl::ChunkSize), size - done));
+        slot.pending = 2;
+        slot.linked = true;
+        slot.srcFd = srcFd;
+        slot.srcOffset = srcPos + done;
+        slot.readSubmitted = slot.writeSubmitted = true;
+        im.reserveEntries(2);
+        io_uring_sqe *rd = im.queue.prepare();
+        im.prepareRw(rd, IORING_OP_READ, srcFd, slot.buffer.data(), slot.length, slot.srcOffset, (uint64_t(idx) << 1) | 1);
+        rd->flags |= IOSQE_IO_LINK;
+        im.prepareRw(im.queue.prepare(), IORING_OP_WRITE, im.fd, slot.buffer.data(), slot.length, slot.offset, uint64_t(idx) << 1);
+        im.window.push_back(idx);
+        done += slot.length;
+    }
+    im.queue.submit(false);
+    return true;
+}
+
+#else
+
+//io_uring is not available on this platform
+
+struct UringFile::Impl {};
+bool UringFile::isSupported() { return false; }
+UringFile::UringFile() {}
+UringFile::~UringFile() {}
+void UringFile::open(const char *filename, OpenMode mode) { TdmSyncAssertF(false, "io_uring is not supported"); }
+void UringFile::close() {}
+void UringFile::read(void* data, size_t size) { TdmSyncAssert(false); }
+void UringFile::write(const void* data, size_t size) { TdmSyncAssert(false); }
+void UringFile::seek(uint64_t pos) { TdmSyncAssert(false); }
+uint64_t UringFile::tell() { TdmSyncAssert(false); return 0; }
+uint64_t UringFile::getSize() { TdmSyncAssert(false); return 0; }
+void UringFile::flush() { TdmSyncAssert(false); }
+void UringFile::truncate(uint64_t size) { TdmSyncAssert(false); }
+void UringFile::preallocate(uint64_t size) { TdmSyncAssert(false); }
+bool UringFile::copyRangeFrom(BaseFile &src, uint64_t srcPos, uint64_t dstPos, uint64_t size) { return false; }
+
+#endif
+
+}
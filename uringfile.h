@@ -0,0 +1,44 @@
+#ifndef _TDM_SYNC_URINGFILE_H_613094_
+#define _TDM_SYNC_URINGFILE_H_613094_
+
+#include "fileio.h"
+#include <memory>
+
+namespace TdmSync {
+
+//file I/O based on io_uring (Linux 5.6+), done via raw syscalls (liburing is not needed)
+//reading: several chunks ahead of current position are being read asynchronously,
+//  so sequential reader (e.g. scan or prepare) does not wait for disk while it processes data
+//writing: data is written in background, flush waits for all writes
+//copyRangeFrom another UringFile submits linked read+write pairs, many of them are in flight at once
+//note: use isSupported to check if it works, otherwise fall back to StdioFile
+class UringFile : public BaseFile {
+public:
+    UringFile();
+    ~UringFile();
+
+    //returns false if io_uring is not available (e.g. other OS, old kernel, disabled by sysctl)
+    static bool isSupported();
+
+    enum OpenMode { Read, Write };
+    void open(const char *filename, OpenMode mode);
+    void close();
+
+    virtual void read(void* data, size_t size) override;
+    virtual void write(const void* data, size_t size) override;
+    virtual void seek(uint64_t pos) override;
+    virtual uint64_t tell() override;
+    virtual uint64_t getSize() override;
+    virtual void flush() override;
+    virtual void truncate(uint64_t size) override;
+    virtual void preallocate(uint64_t size) override;
+    virtual bool copyRangeFrom(BaseFile &src, uint64_t srcPos, uint64_t dstPos, uint64_t size) override;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}
+
+#endif